@@ -0,0 +1,123 @@
+#include "BRDFKernels.h"
+#include "Light.h"
+#include <algorithm>
+
+using namespace Eigen;
+
+namespace {
+    // The original Phong BRDFs divide by the incoming cosine, so grazing light is cut off.
+    const float grazingCosine = 0.001f;
+
+    constexpr bool IsBlinn(BRDFType type){
+        return type == Obp || type == Mbp || type == Mbpn;
+    }
+
+    constexpr bool IsOriginal(BRDFType type){
+        return type == Op || type == Obp;
+    }
+
+    // Materials without a BRDF scatter indirect light as a Lambertian surface,
+    // as in the path integrator.
+    Vector3f LambertianBRDF(const Vector3f&, const Vector3f&, const ReturnVal&, const Material* mat){
+        return mat->diffuseTerm;
+    }
+
+    // Phong and Blinn-Phong lobes, around the mirror direction or the half vector.
+    template <BRDFType T>
+    Vector3f PhongBRDF(const Vector3f& wi, const Vector3f& wo, const ReturnVal& ret, const Material* mat){
+        float cosAngle;
+        if (IsBlinn(T)){
+            cosAngle = ret.normal.dot((wo + wi).normalized());
+        }
+        else{
+            Vector3f wr = (-wi + ret.normal * (2 * ret.normal.dot(wi))).normalized();
+            cosAngle = wr.dot(wo);
+        }
+        Vector3f specular = mat->specularTerm * BRDFKernels::PowInt(std::max(0.0f, cosAngle), mat->phongExp);
+
+        if (IsOriginal(T)){
+            float cosTheta = std::max(0.0f, wi.dot(ret.normal));
+            if (cosTheta < grazingCosine){
+                return {0, 0, 0};
+            }
+            specular /= cosTheta;
+        }
+        return mat->diffuseTerm + specular;
+    }
+
+    // Blinn distribution with the geometry term of Torrance and Sparrow. Tsf
+    // shares the light between the lobes with the Fresnel reflectance.
+    template <BRDFType T>
+    Vector3f TorranceSparrowBRDF(const Vector3f& wi, const Vector3f& wo, const ReturnVal& ret, const Material* mat){
+        Vector3f wh = (wo + wi).normalized();
+        float cosAlpha = wh.dot(ret.normal);
+        float cosTheta = wi.dot(ret.normal);
+        float cosPhi = wo.dot(ret.normal);
+        float g = Light::GeometryTS(wi, wo, wh, ret);
+        float d = BRDFKernels::PowInt(cosAlpha, mat->phongExp);
+        Vector3f specular = mat->specularTerm * (g * d / (4 * cosPhi * cosTheta));
+
+        if (T == Tsf){
+            float f = Light::Fresnel(mat->refractionIndex, mat->absorptionIndex, -wo, ret.normal);
+            return mat->diffuseTerm * (1 - f) + specular * f;
+        }
+        return mat->diffuseTerm + specular;
+    }
+
+    template <DecalMode D>
+    Vector3f DiffuseKernel(const ReturnVal& ret, const Material* mat){
+        if (D == ReplaceKd){
+            return ret.textureColor / ret.textureNormalizer;
+        }
+        if (D == BlendKd){
+            return (mat->diffuseRef + ret.textureColor / ret.textureNormalizer) * 0.5f;
+        }
+        return mat->diffuseRef;
+    }
+
+    template <DecalMode D>
+    Vector3f PhongKernel(const Vector3f& wi, const Vector3f& wo, const ReturnVal& ret, const Material* mat,
+                         const Vector3f& radiance){
+        float cosTheta = std::max(0.0f, ret.normal.dot(wi));
+        float cosAlpha = std::max(0.0f, ret.normal.dot((wo + wi).normalized()));
+        Vector3f reflectance = DiffuseKernel<D>(ret, mat) * cosTheta +
+                               mat->specularRef * BRDFKernels::PowInt(cosAlpha, mat->phongExp);
+        return radiance.cwiseProduct(reflectance);
+    }
+
+    typedef Vector3f (*DiffuseFunction)(const ReturnVal& ret, const Material* mat);
+    typedef Vector3f (*PhongFunction)(const Vector3f& wi, const Vector3f& wo, const ReturnVal& ret,
+                                      const Material* mat, const Vector3f& radiance);
+
+    // Indexed by BRDFType.
+    const BRDFKernel brdfKernels[] = {
+        LambertianBRDF, PhongBRDF<Obp>, PhongBRDF<Mbp>, PhongBRDF<Mbpn>, PhongBRDF<Op>, PhongBRDF<Mp>,
+        PhongBRDF<Mpn>, TorranceSparrowBRDF<Ts>, TorranceSparrowBRDF<Tsf>
+    };
+
+    // Indexed by DecalMode. Only ReplaceKd and BlendKd change the reflectance.
+    const DiffuseFunction diffuseKernels[] = {
+        DiffuseKernel<ReplaceKd>, DiffuseKernel<BlendKd>, DiffuseKernel<NoDecal>, DiffuseKernel<NoDecal>,
+        DiffuseKernel<NoDecal>, DiffuseKernel<NoDecal>, DiffuseKernel<NoDecal>
+    };
+
+    const PhongFunction phongKernels[] = {
+        PhongKernel<ReplaceKd>, PhongKernel<BlendKd>, PhongKernel<NoDecal>, PhongKernel<NoDecal>,
+        PhongKernel<NoDecal>, PhongKernel<NoDecal>, PhongKernel<NoDecal>
+    };
+}
+
+namespace BRDFKernels{
+    BRDFKernel Select(BRDFType type){
+        return brdfKernels[type];
+    }
+
+    Vector3f Phong(const Vector3f& wi, const Vector3f& wo, const ReturnVal& ret, const Material* mat,
+                   const Vector3f& radiance){
+        return phongKernels[ret.dm](wi, wo, ret, mat, radiance);
+    }
+
+    Vector3f DiffuseColor(const ReturnVal& ret, const Material* mat){
+        return diffuseKernels[ret.dm](ret, mat);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef _BRDFKERNELS_H_
+#define _BRDFKERNELS_H_
+
+#include "defs.h"
+#include "Material.h"
+#include "Eigen/Dense"
+
+// Material evaluation compiled once per BRDF type and once per decal mode. A
+// material takes its BRDF kernel when it is loaded, and Phong shading picks its
+// kernel from the decal mode of the hit, so neither walks the types at every hit.
+namespace BRDFKernels{
+    BRDFKernel Select(BRDFType type);
+
+    // Phong reflection of radiance arriving along wi, for materials without a BRDF.
+    Eigen::Vector3f Phong(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const ReturnVal& ret,
+                          const Material* mat, const Eigen::Vector3f& radiance);
+
+    // Diffuse reflectance of the material at the hit, after the decal mode.
+    Eigen::Vector3f DiffuseColor(const ReturnVal& ret, const Material* mat);
+
+    // x^n by repeated squaring, for the integer exponents of specular lobes.
+    inline float PowInt(float x, int n){
+        bool inverse = n < 0;
+        unsigned int e = inverse ? -n : n;
+        float result = 1;
+        while (e){
+            if (e & 1){
+                result *= x;
+            }
+            x *= x;
+            e >>= 1;
+        }
+        return inverse ? 1 / result : result;
+    }
+}
+
+#endif
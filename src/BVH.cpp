@@ -61,12 +61,29 @@ BVH::BVH(Shape* object){
     ConstructionHelper(0, primitives.size(), 0, root, 0);
 }
 
+BVH::~BVH()
+{
+	DeleteHelper(root);
+}
+
+void BVH::DeleteHelper(BTNode<BBox>* node)
+{
+	if (!node)
+	{
+		return;
+	}
+
+	DeleteHelper(node->left);
+	DeleteHelper(node->right);
+	delete node;
+}
+
 void BVH::ConstructionHelper(int startIndex, int endIndex, int splitType, BTNode<BBox>*& node, int recursionDepth)
 {
 	// Stopping condition.
 	if (startIndex == endIndex - 1 || recursionDepth >= bvhMaxRecursionDepth)
 	{
-		BBox box;
+		BBox box = ComputeBoundingBox(startIndex, endIndex);
 		box.startIndex = startIndex;
 		box.endIndex = endIndex;
 		node = new BTNode<BBox>(box, nullptr, nullptr);
@@ -114,6 +131,20 @@ ReturnVal BVH::FindIntersection(const Ray& ray)
 	return FindIntersectionWithBVH(ray, root);
 }
 
+// Nearest hit of every lane in mask. results and distances hold the nearest hit
+// found so far, and are only replaced by nearer hits.
+void BVH::FindPacketIntersection(const RayPacket& packet, uint64_t mask, ReturnVal* results, float* distances)
+{
+	PacketTraversal(packet, mask, root, results, distances);
+}
+
+thread_local long long BVH::nodeVisits = 0;
+
+long long BVH::NodeVisits()
+{
+	return nodeVisits;
+}
+
 float BVH::FindMedian(int startIndex, int endIndex, int coordinate)
 {
 	std::vector<float> centers;
@@ -143,6 +174,7 @@ ReturnVal BVH::FindIntersectionWithBVH(const Ray& ray, BTNode<BBox>* node)
 		ret.full = false;
 		return ret;
 	}
+	nodeVisits++;
 
 	// Leaf
 	if (!node->left && !node->right)
@@ -167,7 +199,12 @@ ReturnVal BVH::FindIntersectionWithBVH(const Ray& ray, BTNode<BBox>* node)
 				{
 					nearestPoint = returnDistance;
 					nearestRet = ret;
-					nearestRet.matIndex = primitives[i]->matIndex;
+
+					// Instances without a material keep the materials of their base.
+					if (primitives[i]->matIndex != -1)
+					{
+						nearestRet.matIndex = primitives[i]->matIndex;
+					}
 				}
 			}
 		}
@@ -209,6 +246,86 @@ ReturnVal BVH::FindIntersectionWithBVH(const Ray& ray, BTNode<BBox>* node)
 	return ret;
 }
 
+void BVH::PacketTraversal(const RayPacket& packet, uint64_t mask, BTNode<BBox>* node, ReturnVal* results,
+		float* distances)
+{
+	if (!node || !mask)
+	{
+		return;
+	}
+	nodeVisits++;
+
+	// Once the packet has spread out, the remaining rays go on one at a time.
+	if (Packets::LaneCount(mask) < minPacketLanes)
+	{
+		for (uint64_t lanes = mask; lanes; lanes &= lanes - 1)
+		{
+			int lane = Packets::FirstLane(lanes);
+			const Ray& ray = packet.GetRay(lane);
+			ReturnVal ret = FindIntersectionWithBVH(ray, node);
+			float distance = ret.full ? (ret.point - ray.origin).norm() : 0;
+			if (ret.full && distance <= distances[lane])
+			{
+				distances[lane] = distance;
+				results[lane] = ret;
+			}
+		}
+		return;
+	}
+
+	// Ties go the same way as in FindIntersectionWithBVH: the first primitive of a
+	// leaf wins, and between subtrees the one visited later wins.
+	if (!node->left && !node->right)
+	{
+		ReturnVal hits[packetSize];
+		ReturnVal leafHits[packetSize];
+		float leafDistances[packetSize];
+		uint64_t leafMask = 0;
+		for (int i = node->data.startIndex; i < node->data.endIndex; i++)
+		{
+			uint64_t hitMask = primitives[i]->bvhPacketIntersect(packet, mask, textures, textureOffset, hits);
+			for (uint64_t lanes = hitMask; lanes; lanes &= lanes - 1)
+			{
+				int lane = Packets::FirstLane(lanes);
+				uint64_t bit = 1ull << lane;
+				float distance = (hits[lane].point - packet.GetRay(lane).origin).norm();
+				if (!(leafMask & bit) || distance < leafDistances[lane])
+				{
+					leafMask |= bit;
+					leafDistances[lane] = distance;
+					leafHits[lane] = hits[lane];
+
+					// Instances without a material keep the materials of their base.
+					if (primitives[i]->matIndex != -1)
+					{
+						leafHits[lane].matIndex = primitives[i]->matIndex;
+					}
+				}
+			}
+		}
+
+		for (uint64_t lanes = leafMask; lanes; lanes &= lanes - 1)
+		{
+			int lane = Packets::FirstLane(lanes);
+			if (leafDistances[lane] <= distances[lane])
+			{
+				distances[lane] = leafDistances[lane];
+				results[lane] = leafHits[lane];
+			}
+		}
+		return;
+	}
+
+	if (packet.FrustumMisses(node->data))
+	{
+		return;
+	}
+
+	uint64_t hitMask = packet.BoxMask(node->data, mask);
+	PacketTraversal(packet, hitMask, node->left, results, distances);
+	PacketTraversal(packet, hitMask, node->right, results, distances);
+}
+
 bool BVH::RayBBoxIntersection(const Ray& ray, BBox box)
 {
 	float tx_e;
@@ -327,6 +444,16 @@ BTNode<BBox>* BVH::GetRoot()
 	return root;
 }
 
+BBox BVH::GetBoundingBox()
+{
+	if (!root)
+	{
+		return ComputeBoundingBox(0, 0);
+	}
+
+	return root->data;
+}
+
 void BVH::DebugBVH()
 {
 
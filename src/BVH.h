@@ -3,6 +3,7 @@
 
 #include "BTNode.h"
 #include "Shape.h"
+#include "Packet.h"
 #include <iostream>
 
 class BVH
@@ -10,12 +11,21 @@ class BVH
 public:
 
 	ReturnVal FindIntersection(const Ray& ray);
+	void FindPacketIntersection(const RayPacket& packet, uint64_t mask, ReturnVal* results, float* distances);
 	BTNode<BBox>* GetRoot();
+	BBox GetBoundingBox();
 	void DebugBVH();
 	BVH();
 	BVH(Shape* object);
+	~BVH();
+
+	// Nodes visited so far by the calling thread, in all BVHs. A packet visiting
+	// a node counts once.
+	static long long NodeVisits();
 
 private:
+	static thread_local long long nodeVisits;
+
     std::vector<int> textures;
     int textureOffset;
 	std::vector<Shape *> primitives;
@@ -23,8 +33,11 @@ private:
 	int bvhMaxRecursionDepth;
 
 	ReturnVal FindIntersectionWithBVH(const Ray& ray, BTNode<BBox>* node);
+	void PacketTraversal(const RayPacket& packet, uint64_t mask, BTNode<BBox>* node, ReturnVal* results,
+			float* distances);
 	bool RayBBoxIntersection(const Ray& ray, BBox box);
 	void ConstructionHelper(int startIndex, int endIndex, int splitType, BTNode<BBox>*& node, int recursionDepth);
+	void DeleteHelper(BTNode<BBox>* node);
 	BBox ComputeBoundingBox(int startIndex, int endIndex);
 	BBox MergeBBoxes(BBox boxOne, BBox boxTwo);
 	Eigen::Vector3f FindMinPointOfTwo(Eigen::Vector3f v1, Eigen::Vector3f v2);
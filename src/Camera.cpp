@@ -18,15 +18,6 @@ Camera::Camera(int id,                      // Id of the camera
 {
 	this->id = id;
 
-	int i = 1;
-	while (i < 1000){
-	    if (i*i >= sampleCount){
-	        this->sampleCount = i;
-	        break;
-	    }
-	    i++;
-	}
-
 	this->imgPlane = imgPlane;
 	strcpy(this->imageName, imageName);
 
@@ -48,16 +39,17 @@ Camera::Camera(int id,                      // Id of the camera
 	pixelWidth = (this->imgPlane.right - this->imgPlane.left) * nxDivisionAvoided;
 	pixelHeight = (this->imgPlane.top - this->imgPlane.bottom) * nyDivisionAvoided;
 
-	sampleWidth = pixelWidth / this->sampleCount;
-	sampleHeight = pixelHeight / this->sampleCount;
 	totalSampleCount = sampleCount;
 
 	this->isDof = isDof;
 	this->focusDistance = focusDistance;
 	this->apertureSize = apertureSize;
 
-	mt = std::mt19937 (rd());
-	dist = std::uniform_real_distribution<float>(0.0, 1.0);
+	adaptive.enabled = false;
+	adaptive.minSamples = 16;
+	adaptive.threshold = 0.01f;
+	adaptive.countImageName[0] = '\0';
+
 }
 
 Ray Camera::getPrimaryRay(int col, int row) const
@@ -91,23 +83,21 @@ Vector3f Camera::PixelLBCorner(int row, int col) const {
     return m;
 }
 
-Ray Camera::getSampleRay(Eigen::Vector3f &lbCorner, int sampleIndex){
-    int i = sampleIndex % sampleCount;
-    int j = sampleIndex / sampleCount;
-
-    float xChi = dist(mt);
-    float yChi = dist(mt);
+Ray Camera::getSampleRay(Eigen::Vector3f &lbCorner, SamplerContext& sampler) const {
+    // The sampler decides how positions are spread over the pixel.
+    float xChi = sampler.Get(PixelX);
+    float yChi = sampler.Get(PixelY);
 
     Vector3f m = lbCorner;
-    m += (i + xChi) * sampleWidth * right;
-    m += (j + yChi) * sampleHeight * up;
+    m += xChi * pixelWidth * right;
+    m += yChi * pixelHeight * up;
 
     Ray ray(pos, (m - pos) / ((m - pos).norm()), 0);
     if (isDof){
-        return AddDepthOfField(m, ray);
+        ray = AddDepthOfField(m, ray, sampler);
     }
 
-    float rayTime = dist(mt);
+    float rayTime = sampler.Get(Time);
     ray.SetTime(rayTime);
     return ray;
 }
@@ -116,14 +106,14 @@ int Camera::GetTotalSampleCount() {
     return totalSampleCount;
 }
 
-Ray Camera::AddDepthOfField(Vector3f &s, Ray &r){
+Ray Camera::AddDepthOfField(Vector3f &s, Ray &r, SamplerContext& sampler) const {
     Vector3f q = pos;
     Vector3f p;
     Vector3f dir;
     float t_fd;
 
-    float xChi = dist(mt) - 0.5f;
-    float yChi = dist(mt) - 0.5f;
+    float xChi = sampler.Get(LensU) - 0.5f;
+    float yChi = sampler.Get(LensV) - 0.5f;
 
     // q is a random point on camera.
     q += apertureSize * xChi * right;
@@ -3,7 +3,17 @@
 
 #include "Ray.h"
 #include "defs.h"
-#include <random>
+#include "Sampler.h"
+
+// Per-pixel adaptive sampling. NumSamples becomes the cap; an empty
+// countImageName means no sample count image is written.
+typedef struct AdaptiveSampling
+{
+	bool enabled;
+	int minSamples;
+	float threshold;
+	char countImageName[64];
+} AdaptiveSampling;
 
 typedef struct ImagePlane
 {
@@ -22,6 +32,7 @@ public:
 	char imageName[64];
 	int id;
 	ImagePlane imgPlane;     // Image plane
+	AdaptiveSampling adaptive;
 
 	Camera(int id,                      // Id of the camera
 	        int sampleCount,
@@ -39,15 +50,11 @@ public:
 	Ray getPrimaryRay(int row, int col) const;
 	Eigen::Vector3f PixelCenterOnImagePlane(int row, int col) const;
 	Eigen::Vector3f PixelLBCorner(int row, int col) const;
-	Ray getSampleRay(Eigen::Vector3f &lbCorner, int sampleCount);
-	Ray AddDepthOfField(Eigen::Vector3f &s, Ray &r);
+	Ray getSampleRay(Eigen::Vector3f &lbCorner, SamplerContext& sampler) const;
+	Ray AddDepthOfField(Eigen::Vector3f &s, Ray &r, SamplerContext& sampler) const;
 	int GetTotalSampleCount();
 
 private:
-    std::random_device rd;
-    std::mt19937 mt;
-    std::uniform_real_distribution<float> dist;
-
 	Eigen::Vector3f pos;         // Camera position
 	Eigen::Vector3f gaze;        // Camera gaze direction
 	Eigen::Vector3f up;
@@ -56,9 +63,6 @@ private:
 	float nyDivisionAvoided;
 	float pixelWidth;
 	float pixelHeight;
-	float sampleWidth;
-	float sampleHeight;
-	int sampleCount;
 	int totalSampleCount;
 
 	float focusDistance;
@@ -0,0 +1,144 @@
+#include "Distribution.h"
+#include <algorithm>
+
+AliasTable::AliasTable()
+{
+    total = 0;
+}
+
+AliasTable::AliasTable(const std::vector<float>& weights)
+{
+    int size = weights.size();
+    probabilities.resize(size);
+    thresholds.resize(size);
+    aliases.resize(size);
+
+    double sum = 0;
+    for (int i = 0; i < size; i++){
+        sum += std::max(0.0f, weights[i]);
+    }
+    total = sum;
+
+    if (size == 0){
+        return;
+    }
+    for (int i = 0; i < size; i++){
+        probabilities[i] = sum > 0 ? std::max(0.0f, weights[i]) / sum : 1.0f / size;
+    }
+
+    // Split the items into those below and above the average, then let every
+    // small item borrow the rest of its bucket from a large one.
+    std::vector<double> scaled(size);
+    std::vector<int> small, large;
+    for (int i = 0; i < size; i++){
+        scaled[i] = (double)probabilities[i] * size;
+        if (scaled[i] < 1){
+            small.push_back(i);
+        }
+        else{
+            large.push_back(i);
+        }
+    }
+
+    while (!small.empty() && !large.empty()){
+        int s = small.back();
+        int l = large.back();
+        small.pop_back();
+
+        thresholds[s] = scaled[s];
+        aliases[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1){
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Whatever is left is 1 up to rounding.
+    int smallSize = small.size();
+    for (int i = 0; i < smallSize; i++){
+        thresholds[small[i]] = 1;
+        aliases[small[i]] = small[i];
+    }
+    int largeSize = large.size();
+    for (int i = 0; i < largeSize; i++){
+        thresholds[large[i]] = 1;
+        aliases[large[i]] = large[i];
+    }
+}
+
+int AliasTable::Sample(float u, float& remapped) const
+{
+    int size = thresholds.size();
+    float scaled = u * size;
+    int index = std::min((int)scaled, size - 1);
+    float fraction = std::min(scaled - index, 0.99999994f);
+
+    float threshold = thresholds[index];
+    if (fraction < threshold){
+        remapped = fraction / threshold;
+        return index;
+    }
+
+    remapped = std::min((fraction - threshold) / (1 - threshold), 0.99999994f);
+    return aliases[index];
+}
+
+float AliasTable::Probability(int index) const
+{
+    return probabilities[index];
+}
+
+float AliasTable::Total() const
+{
+    return total;
+}
+
+int AliasTable::Size() const
+{
+    return probabilities.size();
+}
+
+Distribution2D::Distribution2D()
+{
+    width = 0;
+    height = 0;
+}
+
+Distribution2D::Distribution2D(const std::vector<float>& weights, int width, int height)
+{
+    this->width = width;
+    this->height = height;
+
+    std::vector<float> rowWeights(height);
+    columns.reserve(height);
+    for (int j = 0; j < height; j++){
+        std::vector<float> row(weights.begin() + j * width, weights.begin() + (j + 1) * width);
+        columns.push_back(AliasTable(row));
+        rowWeights[j] = columns[j].Total();
+    }
+    rows = AliasTable(rowWeights);
+}
+
+Eigen::Vector2f Distribution2D::Sample(float u, float v, float& pdf) const
+{
+    float remappedV;
+    int row = rows.Sample(v, remappedV);
+    float remappedU;
+    int column = columns[row].Sample(u, remappedU);
+
+    pdf = rows.Probability(row) * columns[row].Probability(column) * width * height;
+    return {(column + remappedU) / width, (row + remappedV) / height};
+}
+
+float Distribution2D::Pdf(const Eigen::Vector2f& point) const
+{
+    int column = std::max(0, std::min((int)(point[0] * width), width - 1));
+    int row = std::max(0, std::min((int)(point[1] * height), height - 1));
+    return rows.Probability(row) * columns[row].Probability(column) * width * height;
+}
+
+float Distribution2D::Total() const
+{
+    return rows.Total();
+}
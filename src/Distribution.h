@@ -0,0 +1,48 @@
+#ifndef _DISTRIBUTION_H_
+#define _DISTRIBUTION_H_
+
+#include "Eigen/Dense"
+#include <vector>
+
+// Discrete distribution over weighted items (Vose's alias method). Sample()
+// costs O(1) regardless of the number of items.
+class AliasTable
+{
+public:
+    AliasTable();
+    AliasTable(const std::vector<float>& weights);
+
+    // Picks an item with one uniform number. The part of u that was not needed
+    // for the choice is returned in remapped, again uniform in [0, 1).
+    int Sample(float u, float& remapped) const;
+    float Probability(int index) const;
+    float Total() const;
+    int Size() const;
+
+private:
+    std::vector<float> probabilities;
+    std::vector<float> thresholds;
+    std::vector<int> aliases;
+    float total;
+};
+
+// Piecewise constant distribution over [0, 1)^2, given as width x height
+// weights stored row by row. Rows are picked first, then a column in that row.
+class Distribution2D
+{
+public:
+    Distribution2D();
+    Distribution2D(const std::vector<float>& weights, int width, int height);
+
+    // Returns a point with density pdf, with respect to area in [0, 1)^2.
+    Eigen::Vector2f Sample(float u, float v, float& pdf) const;
+    float Pdf(const Eigen::Vector2f& point) const;
+    float Total() const;
+
+private:
+    int width, height;
+    AliasTable rows;
+    std::vector<AliasTable> columns;
+};
+
+#endif
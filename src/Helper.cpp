@@ -1,6 +1,13 @@
 #include "Helper.h"
 #include "BVH.h"
 #include "Instance.h"
+#include <algorithm>
+#include <limits>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
@@ -15,68 +22,96 @@ namespace BVHMethods{
         return false;
     }
 
-    ReturnVal FindIntersection(const Ray &ray, std::vector<Shape*> &objects, std::vector<Instance*> &instances){
-        Ray transformedRay(0);
-        ReturnVal ret;
-        ReturnVal nearestRet = {};
-        float nearestDistance = std::numeric_limits<float>::max();
-        float distance = 0;
-        glm::mat4 inverseTransformations;
-        glm::mat4 inverseTranspose;
-        glm::vec3 blur;
-
-        if (isNaN(ray.origin) || isNaN(ray.direction)){
-            return nearestRet;
-        }
+    // The object wrappers are added to wrappers, which owns them.
+    Group* BuildTopLevel(std::vector<Shape*> &objects, std::vector<Instance*> &instances,
+            std::vector<Instance*> &wrappers){
+        std::vector<Instance*> members;
+        std::vector<Transformation*> noTransformations;
 
+        // Objects are wrapped into instances so that their world space bounds,
+        // including motion, go into the same BVH as the instances.
         int objectSize = objects.size();
         for (int i = 0; i < objectSize; i++){
-            inverseTransformations = *objects[i]->inverse_tMatrix;
-            blur = objects[i]->blurTransformation;
-
-            transformedRay = Transforming::TransformRay(ray, inverseTransformations, blur);
-            ret = objects[i]->bvh->FindIntersection(transformedRay);
-            if (ret.full)
-            {
-                distance = transformedRay.gett(ret.point);
-
-                if (distance < nearestDistance && distance > 0)
-                {
-                    nearestDistance = distance;
-                    inverseTranspose = *objects[i]->inverseTranspose_tMatrix;
-                    ret.point = ray.getPoint(distance);
-                    nearestRet = ret;
-                }
-            }
+            Instance* wrapper = new Instance(objects[i]->id, objects[i], nullptr, -1, true, noTransformations,
+                    objects[i]->motion);
+            wrapper->model = *objects[i]->transformationMatrix;
+            wrapper->inverseModel = *objects[i]->inverse_tMatrix;
+            wrapper->inverseTransposeModel = *objects[i]->inverseTranspose_tMatrix;
+            wrapper->ComputeBounds();
+            members.push_back(wrapper);
+            wrappers.push_back(wrapper);
         }
 
         int instanceSize = instances.size();
         for (int i = 0; i < instanceSize; i++){
-            inverseTransformations = *instances[i]->inverse_tMatrix;
-            blur = instances[i]->blurTransformation;
-
-            transformedRay = Transforming::TransformRay(ray, inverseTransformations, blur);
-            ret = instances[i]->baseMesh->bvh->FindIntersection(transformedRay);
-            if (ret.full)
-            {
-                distance = transformedRay.gett(ret.point);
-
-                if (distance < nearestDistance && distance > 0)
-                {
-                    nearestDistance = distance;
-                    inverseTranspose = *instances[i]->inverseTranspose_tMatrix;
-                    ret.matIndex = instances[i]->matIndex;
-                    ret.point = ray.getPoint(distance);
-                    nearestRet = ret;
-                }
+            instances[i]->ComputeBounds();
+            members.push_back(instances[i]);
+        }
+
+        Group* topLevel = new Group(0, members, noTransformations);
+        topLevel->bvh = new BVH(topLevel);
+        return topLevel;
+    }
+
+    ReturnVal FindIntersection(const Ray &ray, Group* topLevel){
+        if (isNaN(ray.origin) || isNaN(ray.direction)){
+            return ReturnVal{};
+        }
+
+        return topLevel->intersect(ray);
+    }
+
+    // Nearest hit of every ray in the packet. Lanes with NaN rays miss, as in FindIntersection.
+    void FindPacketIntersection(const RayPacket& packet, Group* topLevel, ReturnVal* results){
+        uint64_t mask = 0;
+        float distances[packetSize];
+        for (int i = 0; i < packet.Size(); i++){
+            results[i] = ReturnVal{};
+            distances[i] = std::numeric_limits<float>::max();
+            const Ray& ray = packet.GetRay(i);
+            if (!isNaN(ray.origin) && !isNaN(ray.direction)){
+                mask |= 1ull << i;
+            }
+        }
+
+        topLevel->bvh->FindPacketIntersection(packet, mask, results, distances);
+    }
+
+    // Direction octant in the top 3 bits, then the Morton code of the origin on a
+    // 512^3 grid over bounds. Rays with close keys tend to visit the same BVH nodes.
+    uint32_t CoherenceKey(const Ray& ray, const BBox& bounds){
+        uint32_t octant = (ray.direction[0] < 0 ? 1u : 0u) | (ray.direction[1] < 0 ? 2u : 0u) |
+                          (ray.direction[2] < 0 ? 4u : 0u);
+
+        uint32_t code = 0;
+        for (int axis = 0; axis < 3; axis++){
+            float extent = bounds.maxPoint[axis] - bounds.minPoint[axis];
+            float t = extent > 0 ? (ray.origin[axis] - bounds.minPoint[axis]) / extent : 0;
+            if (!(t > 0)){
+                t = 0;
+            }
+            uint32_t cell = std::min(511u, (uint32_t)(std::min(t, 1.0f) * 512));
+            for (int bit = 0; bit < 9; bit++){
+                code |= ((cell >> bit) & 1u) << (3 * bit + axis);
             }
         }
 
-        if (nearestRet.full){
-            nearestRet.normal = Transforming::TransformNormal(nearestRet.normal, inverseTranspose);
+        return (octant << 27) | code;
+    }
+
+    // Indices of keys in increasing key order. Equal keys keep their order.
+    void CoherentOrder(const std::vector<uint32_t>& keys, std::vector<int>& order){
+        int keySize = keys.size();
+        std::vector<uint64_t> sorted(keySize);
+        for (int i = 0; i < keySize; i++){
+            sorted[i] = ((uint64_t)keys[i] << 32) | (uint32_t)i;
         }
+        std::sort(sorted.begin(), sorted.end());
 
-        return nearestRet;
+        order.resize(keySize);
+        for (int i = 0; i < keySize; i++){
+            order[i] = (int)(sorted[i] & 0xffffffffu);
+        }
     }
 }
 
@@ -87,7 +122,7 @@ namespace Transforming{
 
     }
 
-    Eigen::Vector3f TransformPoint(Eigen::Vector3f point, glm::mat4 &tMatrix){
+    Eigen::Vector3f TransformPoint(Eigen::Vector3f point, const glm::mat4 &tMatrix){
         glm::vec4 glmPoint;
         glmPoint = {point[0], point[1], point[2], 1};
 
@@ -97,7 +132,7 @@ namespace Transforming{
         return Eigen::Vector3f{glmTransformedPoint[0], glmTransformedPoint[1], glmTransformedPoint[2]};
     }
 
-    Eigen::Vector3f TransformNormal(Eigen::Vector3f normal, glm::mat4 &tMatrix){
+    Eigen::Vector3f TransformNormal(Eigen::Vector3f normal, const glm::mat4 &tMatrix){
         glm::vec4 glmNormal;
         glmNormal = {normal[0], normal[1], normal[2], 1};
 
@@ -107,14 +142,10 @@ namespace Transforming{
         return Eigen::Vector3f{glmTransformedNormal[0], glmTransformedNormal[1], glmTransformedNormal[2]}.normalized();
     }
 
-    Ray TransformRay(const Ray& ray, glm::mat4 &tMatrix, glm::vec3 &blur){
+    Ray TransformRay(const Ray& ray, const glm::mat4 &tMatrix){
         Ray transformedRay(ray.time);
-        blur = blur * ray.time;
         transformedRay.origin = ray.origin;
         transformedRay.direction = ray.direction;
-        transformedRay.origin[0] -= blur[0];
-        transformedRay.origin[1] -= blur[1];
-        transformedRay.origin[2] -= blur[2];
 
         glm::vec4 glmOrigin;
         glm::vec4 glmDirection;
@@ -132,7 +163,7 @@ namespace Transforming{
         return transformedRay;
     }
 
-    void ComputeObjectTransformations(std::vector<Shape*> &objects, std::vector<Instance*> instances,
+    glm::mat4 ComposeTransformations(const std::vector<Transformation*> &objTransformations,
             std::vector<Transformation*> &translations, std::vector<Transformation*> &scalings,
             std::vector<Transformation*> &rotations, std::vector<Transformation*> &composites){
 
@@ -141,87 +172,93 @@ namespace Transforming{
         glm::vec3 glmCommon;
         Eigen::Vector3f common;
         float angle = 0;
+        glm::mat4 glmModel(1.0);
 
-        int objectSize = objects.size();
-        for (int i = 0; i < objectSize; i++){
-            int transformSize = 0;
-            transformSize = objects[i]->objTransformations.size();
+        int transformSize = objTransformations.size();
+        for (int j = transformSize-1; j >= 0; j--){
+            type = objTransformations[j]->type;
+            transformIndex = objTransformations[j]->id;
+
+            if (type == TransformationType::Translation){
+                common = translations[transformIndex-1]->common;
+                glmCommon = {common[0], common[1], common[2]};
+                glmModel = glm::translate(glmModel, glmCommon);
+            }
+            else if (type == TransformationType::Scaling){
+                common = scalings[transformIndex-1]->common;
+                glmCommon = {common[0], common[1], common[2]};
+                glmModel = glm::scale(glmModel, glmCommon);
+            }
+            else if (type == TransformationType::Rotation){
+                common = rotations[transformIndex-1]->common;
+                glmCommon = {common[0], common[1], common[2]};
+                angle = rotations[transformIndex-1]->angle;
+                glmModel = glm::rotate(glmModel, glm::radians(angle), glmCommon);
+            }
+            else if (type == TransformationType::Composite){
+                glmModel = composites[transformIndex-1]->composite;
+            }
+        }
 
-            objects[i]->transformationMatrix = new glm::mat4(1.0);
-            glm::mat4* glmModel = objects[i]->transformationMatrix;
+        return glmModel;
+    }
 
-            for (int j = transformSize-1; j >= 0; j--){
-                type = objects[i]->objTransformations[j]->type;
-                transformIndex = objects[i]->objTransformations[j]->id;
+    void ComputeInstanceTransformation(Instance* instance, std::vector<Transformation*> &translations,
+            std::vector<Transformation*> &scalings, std::vector<Transformation*> &rotations,
+            std::vector<Transformation*> &composites){
+        glm::mat4 glmModel = ComposeTransformations(instance->objTransformations, translations, scalings,
+                rotations, composites);
 
-                if (type == TransformationType::Translation){
-                    common = translations[transformIndex-1]->common;
-                    glmCommon = {common[0], common[1], common[2]};
-                    *glmModel = glm::translate(*glmModel, glmCommon);
-                }
-                else if (type == TransformationType::Scaling){
-                    common = scalings[transformIndex-1]->common;
-                    glmCommon = {common[0], common[1], common[2]};
-                    *glmModel = glm::scale(*glmModel, glmCommon);
-                }
-                else if (type == TransformationType::Rotation){
-                    common = rotations[transformIndex-1]->common;
-                    glmCommon = {common[0], common[1], common[2]};
-                    angle = rotations[transformIndex-1]->angle;
-                    *glmModel = glm::rotate(*glmModel, glm::radians(angle), glmCommon);
-                }
-                else if (type == TransformationType::Composite){
-                    *glmModel = composites[transformIndex-1]->composite;
-                }
+        // Instances of instances compose onto the referenced instance, which is always computed first.
+        if (!instance->resetTransform){
+            if (instance->baseInstance){
+                glmModel = glmModel * instance->baseInstance->model;
+            }
+            else{
+                glmModel = glmModel * (*instance->base->transformationMatrix);
             }
+        }
+
+        instance->model = glmModel;
+        instance->inverseModel = glm::inverse(glmModel);
+        instance->inverseTransposeModel = glm::inverseTranspose(glmModel);
+    }
+
+    void ComputeShapeTransformation(Shape* shape, std::vector<Transformation*> &translations,
+            std::vector<Transformation*> &scalings, std::vector<Transformation*> &rotations,
+            std::vector<Transformation*> &composites){
+        glm::mat4 glmModel = ComposeTransformations(shape->objTransformations, translations, scalings,
+                rotations, composites);
+
+        shape->transformationMatrix = new glm::mat4(glmModel);
+        shape->inverse_tMatrix = new glm::mat4(glm::inverse(glmModel));
+        shape->inverseTranspose_tMatrix = new glm::mat4(glm::inverseTranspose(glmModel));
+    }
 
-            objects[i]->inverse_tMatrix = new glm::mat4(1.0);
-            *objects[i]->inverse_tMatrix = glm::inverse(*glmModel);
+    void ComputeObjectTransformations(std::vector<Shape*> &objects, std::vector<Group*> &groups,
+            std::vector<Instance*> &instances, std::vector<Transformation*> &translations,
+            std::vector<Transformation*> &scalings, std::vector<Transformation*> &rotations,
+            std::vector<Transformation*> &composites){
 
-            objects[i]->inverseTranspose_tMatrix = new glm::mat4(1.0);
-            *objects[i]->inverseTranspose_tMatrix = glm::inverseTranspose(*glmModel);
+        int objectSize = objects.size();
+        for (int i = 0; i < objectSize; i++){
+            ComputeShapeTransformation(objects[i], translations, scalings, rotations, composites);
         }
 
-        int instanceSize = instances.size();
-        for (int i = 0; i < instanceSize; i++){
-            instances[i]->transformationMatrix = new glm::mat4(1.0);
-            glm::mat4* glmModel = instances[i]->transformationMatrix;
-
-            int transformSize = instances[i]->objTransformations.size();
-            for (int j = transformSize-1; j >= 0; j--){
-                type = instances[i]->objTransformations[j]->type;
-                transformIndex = instances[i]->objTransformations[j]->id;
-
-                if (type == TransformationType::Translation){
-                    common = translations[transformIndex-1]->common;
-                    glmCommon = {common[0], common[1], common[2]};
-                    *glmModel = glm::translate(*glmModel, glmCommon);
-                }
-                else if (type == TransformationType::Scaling){
-                    common = scalings[transformIndex-1]->common;
-                    glmCommon = {common[0], common[1], common[2]};
-                    *glmModel = glm::scale(*glmModel, glmCommon);
-                }
-                else if (type == TransformationType::Rotation){
-                    common = rotations[transformIndex-1]->common;
-                    glmCommon = {common[0], common[1], common[2]};
-                    angle = rotations[transformIndex-1]->angle;
-                    *glmModel = glm::rotate(*glmModel, glm::radians(angle), glmCommon);
-                }
-                else if (type == TransformationType::Composite){
-                    *glmModel = composites[transformIndex-1]->composite;
-                }
-            }
+        // Groups are in parse order, so members only refer to groups computed before them.
+        int groupSize = groups.size();
+        for (int i = 0; i < groupSize; i++){
+            ComputeShapeTransformation(groups[i], translations, scalings, rotations, composites);
 
-            if (!instances[i]->resetTransform){
-                *glmModel = (*glmModel) * (*instances[i]->baseMesh->transformationMatrix);
+            int memberSize = groups[i]->members.size();
+            for (int j = 0; j < memberSize; j++){
+                ComputeInstanceTransformation(groups[i]->members[j], translations, scalings, rotations, composites);
             }
+        }
 
-            instances[i]->inverse_tMatrix = new glm::mat4(1.0);
-            *instances[i]->inverse_tMatrix = glm::inverse(*glmModel);
-
-            instances[i]->inverseTranspose_tMatrix = new glm::mat4(1.0);
-            *instances[i]->inverseTranspose_tMatrix = glm::inverseTranspose(*glmModel);
+        int instanceSize = instances.size();
+        for (int i = 0; i < instanceSize; i++){
+            ComputeInstanceTransformation(instances[i], translations, scalings, rotations, composites);
         }
     }
 }
@@ -340,6 +377,25 @@ namespace GeometryHelpers
 
         return (vector.cross(nonLinear)).normalized();
     }
+
+    // Direction around normal with density cos(theta) / pi.
+    Eigen::Vector3f SampleCosineHemisphere(const Eigen::Vector3f &normal, float u, float v){
+        float radius = sqrt(u);
+        float phi = 2 * M_PI * v;
+        Eigen::Vector3f t = GetOrthonormalUVector(normal);
+        Eigen::Vector3f b = normal.cross(t);
+        float x = radius * std::cos(phi);
+        float y = radius * std::sin(phi);
+        return (t * x + b * y + normal * sqrt(std::max(0.0f, 1 - u))).normalized();
+    }
+
+    // Direction with density 1 / (4 pi).
+    Eigen::Vector3f SampleUniformSphere(float u, float v){
+        float z = 1 - 2 * u;
+        float radius = sqrt(std::max(0.0f, 1 - z * z));
+        float phi = 2 * M_PI * v;
+        return {radius * std::cos(phi), radius * std::sin(phi), z};
+    }
 }
 
 namespace ExrLibrary{
@@ -410,4 +466,82 @@ namespace ExrLibrary{
             return;
         }
     }
-}
\ No newline at end of file
+}
+
+namespace {
+    // CPUs the process may run on, in increasing order. Reads the affinity mask,
+    // which follows taskset and container cpusets, once, before any worker is
+    // pinned. Empty where the mask can not be read.
+    const std::vector<int>& AllowedCpus(){
+        static const std::vector<int> cpus = [](){
+            std::vector<int> allowed;
+#ifdef __linux__
+            cpu_set_t cpuSet;
+            CPU_ZERO(&cpuSet);
+            if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuSet) == 0){
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+                    if (CPU_ISSET(cpu, &cpuSet)){
+                        allowed.push_back(cpu);
+                    }
+                }
+            }
+#endif
+            return allowed;
+        }();
+        return cpus;
+    }
+}
+
+namespace Parser{
+    bool ParseIntegratorType(const std::string& name, IntegratorType& integrator){
+        if (name == "whitted"){
+            integrator = WhittedIntegrator;
+        }
+        else if (name == "path"){
+            integrator = PathIntegrator;
+        }
+        else{
+            return false;
+        }
+
+        return true;
+    }
+}
+
+namespace Threading{
+    int ResolveThreadCount(int requested){
+        // Zero or less means one worker per CPU the process is allowed to use.
+        if (requested > 0){
+            return requested;
+        }
+
+        int allowed = AllowedCpus().size();
+        if (allowed > 0){
+            return allowed;
+        }
+
+        int detected = std::thread::hardware_concurrency();
+        return detected > 0 ? detected : 1;
+    }
+
+    void PinToCore(std::thread& thread, int core){
+#ifdef __linux__
+        // Worker i goes to the i-th allowed CPU, so renders confined to other
+        // CPUs do not all pile onto the lowest numbered ones.
+        const std::vector<int>& cpus = AllowedCpus();
+        if (cpus.empty()){
+            return;
+        }
+
+        int cpu = cpus[core % cpus.size()];
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuSet) != 0){
+            std::cerr << "Could not pin render thread to core " << cpu << "." << std::endl;
+        }
+#else
+        std::cerr << "Thread pinning is not supported on this platform." << std::endl;
+#endif
+    }
+}
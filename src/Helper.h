@@ -1,28 +1,42 @@
 #ifndef _HELPER_H_
 #define _HELPER_H_
 
+#include <cstdint>
 #include <vector>
 #include "Eigen/Dense"
 #include <iostream>
+#include <string>
+#include <thread>
 #include "glm/ext.hpp"
 #include "Shape.h"
 #include "glm/gtx/string_cast.hpp"
 #include "defs.h"
 #include "Instance.h"
+#include "Packet.h"
 
 namespace Transforming{
-    Eigen::Vector3f TransformPoint(Eigen::Vector3f point, glm::mat4 &tMatrix);
-    Ray TransformRay(const Ray& ray, glm::mat4 &tMatrix, glm::vec3 &blur);
-    Eigen::Vector3f TransformNormal(Eigen::Vector3f normal, glm::mat4 &tMatrix);
+    Eigen::Vector3f TransformPoint(Eigen::Vector3f point, const glm::mat4 &tMatrix);
+    Ray TransformRay(const Ray& ray, const glm::mat4 &tMatrix);
+    Eigen::Vector3f TransformNormal(Eigen::Vector3f normal, const glm::mat4 &tMatrix);
 
-    void ComputeObjectTransformations(std::vector<Shape*> &objects, std::vector<Instance*> instances, std::vector<Transformation*> &translations,
-                              std::vector<Transformation*> &scalings, std::vector<Transformation*> &rotations
-            , std::vector<Transformation*> &composites);
+    glm::mat4 ComposeTransformations(const std::vector<Transformation*> &objTransformations,
+            std::vector<Transformation*> &translations, std::vector<Transformation*> &scalings,
+            std::vector<Transformation*> &rotations, std::vector<Transformation*> &composites);
+
+    void ComputeObjectTransformations(std::vector<Shape*> &objects, std::vector<Group*> &groups,
+            std::vector<Instance*> &instances, std::vector<Transformation*> &translations,
+            std::vector<Transformation*> &scalings, std::vector<Transformation*> &rotations,
+            std::vector<Transformation*> &composites);
 }
 
 namespace BVHMethods{
     bool isNaN(Eigen::Vector3f checkVector);
-    ReturnVal FindIntersection(const Ray& ray, std::vector<Shape*> &objects, std::vector<Instance*> &instances);
+    Group* BuildTopLevel(std::vector<Shape*> &objects, std::vector<Instance*> &instances,
+            std::vector<Instance*> &wrappers);
+    ReturnVal FindIntersection(const Ray& ray, Group* topLevel);
+    void FindPacketIntersection(const RayPacket& packet, Group* topLevel, ReturnVal* results);
+    uint32_t CoherenceKey(const Ray& ray, const BBox& bounds);
+    void CoherentOrder(const std::vector<uint32_t>& keys, std::vector<int>& order);
 }
 
 namespace ShapeHelpers
@@ -44,6 +58,8 @@ namespace GeometryHelpers
 {
     int GetAbsSmallestIndex(Eigen::Vector3f &vector);
     Eigen::Vector3f GetOrthonormalUVector(const Eigen::Vector3f &vector);
+    Eigen::Vector3f SampleCosineHemisphere(const Eigen::Vector3f &normal, float u, float v);
+    Eigen::Vector3f SampleUniformSphere(float u, float v);
 }
 
 namespace ExrLibrary{
@@ -51,4 +67,14 @@ namespace ExrLibrary{
     void SaveExr(const char *filename, float* data, int width, int height);
 }
 
+// Shared by the XML parser and the command line.
+namespace Parser{
+    bool ParseIntegratorType(const std::string& name, IntegratorType& integrator);
+}
+
+namespace Threading{
+    int ResolveThreadCount(int requested);
+    void PinToCore(std::thread& thread, int core);
+}
+
 #endif
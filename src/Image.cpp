@@ -13,6 +13,11 @@ Image::Image(int width, int height)
     }*/
 }
 
+Image::~Image()
+{
+    delete[] _data;
+}
+
 void Image::setPixelValue(int col, int row, const Eigen::Vector3f& pixelColor)
 {
     //data[row][col] = color;
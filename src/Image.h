@@ -33,6 +33,7 @@ public:
 	int height;
 
 	Image(int width, int height);
+	~Image();
 
 	void setPixelValue(int col, int row, const Eigen::Vector3f& pixelColor);
 	void saveImage(const char* imageName);
@@ -1,16 +1,245 @@
 #include "Instance.h"
+#include "BVH.h"
+#include "Helper.h"
+#include "Packet.h"
+#include <limits>
 
-Instance::Instance(int id, Shape* baseMesh, int matIndex, bool resetTransform, const std::vector<Transformation*>& transformations,
-                   glm::vec3 &blurTransformation, bool isBlur){
-    this->id = id;
-    this->baseMesh = baseMesh;
-    this->matIndex = matIndex;
+using namespace Eigen;
+
+Instance::Instance(int id, Shape* base, Instance* baseInstance, int matIndex, bool resetTransform,
+                   const std::vector<Transformation*>& transformations, MotionTrack* motion)
+    : Shape(id, matIndex)
+{
+    this->base = base;
+    this->baseInstance = baseInstance;
     this->resetTransform = resetTransform;
     this->objTransformations = transformations;
-    this->blurTransformation = blurTransformation;
-    this->isBlur = isBlur;
+    this->motion = motion;
+    this->bvh = nullptr;
+    this->textureOffset = 0;
 }
 
 Instance::Instance(){
 
-}
\ No newline at end of file
+}
+
+ReturnVal Instance::intersect(const Ray& ray) const
+{
+    glm::mat4 normalMatrix;
+    Ray localRay = ToLocalSpace(ray, normalMatrix);
+
+    ReturnVal ret = base->bvh->FindIntersection(localRay);
+    if (!ToParentSpace(ray, localRay, normalMatrix, ret)){
+        ret.full = false;
+    }
+    return ret;
+}
+
+// Hit of ray with one primitive of the base, as reported by an earlier
+// traversal of this instance. Textures are not looked up.
+ReturnVal Instance::IntersectPrimitive(const Ray& ray, const Shape* primitive) const
+{
+    glm::mat4 normalMatrix;
+    Ray localRay = ToLocalSpace(ray, normalMatrix);
+
+    std::vector<int> noTextures;
+    ReturnVal ret = primitive->bvhIntersect(localRay, noTextures, 0);
+    if (!ToParentSpace(ray, localRay, normalMatrix, ret)){
+        ret.full = false;
+    }
+    return ret;
+}
+
+Ray Instance::ToLocalSpace(const Ray& ray, glm::mat4& normalMatrix) const
+{
+    if (motion){
+        glm::mat4 inverse = inverseModel * motion->EvaluateInverse(ray.time);
+        normalMatrix = glm::transpose(inverse);
+        return Transforming::TransformRay(ray, inverse);
+    }
+
+    normalMatrix = inverseTransposeModel;
+    return Transforming::TransformRay(ray, inverseModel);
+}
+
+// Moves a hit of localRay back to the space of ray. Returns false for no hit.
+bool Instance::ToParentSpace(const Ray& ray, const Ray& localRay, const glm::mat4& normalMatrix, ReturnVal& ret) const
+{
+    if (!ret.full){
+        return false;
+    }
+
+    // Direction is transformed without normalization, so t is the same in both spaces.
+    float t = localRay.gett(ret.point);
+    if (t <= 0){
+        return false;
+    }
+
+    ret.point = ray.getPoint(t);
+    ret.normal = Transforming::TransformNormal(ret.normal, normalMatrix);
+    ret.instance = this;
+    ret.instanceDepth++;
+
+    // Instances without a material keep the materials of their base.
+    if (matIndex != -1){
+        ret.matIndex = matIndex;
+    }
+
+    return true;
+}
+
+uint64_t Instance::bvhPacketIntersect(const RayPacket& packet, uint64_t mask, std::vector<int>& txt, int txtOffset,
+                                      ReturnVal* results) const
+{
+    // Moving instances transform every ray with its own time.
+    if (motion){
+        return Shape::bvhPacketIntersect(packet, mask, txt, txtOffset, results);
+    }
+
+    // An affine transform keeps a common origin common, so the local packet keeps its frustum.
+    RayPacket localPacket;
+    int size = packet.Size();
+    for (int i = 0; i < size; i++){
+        localPacket.Add(Transforming::TransformRay(packet.GetRay(i), inverseModel), packet.GetMaxDistance(i));
+    }
+    localPacket.Prepare();
+
+    float distances[packetSize];
+    for (int i = 0; i < size; i++){
+        results[i].full = false;
+        distances[i] = std::numeric_limits<float>::max();
+    }
+    base->bvh->FindPacketIntersection(localPacket, mask, results, distances);
+
+    uint64_t hits = 0;
+    for (uint64_t lanes = mask; lanes; lanes &= lanes - 1){
+        int lane = Packets::FirstLane(lanes);
+        if (ToParentSpace(packet.GetRay(lane), localPacket.GetRay(lane), inverseTransposeModel, results[lane])){
+            hits |= 1ull << lane;
+        }
+    }
+    return hits;
+}
+
+ReturnVal Instance::bvhIntersect(const Ray& ray, std::vector<int>&, int) const
+{
+    return intersect(ray);
+}
+
+void Instance::FillPrimitives(std::vector<Shape*> &primitives) const
+{
+    primitives.push_back(const_cast<Instance*>(this));
+}
+
+void Instance::ComputeBounds()
+{
+    BBox local = base->bvh->GetBoundingBox();
+    if (motion){
+        bounds = motion->ComputeBounds(local, model);
+        return;
+    }
+
+    Vector3f minPoint = Vector3f::Constant(std::numeric_limits<float>::max());
+    Vector3f maxPoint = Vector3f::Constant(-std::numeric_limits<float>::max());
+
+    // Transform all corners of the base box into parent space.
+    for (int i = 0; i < 8; i++){
+        Vector3f corner = {(i & 1) ? local.maxPoint[0] : local.minPoint[0],
+                           (i & 2) ? local.maxPoint[1] : local.minPoint[1],
+                           (i & 4) ? local.maxPoint[2] : local.minPoint[2]};
+        corner = Transforming::TransformPoint(corner, model);
+        minPoint = minPoint.cwiseMin(corner);
+        maxPoint = maxPoint.cwiseMax(corner);
+    }
+
+    bounds = BBox{minPoint, maxPoint};
+}
+
+BBox Instance::GetBoundingBox() const
+{
+    return bounds;
+}
+
+Eigen::Vector3f Instance::GetCenter() const
+{
+    return (bounds.minPoint + bounds.maxPoint) * 0.5f;
+}
+
+Group::Group(){
+
+}
+
+Group::Group(int id, const std::vector<Instance*>& members, const std::vector<Transformation*>& transformations)
+    : Shape(id, -1)
+{
+    this->members = members;
+    this->objTransformations = transformations;
+    this->bvh = nullptr;
+    this->textureOffset = 0;
+    this->depth = 1;
+
+    int memberSize = members.size();
+    for (int i = 0; i < memberSize; i++){
+        Group* nested = dynamic_cast<Group*>(members[i]->base);
+        if (nested && nested->depth + 1 > depth){
+            depth = nested->depth + 1;
+        }
+    }
+}
+
+ReturnVal Group::intersect(const Ray& ray) const
+{
+    return bvh->FindIntersection(ray);
+}
+
+uint64_t Group::bvhPacketIntersect(const RayPacket& packet, uint64_t mask, std::vector<int>&, int,
+                                   ReturnVal* results) const
+{
+    float distances[packetSize];
+    for (int i = 0; i < packet.Size(); i++){
+        results[i].full = false;
+        distances[i] = std::numeric_limits<float>::max();
+    }
+    bvh->FindPacketIntersection(packet, mask, results, distances);
+
+    uint64_t hits = 0;
+    for (uint64_t lanes = mask; lanes; lanes &= lanes - 1){
+        int lane = Packets::FirstLane(lanes);
+        if (results[lane].full){
+            hits |= 1ull << lane;
+        }
+    }
+    return hits;
+}
+
+ReturnVal Group::bvhIntersect(const Ray& ray, std::vector<int>&, int) const
+{
+    return intersect(ray);
+}
+
+void Group::FillPrimitives(std::vector<Shape*> &primitives) const
+{
+    int memberSize = members.size();
+    for (int i = 0; i < memberSize; i++){
+        primitives.push_back(members[i]);
+    }
+}
+
+void Group::ComputeBounds()
+{
+    int memberSize = members.size();
+    for (int i = 0; i < memberSize; i++){
+        members[i]->ComputeBounds();
+    }
+}
+
+BBox Group::GetBoundingBox() const
+{
+    return bvh->GetBoundingBox();
+}
+
+Eigen::Vector3f Group::GetCenter() const
+{
+    BBox box = GetBoundingBox();
+    return (box.minPoint + box.maxPoint) * 0.5f;
+}
@@ -6,23 +6,61 @@
 #include "Shape.h"
 #include <vector>
 
-class Instance{
+// Groups can contain instances of other groups. Nesting deeper than this is
+// rejected while parsing so that traversal depth stays bounded.
+const int maxGroupDepth = 8;
+
+// An instance places a base shape (a mesh or a group) into its parent space.
+// Instances of instances are flattened: they point at the base of the
+// instance they refer to and compose its transformation.
+class Instance : public Shape{
 public:
-    int id;
-    int matIndex;
     bool resetTransform;
-    bool isBlur;
 
-    glm::vec3 blurTransformation;
-    Shape* baseMesh;
-    glm::mat4* inverse_tMatrix;
-    glm::mat4* inverseTranspose_tMatrix;
-    glm::mat4* transformationMatrix;
-    std::vector<Transformation*> objTransformations;
+    Shape* base;
+    Instance* baseInstance;
+    glm::mat4 model;
+    glm::mat4 inverseModel;
+    glm::mat4 inverseTransposeModel;
+    BBox bounds;
 
     Instance();
-    Instance(int id, Shape* baseMesh, int matIndex, bool resetTransform, const std::vector<Transformation*>& transformations,
-             glm::vec3 &blurTransformation, bool isBlur);
+    Instance(int id, Shape* base, Instance* baseInstance, int matIndex, bool resetTransform,
+             const std::vector<Transformation*>& transformations, MotionTrack* motion);
+
+    ReturnVal bvhIntersect(const Ray& ray, std::vector<int>& txt, int txtOffset) const;
+    ReturnVal intersect(const Ray& ray) const;
+    ReturnVal IntersectPrimitive(const Ray& ray, const Shape* primitive) const;
+    uint64_t bvhPacketIntersect(const RayPacket& packet, uint64_t mask, std::vector<int>& txt, int txtOffset,
+                                ReturnVal* results) const;
+    void FillPrimitives(std::vector<Shape*> &primitives) const;
+    void ComputeBounds();
+    BBox GetBoundingBox() const;
+    Eigen::Vector3f GetCenter() const;
+
+private:
+    Ray ToLocalSpace(const Ray& ray, glm::mat4& normalMatrix) const;
+    bool ToParentSpace(const Ray& ray, const Ray& localRay, const glm::mat4& normalMatrix, ReturnVal& ret) const;
+};
+
+// A group is a set of instances sharing one BVH. Every instance of a group
+// reuses that BVH, so memory grows with unique geometry only.
+class Group : public Shape{
+public:
+    int depth;
+    std::vector<Instance*> members;
+
+    Group();
+    Group(int id, const std::vector<Instance*>& members, const std::vector<Transformation*>& transformations);
+
+    ReturnVal bvhIntersect(const Ray& ray, std::vector<int>& txt, int txtOffset) const;
+    ReturnVal intersect(const Ray& ray) const;
+    uint64_t bvhPacketIntersect(const RayPacket& packet, uint64_t mask, std::vector<int>& txt, int txtOffset,
+                                ReturnVal* results) const;
+    void FillPrimitives(std::vector<Shape*> &primitives) const;
+    void ComputeBounds();
+    BBox GetBoundingBox() const;
+    Eigen::Vector3f GetCenter() const;
 };
 
 #endif
@@ -0,0 +1,162 @@
+#include "IrradianceCache.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+using namespace Eigen;
+
+namespace {
+    // Records are rejected when they lie this far in front of the point, in
+    // units of their radius.
+    const float frontTolerance = 0.05f;
+}
+
+IrradianceCache::IrradianceCache(const BBox& sceneBox, float tolerance)
+{
+    this->tolerance = tolerance;
+    lookups = 0;
+    hits = 0;
+
+    Vector3f extent = sceneBox.maxPoint - sceneBox.minPoint;
+    float diagonal = extent.norm();
+    minSpacing = 0.02f * diagonal;
+    maxSpacing = 0.5f * diagonal;
+
+    Vector3f center = (sceneBox.minPoint + sceneBox.maxPoint) / 2;
+    root = CreateNode(center, std::max(extent.maxCoeff() / 2, 1e-4f));
+}
+
+IrradianceCache::~IrradianceCache()
+{
+    DeleteNode(root);
+}
+
+IrradianceCache::Node* IrradianceCache::CreateNode(const Vector3f& center, float halfSize)
+{
+    Node* node = new Node;
+    node->center = center;
+    node->halfSize = halfSize;
+    std::fill(node->children, node->children + 8, nullptr);
+    return node;
+}
+
+void IrradianceCache::DeleteNode(Node* node)
+{
+    for (Node* child : node->children){
+        if (child){
+            DeleteNode(child);
+        }
+    }
+    delete node;
+}
+
+void IrradianceCache::ClampRecord(IrradianceRecord& record) const
+{
+    record.radius = std::min(std::max(record.radius, minSpacing), maxSpacing);
+
+    for (int c = 0; c < 3; c++){
+        float change = record.translationalGradient.row(c).norm() * record.radius;
+        if (change > record.irradiance[c]){
+            record.translationalGradient.row(c) *= record.irradiance[c] / change;
+        }
+    }
+}
+
+bool IrradianceCache::Lookup(const Vector3f& point, const Vector3f& normal, Vector3f& irradiance)
+{
+    lookups.fetch_add(1, std::memory_order_relaxed);
+
+    Vector3f sum{0, 0, 0};
+    float weightSum = 0;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        Gather(root, point, normal, sum, weightSum);
+    }
+
+    if (weightSum <= 0){
+        return false;
+    }
+
+    hits.fetch_add(1, std::memory_order_relaxed);
+    irradiance = sum / weightSum;
+    return true;
+}
+
+// A node is visited when the point lies in its box grown by half its side,
+// which holds every point a record stored in the node is valid for.
+void IrradianceCache::Gather(const Node* node, const Vector3f& point, const Vector3f& normal, Vector3f& sum,
+                             float& weightSum) const
+{
+    for (int index : node->records){
+        const IrradianceRecord& record = records[index];
+        Vector3f offset = point - record.position;
+
+        float error = offset.norm() / record.radius + std::sqrt(std::max(0.0f, 1 - normal.dot(record.normal)));
+        if (error >= tolerance){
+            continue;
+        }
+        if (offset.dot(normal + record.normal) / 2 < -frontTolerance * record.radius){
+            continue;
+        }
+
+        Vector3f estimate = record.irradiance + record.rotationalGradient * record.normal.cross(normal) +
+                            record.translationalGradient * offset;
+        float weight = 1 / std::max(error, 1e-6f);
+        sum += weight * estimate.cwiseMax(0);
+        weightSum += weight;
+    }
+
+    for (const Node* child : node->children){
+        if (child && ((point - child->center).cwiseAbs().array() <= 2 * child->halfSize).all()){
+            Gather(child, point, normal, sum, weightSum);
+        }
+    }
+}
+
+// A record goes down to the smallest node whose half side still covers the
+// distance it is valid for, tolerance * radius.
+void IrradianceCache::Insert(IrradianceRecord record)
+{
+    float validDistance = tolerance * record.radius;
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex);
+    Node* node = root;
+    while (node->halfSize / 2 >= validDistance){
+        int child = 0;
+        Vector3f center = node->center;
+        float quarter = node->halfSize / 2;
+        for (int axis = 0; axis < 3; axis++){
+            if (record.position[axis] > node->center[axis]){
+                child |= 1 << axis;
+                center[axis] += quarter;
+            }
+            else{
+                center[axis] -= quarter;
+            }
+        }
+
+        if (!node->children[child]){
+            node->children[child] = CreateNode(center, quarter);
+        }
+        node = node->children[child];
+    }
+
+    node->records.push_back(records.size());
+    records.push_back(record);
+}
+
+int IrradianceCache::RecordCount() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex);
+    return records.size();
+}
+
+long long IrradianceCache::LookupCount() const
+{
+    return lookups.load(std::memory_order_relaxed);
+}
+
+long long IrradianceCache::HitCount() const
+{
+    return hits.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef _IRRADIANCECACHE_H_
+#define _IRRADIANCECACHE_H_
+
+#include <atomic>
+#include <shared_mutex>
+#include <vector>
+#include "defs.h"
+#include "Eigen/Dense"
+
+// Indirect irradiance computed at one point. Rows of the gradients belong to
+// the red, green and blue irradiance. radius is the harmonic mean distance to
+// the surfaces seen from the point, which sets how far the record is valid.
+typedef struct IrradianceRecord
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f normal;
+    Eigen::Vector3f irradiance;
+    Eigen::Matrix3f rotationalGradient;
+    Eigen::Matrix3f translationalGradient;
+    float radius;
+} IrradianceRecord;
+
+// Irradiance caching (Ward et al., with the gradients of Ward and Heckbert).
+// Records are kept in an octree, each in the node whose side is at least twice
+// the distance it is valid for, so a lookup only visits nodes near the point.
+// Records are added while rendering: lookups share a lock, inserts take it alone.
+class IrradianceCache
+{
+public:
+    // tolerance is the largest interpolation error allowed, a in Ward's weight.
+    IrradianceCache(const BBox& sceneBox, float tolerance);
+    ~IrradianceCache();
+
+    // Weighted mean of the records valid at point. Returns false if there is none.
+    bool Lookup(const Eigen::Vector3f& point, const Eigen::Vector3f& normal, Eigen::Vector3f& irradiance);
+    void Insert(IrradianceRecord record);
+
+    // Keeps radius within the spacing allowed for records and limits the
+    // translational gradient so that it cannot turn the irradiance negative.
+    void ClampRecord(IrradianceRecord& record) const;
+
+    int RecordCount() const;
+    long long LookupCount() const;
+    long long HitCount() const;
+
+private:
+    typedef struct Node
+    {
+        Eigen::Vector3f center;
+        float halfSize;
+        std::vector<int> records;
+        Node* children[8];
+    } Node;
+
+    std::vector<IrradianceRecord> records;
+    Node* root;
+    float tolerance;
+    float minSpacing;
+    float maxSpacing;
+    mutable std::shared_timed_mutex mutex;
+    std::atomic<long long> lookups;
+    std::atomic<long long> hits;
+
+    Node* CreateNode(const Eigen::Vector3f& center, float halfSize);
+    void DeleteNode(Node* node);
+    void Gather(const Node* node, const Eigen::Vector3f& point, const Eigen::Vector3f& normal, Eigen::Vector3f& sum,
+                float& weightSum) const;
+};
+
+#endif
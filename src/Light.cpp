@@ -2,17 +2,33 @@
 #include "Scene.h"
 #include "Helper.h"
 #include "Texture.h"
+#include "OccluderCache.h"
+#include "BRDFKernels.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
 
 using namespace Eigen;
 
 Light::Light(){
+    _occluderSlot = OccluderCache::NewSlot();
+}
+
+bool Light::GetBounds(LightBounds&) const {
+    return false;
+}
 
+void Light::Prepare() {
+
+}
+
+float Light::PhotonPower(const BBox&) const {
+    LightBounds bounds;
+    return GetBounds(bounds) ? bounds.power : 0;
 }
 
-float Light::DistributionTS(float cosAlpha, int phongExp) {
-    float x = (phongExp + 2.0f) / (2.0f * M_PI);
-    x = x * pow(cosAlpha, phongExp);
-    return x;
+bool Light::EmitPhoton(SamplerContext&, const BBox&, Ray&, Eigen::Vector3f&) const {
+    return false;
 }
 
 float Light::Fresnel(float n_t, float k_t, const Vector3f& ray, const Vector3f& normal){
@@ -60,105 +76,109 @@ float Light::GeometryTS(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, co
 }
 
 Vector3f Light::TermBRDF(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret, Material* mat) {
-    if (mat->_brdfType == Mp){
-        float n_wi = ret.normal.dot(wi);
-        Vector3f wr = -wi + ret.normal * 2 * n_wi;
-        wr = wr / wr.norm();
-
-        float cosAngle = std::max(0.0f, wr.dot(wo));
-        return mat->diffuseRef + mat->specularRef * pow(cosAngle, mat->phongExp);
-    }
-    else if (mat->_brdfType == Op){
-        float n_wi = ret.normal.dot(wi);
-        Vector3f wr = -wi + ret.normal * 2 * n_wi;
-        wr = wr / wr.norm();
-
-        float cosAngle = std::max(0.0f, wr.dot(wo));
-        float cosTheta_i = std::max(0.0f, wi.dot(ret.normal));
-        if (cosTheta_i < _epsilon){
-            return {0,0,0};
-        }
-        return mat->diffuseRef + (mat->specularRef * pow(cosAngle, mat->phongExp)) / cosTheta_i;
+    return mat->brdfKernel(wi, wo, ret, mat);
+}
+
+Vector3f Light::BRDF(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret,
+        const Eigen::Vector3f &radiance, Material* mat) {
+    Vector3f brdfTerm = TermBRDF(wi, wo, ret, mat);
+    float cosAngle = std::max(0.0f, wi.dot(ret.normal));
+    return radiance.cwiseProduct(brdfTerm) * cosAngle;
+}
+
+// Light leaving towards wo: the BRDF times the cosine, or Phong shading for
+// materials without a BRDF.
+Vector3f Light::Reflect(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret,
+        const Eigen::Vector3f &radiance, Material* mat) {
+    if (mat->_brdfType == NoBRDF){
+        return BRDFKernels::Phong(wi, wo, ret, mat, radiance);
     }
-    else if (mat->_brdfType == Mpn){
-        float n_wi = ret.normal.dot(wi);
-        Vector3f wr = -wi + ret.normal * 2 * n_wi;
-        wr = wr / wr.norm();
+    return BRDF(wi, wo, ret, radiance, mat);
+}
 
-        float cosAngle = std::max(0.0f, wr.dot(wo));
-        int p = mat->phongExp;
-        Vector3f diffusePart = mat->diffuseRef / M_PI;
-        Vector3f specularPart = mat->specularRef * ((p+2) / (2*M_PI)) * pow(cosAngle, p);
-        return diffusePart + specularPart;
+// Specular lobe of a BRDF, used to sample directions near its peak.
+namespace {
+    bool IsBlinnLobe(BRDFType type){
+        return type == Obp || type == Mbp || type == Mbpn || type == Ts || type == Tsf;
     }
-    else if (mat->_brdfType == Mbp){
-        Vector3f h = (wo + wi).normalized();
-        float nh = ret.normal.dot(h);
 
-        float cosAngle = std::max(0.0f, nh);
-        return mat->diffuseRef + mat->specularRef * pow(cosAngle, mat->phongExp);
+    // Direction around axis with density (e + 1) / (2 pi) * cos^e.
+    Vector3f SampleCosinePower(const Vector3f& axis, float exponent, float u, float v){
+        float cosTheta = pow(u, 1.0f / (exponent + 1));
+        float sinTheta = sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+        float phi = 2 * M_PI * v;
+        Vector3f t = GeometryHelpers::GetOrthonormalUVector(axis);
+        Vector3f b = axis.cross(t);
+        return (t * (sinTheta * cos(phi)) + b * (sinTheta * sin(phi)) + axis * cosTheta).normalized();
     }
-    else if (mat->_brdfType == Obp){
-        Vector3f h = (wo + wi).normalized();
-        float nh = ret.normal.dot(h);
 
-        float cosAngle = std::max(0.0f, nh);
-        float cosTheta_i = std::max(0.0f, wi.dot(ret.normal));
-        if (cosTheta_i < _epsilon){
-            return {0,0,0};
+    float CosinePowerPdf(float cosTheta, float exponent){
+        if (cosTheta <= 0){
+            return 0;
         }
-        return mat->diffuseRef + (mat->specularRef * pow(cosAngle, mat->phongExp)) / cosTheta_i;
+        return (exponent + 1) / (2 * M_PI) * pow(cosTheta, exponent);
     }
-    else if (mat->_brdfType == Mbpn){
-        Vector3f h = (wo + wi).normalized();
-        float nh = ret.normal.dot(h);
 
-        float cosAngle = std::max(0.0f, nh);
-        int p = mat->phongExp;
-        Vector3f diffusePart = mat->diffuseRef / M_PI;
-        Vector3f specularPart = mat->specularRef * ((p+8) / (8*M_PI)) * pow(cosAngle, p);
-        return diffusePart + specularPart;
+    // Share of the samples given to the specular lobe.
+    float SpecularProbability(Material* mat){
+        float diffuse = mat->diffuseRef.mean();
+        float specular = mat->specularRef.mean();
+        if (diffuse + specular <= 0){
+            return 0.5f;
+        }
+        return specular / (diffuse + specular);
     }
-    else if (mat->_brdfType == Ts){
-        Vector3f wh = (wo + wi).normalized();
-
-        Vector3f diffusePart = mat->diffuseRef / M_PI;
-
-        float cosAlpha = wh.dot(ret.normal);
-        float cosTheta = wi.dot(ret.normal);
-        float cosPhi = wo.dot(ret.normal);
-        float g = GeometryTS(wi, wo, wh, ret);
-        float d = DistributionTS(cosAlpha, mat->phongExp);
-        Vector3f specularPart = mat->specularRef * g * d;
-        specularPart = specularPart / (4 * cosPhi * cosTheta);
+}
 
-        return diffusePart + specularPart;
+// Samples wi from a mix of a cosine weighted hemisphere for the diffuse part and
+// the specular lobe of the BRDF: around the mirror direction for the Phong BRDFs,
+// and through the half vector for the Blinn-Phong and Torrance-Sparrow BRDFs.
+Vector3f Light::SampleBRDF(const Eigen::Vector3f& wo, const ReturnVal& ret, Material* mat, float lobe, float u, float v,
+        float& pdf) {
+    Vector3f wi;
+    float specularProbability = SpecularProbability(mat);
+    if (lobe >= specularProbability){
+        wi = SampleCosinePower(ret.normal, 1, u, v);
+    }
+    else if (IsBlinnLobe(mat->_brdfType)){
+        Vector3f h = SampleCosinePower(ret.normal, mat->phongExp, u, v);
+        wi = -wo + h * (2 * wo.dot(h));
+    }
+    else{
+        Vector3f wr = -wo + ret.normal * (2 * wo.dot(ret.normal));
+        wi = SampleCosinePower(wr, mat->phongExp, u, v);
     }
-    else if (mat->_brdfType == Tsf){
-        Vector3f wh = (wo + wi).normalized();
 
-        float f = Fresnel(mat->refractionIndex, mat->absorptionIndex, -wo, ret.normal);
-        Vector3f diffusePart = mat->diffuseRef / M_PI;
-        diffusePart = diffusePart * (1 - f);
+    pdf = PdfBRDF(wi, wo, ret, mat);
+    return wi;
+}
 
-        float cosAlpha = wh.dot(ret.normal);
-        float cosTheta = wi.dot(ret.normal);
-        float cosPhi = wo.dot(ret.normal);
-        float g = GeometryTS(wi, wo, wh, ret);
-        float d = DistributionTS(cosAlpha, mat->phongExp);
-        Vector3f specularPart = mat->specularRef * g * d;
-        specularPart = specularPart / (4.0f * cosPhi * cosTheta);
-        specularPart = specularPart * f;
+float Light::PdfBRDF(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const ReturnVal& ret, Material* mat) {
+    float specularProbability = SpecularProbability(mat);
+    float diffusePdf = CosinePowerPdf(wi.dot(ret.normal), 1);
 
-        return diffusePart + specularPart;
+    float specularPdf;
+    if (IsBlinnLobe(mat->_brdfType)){
+        Vector3f h = (wo + wi).normalized();
+        float woh = wo.dot(h);
+        specularPdf = woh > 0 ? CosinePowerPdf(h.dot(ret.normal), mat->phongExp) / (4 * woh) : 0;
+    }
+    else{
+        Vector3f wr = -wo + ret.normal * (2 * wo.dot(ret.normal));
+        specularPdf = CosinePowerPdf(wi.dot(wr), mat->phongExp);
     }
+
+    return (1 - specularProbability) * diffusePdf + specularProbability * specularPdf;
 }
 
-Vector3f Light::BRDF(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret,
-        const Eigen::Vector3f &radiance, Material* mat) {
-    Vector3f brdfTerm = TermBRDF(wi, wo, ret, mat);
-    float cosAngle = std::max(0.0f, wi.dot(ret.normal));
-    return radiance.cwiseProduct(brdfTerm) * cosAngle;
+// Weight of a sample taken with pdf when otherPdf could also have produced it (Veach).
+float Light::PowerHeuristic(float pdf, float otherPdf) {
+    float a = pdf * pdf;
+    float b = otherPdf * otherPdf;
+    if (a + b <= 0 || !std::isfinite(a + b)){
+        return std::isinf(a) ? 1 : 0;
+    }
+    return a / (a + b);
 }
 
 // ----------------------------------------------------- //
@@ -185,68 +205,65 @@ LightType PointLight::GetType() const {
     return _type;
 }
 
+bool PointLight::GetBounds(LightBounds& bounds) const {
+    bounds.box.minPoint = position;
+    bounds.box.maxPoint = position;
+    bounds.axis = {0, 1, 0};
+    bounds.thetaO = M_PI;
+    bounds.thetaE = M_PI / 2;
+    bounds.power = 4 * M_PI * intensity.mean();
+    return true;
+}
+
+bool PointLight::EmitPhoton(SamplerContext& sampler, const BBox&, Ray& ray, Eigen::Vector3f& power) const {
+    float u = sampler.Next();
+    float v = sampler.Next();
+    ray = Ray(position, GeometryHelpers::SampleUniformSphere(u, v), sampler.Get(Time));
+    power = intensity * (4 * M_PI);
+    return true;
+}
+
 bool PointLight::IsShadow(const Ray &primeRay, const ReturnVal &ret) const {
     Vector3f direction = position - ret.point;
 
     // Create a new ray. Origin is moved with epsilon towards light to avoid self intersection.
     Ray ray(ret.point + ret.normal * pScene->shadowRayEps, direction / direction.norm(), primeRay.time);
 
+    // The primitive that blocked the last shadow ray of this thread is tried first.
+    float lightDistance = (ret.point - position).norm();
+    if (pScene->occluderCache && OccluderCache::Blocks(_occluderSlot, ray, ret.point, lightDistance))
+    {
+        return true;
+    }
+
     // Find nearest intersection of ray with all objects to see if there is a shadow.
-    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->objects, pScene->instances);
+    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->topLevel);
 
     if (nearestRet.full)
     {
-        bool objectBlocksLight = (ret.point - position).norm() > (ret.point - nearestRet.point).norm();
+        bool objectBlocksLight = lightDistance > (ret.point - nearestRet.point).norm();
+        if (objectBlocksLight && pScene->occluderCache)
+        {
+            OccluderCache::Store(_occluderSlot, nearestRet);
+        }
         return objectBlocksLight;
     }
 
     return false;
 }
 
-Eigen::Vector3f PointLight::Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
-    Vector3f wi = (position - ret.point).normalized();
-    float nh = ret.normal.dot(wi);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f diffuseColor;
-    if (ret.dm == ReplaceKd){
-        diffuseColor = (ComputeLightContribution(ret.point).cwiseProduct((ret.textureColor / ret.textureNormalizer) * alpha));
-    }
-    else if (ret.dm == BlendKd){
-        Vector3f blended = (mat->diffuseRef + (ret.textureColor / ret.textureNormalizer)) * 0.5f;
-        diffuseColor = (ComputeLightContribution(ret.point).cwiseProduct(blended * alpha));
-    }
-    else{
-        diffuseColor = (ComputeLightContribution(ret.point).cwiseProduct(mat->diffuseRef * alpha));
-    }
-    return diffuseColor;
-}
-
-Eigen::Vector3f PointLight::Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
-    // Compute specular color at given point with given light.
-    Vector3f wo = -primeRay.direction;
-    Vector3f wi = (position - ret.point).normalized();
-    Vector3f h = (wo + wi) / (wo + wi).norm();
-    float nh = ret.normal.dot(h);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f specularColor = ComputeLightContribution(ret.point).cwiseProduct(
-            mat->specularRef * pow(alpha, mat->phongExp));
-    return specularColor;
-}
-
-Eigen::Vector3f PointLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat){
+Eigen::Vector3f PointLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext&){
     if (IsShadow(primeRay, ret)){
         return {0,0,0};
     }
 
-    if (mat->_brdfType != NoBRDF){
-        Vector3f wi = (position - ret.point).normalized();
-        Vector3f radiance = ComputeLightContribution(ret.point);
-        return BRDF(wi, -primeRay.direction, ret, radiance, mat);
-    }
+    return ShadeUnoccluded(primeRay, ret, mat);
+}
 
-    return Diffuse(primeRay, ret, mat) + Specular(primeRay, ret, mat);
+// Shading of a point already known to see the light.
+Eigen::Vector3f PointLight::ShadeUnoccluded(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
+    Vector3f wi = (position - ret.point).normalized();
+    return Reflect(wi, -primeRay.direction, ret, ComputeLightContribution(ret.point), mat);
 }
 
 // ----------------------------------------------------------- //
@@ -267,57 +284,45 @@ LightType DirectionalLight::GetType() const {
     return _type;
 }
 
-bool DirectionalLight::IsShadow(const Ray &primeRay, const ReturnVal &ret) const {
-    Ray ray(ret.point + ret.normal * pScene->shadowRayEps, -_direction, primeRay.time);
-
-    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->objects, pScene->instances);
-    return nearestRet.full;
+// The light is cut to a disc as wide as the bounding sphere of the scene, so
+// its power is the irradiance times the area of that disc.
+float DirectionalLight::PhotonPower(const BBox& sceneBox) const {
+    float radius = 0.5f * (sceneBox.maxPoint - sceneBox.minPoint).norm();
+    return M_PI * radius * radius * _radiance.mean();
 }
 
-Eigen::Vector3f DirectionalLight::Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
-    Vector3f wi = -_direction;
-    float nh = ret.normal.dot(wi);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f diffuseColor;
-    if (ret.dm == ReplaceKd){
-        diffuseColor = (_radiance.cwiseProduct((ret.textureColor / ret.textureNormalizer) * alpha));
+bool DirectionalLight::EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const {
+    Vector3f center = (sceneBox.minPoint + sceneBox.maxPoint) * 0.5f;
+    float radius = 0.5f * (sceneBox.maxPoint - sceneBox.minPoint).norm();
+    if (radius <= 0){
+        return false;
     }
-    else if (ret.dm == BlendKd){
-        Vector3f blended = (mat->diffuseRef + (ret.textureColor / ret.textureNormalizer)) * 0.5f;
-        diffuseColor = (_radiance.cwiseProduct(blended * alpha));
-    }
-    else{
-        diffuseColor = (_radiance.cwiseProduct(mat->diffuseRef * alpha));
-    }
-    return diffuseColor;
+
+    // Uniform point on the disc, which faces the light from outside the bounding sphere.
+    float r = radius * sqrt(sampler.Next());
+    float phi = 2 * M_PI * sampler.Next();
+    Vector3f t = GeometryHelpers::GetOrthonormalUVector(_direction);
+    Vector3f b = _direction.cross(t);
+    Vector3f origin = center - _direction * radius + t * (r * std::cos(phi)) + b * (r * std::sin(phi));
+
+    ray = Ray(origin, _direction, sampler.Get(Time));
+    power = _radiance * (M_PI * radius * radius);
+    return true;
 }
 
-Eigen::Vector3f DirectionalLight::Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
-    // Compute specular color at given point with given light.
-    Vector3f wo = -primeRay.direction;
-    Vector3f wi = -_direction;
-    Vector3f h = (wo + wi) / (wo + wi).norm();
-    float nh = ret.normal.dot(h);
-    float alpha = std::max(0.0f, nh);
+bool DirectionalLight::IsShadow(const Ray &primeRay, const ReturnVal &ret) const {
+    Ray ray(ret.point + ret.normal * pScene->shadowRayEps, -_direction, primeRay.time);
 
-    Vector3f specularColor = _radiance.cwiseProduct(
-            mat->specularRef * pow(alpha, mat->phongExp));
-    return specularColor;
+    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->topLevel);
+    return nearestRet.full;
 }
 
-Eigen::Vector3f DirectionalLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat){
+Eigen::Vector3f DirectionalLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext&){
     if (IsShadow(primeRay, ret)){
         return {0,0,0};
     }
 
-    if (mat->_brdfType != NoBRDF){
-        Vector3f wi = -_direction;
-        Vector3f radiance = _radiance;
-        return BRDF(wi, -primeRay.direction, ret, radiance, mat);
-    }
-
-    return Diffuse(primeRay, ret, mat) + Specular(primeRay, ret, mat);
+    return Reflect(-_direction, -primeRay.direction, ret, _radiance, mat);
 }
 
 // ---------------------------------------------------- //
@@ -356,83 +361,76 @@ LightType SpotLight::GetType() const {
     return _type;
 }
 
+bool SpotLight::GetBounds(LightBounds& bounds) const {
+    bounds.box.minPoint = _position;
+    bounds.box.maxPoint = _position;
+    bounds.axis = _direction;
+    bounds.thetaO = 0;
+    bounds.thetaE = _coverage;
+    bounds.power = 2 * M_PI * (1 - cos(_coverage)) * _intensity.mean();
+    return true;
+}
+
+// Directions are uniform in the cone of the coverage angle, and those past the
+// fall angle carry the falloff in their power.
+bool SpotLight::EmitPhoton(SamplerContext& sampler, const BBox&, Ray& ray, Eigen::Vector3f& power) const {
+    float cosMax = cos(_coverage);
+    float cosTheta = 1 - sampler.Next() * (1 - cosMax);
+    float sinTheta = sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+    float phi = 2 * M_PI * sampler.Next();
+    Vector3f t = GeometryHelpers::GetOrthonormalUVector(_direction);
+    Vector3f b = _direction.cross(t);
+    Vector3f direction = t * (sinTheta * std::cos(phi)) + b * (sinTheta * std::sin(phi)) + _direction * cosTheta;
+
+    float angle = acos(std::min(1.0f, cosTheta));
+    float falloff = angle < _fall ? 1.0f : FallOf(angle);
+    ray = Ray(_position, direction.normalized(), sampler.Get(Time));
+    power = _intensity * (2 * M_PI * (1 - cosMax) * falloff);
+    return true;
+}
+
 bool SpotLight::IsShadow(const Ray &primeRay, const ReturnVal &ret) const {
     Vector3f direction = _position - ret.point;
 
     // Create a new ray. Origin is moved with epsilon towards light to avoid self intersection.
     Ray ray(ret.point + ret.normal * pScene->shadowRayEps, direction / direction.norm(), primeRay.time);
 
+    // The primitive that blocked the last shadow ray of this thread is tried first.
+    float lightDistance = (ret.point - _position).norm();
+    if (pScene->occluderCache && OccluderCache::Blocks(_occluderSlot, ray, ret.point, lightDistance))
+    {
+        return true;
+    }
+
     // Find nearest intersection of ray with all objects to see if there is a shadow.
-    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->objects, pScene->instances);
+    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->topLevel);
 
     if (nearestRet.full)
     {
-        bool objectBlocksLight = (ret.point - _position).norm() > (ret.point - nearestRet.point).norm();
+        bool objectBlocksLight = lightDistance > (ret.point - nearestRet.point).norm();
+        if (objectBlocksLight && pScene->occluderCache)
+        {
+            OccluderCache::Store(_occluderSlot, nearestRet);
+        }
         return objectBlocksLight;
     }
 
     return false;
 }
 
-Eigen::Vector3f SpotLight::Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
-    Vector3f wi = (_position - ret.point).normalized();
-    float nh = ret.normal.dot(wi);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f diffuseColor;
-    if (ret.dm == ReplaceKd){
-        diffuseColor = (ComputeLightContribution(ret.point).cwiseProduct((ret.textureColor / ret.textureNormalizer) * alpha));
-    }
-    else if (ret.dm == BlendKd){
-        Vector3f blended = (mat->diffuseRef + (ret.textureColor / ret.textureNormalizer)) * 0.5f;
-        diffuseColor = (ComputeLightContribution(ret.point).cwiseProduct(blended * alpha));
-    }
-    else{
-        diffuseColor = (ComputeLightContribution(ret.point).cwiseProduct(mat->diffuseRef * alpha));
-    }
-    return diffuseColor;
-}
-
-Eigen::Vector3f SpotLight::Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat) const{
-    // Compute specular color at given point with given light.
-    Vector3f wo = -primeRay.direction;
-    Vector3f wi = (_position - ret.point).normalized();
-    Vector3f h = (wo + wi) / (wo + wi).norm();
-    float nh = ret.normal.dot(h);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f specularColor = ComputeLightContribution(ret.point).cwiseProduct(
-            mat->specularRef * pow(alpha, mat->phongExp));
-    return specularColor;
-}
-
-Eigen::Vector3f SpotLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat){
+Eigen::Vector3f SpotLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext&){
     if (IsShadow(primeRay, ret)){
         return {0,0,0};
     }
 
     float angle = FindAngle(ret);
-    if (angle < _fall){
-        if (mat->_brdfType != NoBRDF){
-            Vector3f wi = (_position - ret.point).normalized();
-            Vector3f radiance = ComputeLightContribution(ret.point);
-            return BRDF(wi, -primeRay.direction, ret, radiance, mat);
-        }
-
-        return Diffuse(primeRay, ret, mat) + Specular(primeRay, ret, mat);
-    }
-    else if (angle < _coverage){
-        if (mat->_brdfType != NoBRDF){
-            Vector3f wi = (_position - ret.point).normalized();
-            Vector3f radiance = ComputeLightContribution(ret.point);
-            return BRDF(wi, -primeRay.direction, ret, radiance, mat) * FallOf(angle);
-        }
-
-        return (Diffuse(primeRay, ret, mat) + Specular(primeRay, ret, mat)) * FallOf(angle);
-    }
-    else{
+    if (angle >= _coverage){
         return {0,0,0};
     }
+
+    Vector3f wi = (_position - ret.point).normalized();
+    Vector3f color = Reflect(wi, -primeRay.direction, ret, ComputeLightContribution(ret.point), mat);
+    return angle < _fall ? color : color * FallOf(angle);
 }
 
 // ---------------------------------------------------- //
@@ -440,7 +438,7 @@ Eigen::Vector3f SpotLight::BasicShading(const Ray& primeRay, const ReturnVal& re
 // ---------------------------------------------------- //
 
 AreaLight::AreaLight(const Eigen::Vector3f& position, const Eigen::Vector3f& normal, const Eigen::Vector3f& radiance,
-        float size){
+        float size, int sampleCount){
     _position = position;
     _normal = normal.normalized();
     _radiance = radiance;
@@ -449,9 +447,12 @@ AreaLight::AreaLight(const Eigen::Vector3f& position, const Eigen::Vector3f& nor
 
     _u = GeometryHelpers::GetOrthonormalUVector(_normal);
     _v = _normal.cross(_u);
+    _corner = _position - (_u + _v) * (_size * 0.5f);
 
-    //mt = std::mt19937 (rd());
-    //dist = std::uniform_real_distribution<float>(0.0, 1.0);
+    _gridSize = 1;
+    while (_gridSize * _gridSize < sampleCount){
+        _gridSize++;
+    }
 }
 
 float AreaLight::FindAreaFactor(const Eigen::Vector3f& p, const Eigen::Vector3f& sample) const {
@@ -462,6 +463,98 @@ float AreaLight::FindAreaFactor(const Eigen::Vector3f& p, const Eigen::Vector3f&
     return (_size * _size) * (cosTheta / dSquare);
 }
 
+// Uniform sampling of the solid angle the square subtends at p (Urena et al., 2013).
+// Returns false when the square is seen edge on or is too small for the sampling
+// to be stable, in which case the caller falls back to sampling the area.
+bool AreaLight::SampleSolidAngle(const Vector3f& p, float u, float v, Vector3f& sample, float& solidAngle) const {
+    Vector3d x = _u.cast<double>();
+    Vector3d y = _v.cast<double>();
+    Vector3d z = x.cross(y);
+    Vector3d d = (_corner - p).cast<double>();
+
+    double z0 = d.dot(z);
+    if (z0 > 0){
+        z = -z;
+        z0 = -z0;
+    }
+    if (z0 > -1e-6){
+        return false;
+    }
+
+    double x0 = d.dot(x);
+    double y0 = d.dot(y);
+    double x1 = x0 + _size;
+    double y1 = y0 + _size;
+
+    // Normals of the planes through p and each edge of the square.
+    Vector3d n0 = Vector3d(0, z0, -y0).normalized();
+    Vector3d n1 = Vector3d(-z0, 0, x1).normalized();
+    Vector3d n2 = Vector3d(0, -z0, y1).normalized();
+    Vector3d n3 = Vector3d(z0, 0, -x0).normalized();
+
+    double g0 = acos(std::max(-1.0, std::min(1.0, -n0.dot(n1))));
+    double g1 = acos(std::max(-1.0, std::min(1.0, -n1.dot(n2))));
+    double g2 = acos(std::max(-1.0, std::min(1.0, -n2.dot(n3))));
+    double g3 = acos(std::max(-1.0, std::min(1.0, -n3.dot(n0))));
+    double k = 2 * M_PI - g2 - g3;
+    double s = g0 + g1 - k;
+    if (!(s > 1e-6)){
+        return false;
+    }
+
+    // Pick the x coordinate from the fraction u of the solid angle.
+    double au = u * s + k;
+    double fu = (cos(au) * n0[2] - n2[2]) / sin(au);
+    double cu = (fu > 0 ? 1.0 : -1.0) / sqrt(fu * fu + n0[2] * n0[2]);
+    cu = std::max(-1.0, std::min(1.0, cu));
+    double xu = -(cu * z0) / std::max(sqrt(1 - cu * cu), 1e-12);
+    xu = std::max(x0, std::min(x1, xu));
+
+    // Then the y coordinate uniformly in the cosine of the elevation.
+    double dist = sqrt(xu * xu + z0 * z0);
+    double h0 = y0 / sqrt(dist * dist + y0 * y0);
+    double h1 = y1 / sqrt(dist * dist + y1 * y1);
+    double hv = h0 + v * (h1 - h0);
+    double hv2 = hv * hv;
+    double yv = (hv2 < 1 - 1e-6) ? (hv * dist) / sqrt(1 - hv2) : y1;
+    yv = std::max(y0, std::min(y1, yv));
+
+    if (!std::isfinite(xu) || !std::isfinite(yv)){
+        return false;
+    }
+
+    sample = p + (x * xu + y * yv + z * z0).cast<float>();
+    solidAngle = s;
+    return true;
+}
+
+// Density, with respect to solid angle at p, of the sample BasicShading would take.
+float AreaLight::Pdf(const Vector3f& p, const Vector3f& sample) const {
+    Vector3f unused;
+    float solidAngle;
+    if (SampleSolidAngle(p, 0.5f, 0.5f, unused, solidAngle)){
+        return 1.0f / solidAngle;
+    }
+    return 1.0f / FindAreaFactor(p, sample);
+}
+
+bool AreaLight::Intersect(const Vector3f& p, const Vector3f& direction, Vector3f& hit) const {
+    float denominator = direction.dot(_normal);
+    if (std::abs(denominator) < 1e-8f){
+        return false;
+    }
+
+    float t = (_position - p).dot(_normal) / denominator;
+    if (t <= 0){
+        return false;
+    }
+
+    hit = p + direction * t;
+    Vector3f local = hit - _position;
+    float halfSize = _size * 0.5f;
+    return std::abs(local.dot(_u)) <= halfSize && std::abs(local.dot(_v)) <= halfSize;
+}
+
 Vector3f AreaLight::ComputeLightContribution(const Vector3f &p, const Eigen::Vector3f& sample) const {
     return _radiance * FindAreaFactor(p, sample);
 }
@@ -470,13 +563,43 @@ LightType AreaLight::GetType() const {
     return _type;
 }
 
+bool AreaLight::GetBounds(LightBounds& bounds) const {
+    Vector3f edgeU = _u * _size;
+    Vector3f edgeV = _v * _size;
+    bounds.box.minPoint = _corner.cwiseMin(_corner + edgeU).cwiseMin(_corner + edgeV).cwiseMin(_corner + edgeU + edgeV);
+    bounds.box.maxPoint = _corner.cwiseMax(_corner + edgeU).cwiseMax(_corner + edgeV).cwiseMax(_corner + edgeU + edgeV);
+
+    // Both sides of the square emit.
+    bounds.axis = _normal;
+    bounds.thetaO = M_PI;
+    bounds.thetaE = M_PI / 2;
+    bounds.power = 2 * M_PI * _size * _size * _radiance.mean();
+    return true;
+}
+
+// Uniform point on the square, a side picked with equal chance, then a cosine
+// weighted direction from that side.
+bool AreaLight::EmitPhoton(SamplerContext& sampler, const BBox&, Ray& ray, Eigen::Vector3f& power) const {
+    float u = sampler.Next();
+    float v = sampler.Next();
+    Vector3f point = _corner + _u * (_size * u) + _v * (_size * v);
+    Vector3f normal = sampler.Next() < 0.5f ? _normal : Vector3f(-_normal);
+    u = sampler.Next();
+    v = sampler.Next();
+    Vector3f direction = GeometryHelpers::SampleCosineHemisphere(normal, u, v);
+
+    ray = Ray(point + normal * pScene->shadowRayEps, direction, sampler.Get(Time));
+    power = _radiance * (2 * M_PI * _size * _size);
+    return true;
+}
+
 bool AreaLight::IsShadow(const Ray &primeRay, const ReturnVal &ret, const Eigen::Vector3f& sample) const {
     Vector3f direction = sample - ret.point;
     // Create a new ray. Origin is moved with epsilon towards light to avoid self intersection.
     Ray ray(ret.point + ret.normal * pScene->shadowRayEps, direction / direction.norm(), primeRay.time);
 
     // Find nearest intersection of ray with all objects to see if there is a shadow.
-    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->objects, pScene->instances);
+    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->topLevel);
 
     if (nearestRet.full)
     {
@@ -487,61 +610,57 @@ bool AreaLight::IsShadow(const Ray &primeRay, const ReturnVal &ret, const Eigen:
     return false;
 }
 
-Eigen::Vector3f AreaLight::Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat, const Eigen::Vector3f& sample) const{
-    Vector3f wi = (sample - ret.point).normalized();
-    float nh = ret.normal.dot(wi);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f diffuseColor;
-    if (ret.dm == ReplaceKd){
-        diffuseColor = (ComputeLightContribution(ret.point, sample).cwiseProduct((ret.textureColor / ret.textureNormalizer) * alpha));
-    }
-    else if (ret.dm == BlendKd){
-        Vector3f blended = (mat->diffuseRef + (ret.textureColor / ret.textureNormalizer)) * 0.5f;
-        diffuseColor = (ComputeLightContribution(ret.point, sample).cwiseProduct(blended * alpha));
-    }
-    else{
-        diffuseColor = (ComputeLightContribution(ret.point, sample).cwiseProduct(mat->diffuseRef * alpha));
-    }
-    return diffuseColor;
-}
-
-Eigen::Vector3f AreaLight::Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat, const Eigen::Vector3f& sample) const{
-    // Compute specular color at given point with given light.
+Eigen::Vector3f AreaLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler){
+    Vector3f color = {0,0,0};
     Vector3f wo = -primeRay.direction;
-    Vector3f wi = (sample - ret.point).normalized();
-    Vector3f h = (wo + wi) / (wo + wi).norm();
-    float nh = ret.normal.dot(h);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f specularColor = ComputeLightContribution(ret.point, sample).cwiseProduct(
-            mat->specularRef * pow(alpha, mat->phongExp));
-    return specularColor;
-}
+    int sampleCount = _gridSize * _gridSize;
+
+    // One jittered sample per cell of the grid over the light.
+    for (int i = 0; i < sampleCount; i++){
+        float u = ((i % _gridSize) + sampler.Next()) / _gridSize;
+        float v = ((i / _gridSize) + sampler.Next()) / _gridSize;
+
+        Vector3f sample;
+        Vector3f radiance;
+        float solidAngle;
+        if (SampleSolidAngle(ret.point, u, v, sample, solidAngle)){
+            radiance = _radiance * solidAngle;
+        }
+        else{
+            sample = _corner + (_u * _size * u) + (_v * _size * v);
+            radiance = ComputeLightContribution(ret.point, sample);
+        }
 
-Eigen::Vector3f AreaLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat){
-    std::random_device rd;
-    std::mt19937 mt;
-    std::uniform_real_distribution<float> dist;
+        if (mat->_brdfType == NoBRDF){
+            if (!IsShadow(primeRay, ret, sample)){
+                color += Reflect((sample - ret.point).normalized(), wo, ret, radiance, mat);
+            }
+            continue;
+        }
 
-    mt = std::mt19937 (rd());
-    dist = std::uniform_real_distribution<float>(0.0, 1.0);
+        // BRDFs also sample a direction from their own lobes. Both samples are
+        // weighted with the power heuristic, so glossy highlights are not left
+        // to light samples alone.
+        Vector3f wi = (sample - ret.point).normalized();
+        if (!IsShadow(primeRay, ret, sample)){
+            float weight = PowerHeuristic(Pdf(ret.point, sample), PdfBRDF(wi, wo, ret, mat));
+            color += BRDF(wi, wo, ret, radiance, mat) * weight;
+        }
 
-    float uChi = dist(mt) - 0.5f;
-    float vChi = dist(mt) - 0.5f;
-    Vector3f sample = _position + (_u * _size * uChi) + (_v * _size * vChi);
+        float lobe = sampler.Next();
+        float brdfU = sampler.Next();
+        float brdfV = sampler.Next();
+        float brdfPdf;
+        wi = SampleBRDF(wo, ret, mat, lobe, brdfU, brdfV, brdfPdf);
 
-    if (IsShadow(primeRay, ret, sample)){
-        return {0,0,0};
-    }
-
-    if (mat->_brdfType != NoBRDF){
-        Vector3f wi = (sample - ret.point).normalized();
-        Vector3f radiance = ComputeLightContribution(ret.point, sample);
-        return BRDF(wi, -primeRay.direction, ret, radiance, mat);
+        Vector3f hit;
+        if (brdfPdf > 0 && wi.dot(ret.normal) > 0 && Intersect(ret.point, wi, hit) && !IsShadow(primeRay, ret, hit)){
+            float weight = PowerHeuristic(brdfPdf, Pdf(ret.point, hit));
+            color += BRDF(wi, wo, ret, _radiance / brdfPdf, mat) * weight;
+        }
     }
 
-    return Diffuse(primeRay, ret, mat, sample) + Specular(primeRay, ret, mat, sample);
+    return color / sampleCount;
 }
 
 // ----------------------------------------------------------- //
@@ -551,27 +670,68 @@ Eigen::Vector3f AreaLight::BasicShading(const Ray& primeRay, const ReturnVal& re
 EnvironmentLight::EnvironmentLight(std::string imageName){
     _image = new Texture(imageName, NoDecal, Bilinear, ImageTexture, 1, 1);
     _type = Environment;
+    BuildDistribution();
+}
 
-    mt = std::mt19937 (rd());
-    dist = std::uniform_real_distribution<float>(0.0, 1.0);
+void EnvironmentLight::BuildDistribution() {
+    int width = _image->GetWidth();
+    int height = _image->GetHeight();
+    std::vector<float> weights(width * height);
+
+    for (int j = 0; j < height; j++){
+        // Rows near the poles cover less solid angle.
+        float sinTheta = sin(M_PI * (j + 0.5f) / height);
+        for (int i = 0; i < width; i++){
+            // Bilinear lookups blend in the next texels, so a texel is weighted by
+            // the brightest of them to keep the density above zero wherever light is.
+            float luminance = 0;
+            for (int k = 0; k < 4; k++){
+                Vector3f color = _image->GetColorAtPixel((i + (k & 1)) % width, j + (k >> 1));
+                luminance = std::max(luminance, 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2]);
+            }
+            weights[j * width + i] = luminance * sinTheta;
+        }
+    }
+
+    _distribution = Distribution2D(weights, width, height);
 }
 
 Texture* EnvironmentLight::GetTexture() {
     return _image;
 }
 
-Vector3f EnvironmentLight::ComputeLightContribution(const ReturnVal& ret, const Eigen::Vector3f& direction) const {
-    Vector3f u = GeometryHelpers::GetOrthonormalUVector(ret.normal);
-    Vector3f w = ret.normal.cross(u);
-    //float theta = acos(direction.dot(ret.normal));
-    //float phi = atan2(direction.dot(w), direction.dot(u));
-    float theta = acos(direction[1]);
+Vector3f EnvironmentLight::ComputeLightContribution(const Eigen::Vector3f& direction) const {
+    float theta = acos(std::max(-1.0f, std::min(1.0f, direction[1])));
     float phi = atan2(direction[2], direction[0]);
     float textureU = (-phi + M_PI) / (2 * M_PI);
     float textureV = theta / M_PI;
-    Vector3f radiance = _image->GetColorAtCoordinates(textureU, textureV);
-    //std::cout << radiance << std::endl << std::endl;
-    return radiance * 2 * M_PI;
+    return _image->GetColorAtCoordinates(textureU, textureV);
+}
+
+// Picks a direction with probability proportional to the brightness of the map.
+// The density is converted from texture space to solid angle.
+Vector3f EnvironmentLight::SampleDirection(float u, float v, float& pdf) const {
+    float texturePdf;
+    Vector2f uv = _distribution.Sample(u, v, texturePdf);
+
+    float theta = uv[1] * M_PI;
+    float phi = M_PI - uv[0] * 2 * M_PI;
+    float sinTheta = std::sin(theta);
+    pdf = sinTheta > 0 ? texturePdf / (2 * M_PI * M_PI * sinTheta) : 0;
+
+    return {sinTheta * std::cos(phi), std::cos(theta), sinTheta * std::sin(phi)};
+}
+
+float EnvironmentLight::Pdf(const Eigen::Vector3f& direction) const {
+    float theta = acos(std::max(-1.0f, std::min(1.0f, direction[1])));
+    float phi = atan2(direction[2], direction[0]);
+    float sinTheta = sin(theta);
+    if (sinTheta <= 0){
+        return 0;
+    }
+
+    Vector2f uv = {(float)((-phi + M_PI) / (2 * M_PI)), (float)(theta / M_PI)};
+    return _distribution.Pdf(uv) / (2 * M_PI * M_PI * sinTheta);
 }
 
 LightType EnvironmentLight::GetType() const {
@@ -583,7 +743,7 @@ bool EnvironmentLight::IsShadow(const Ray &primeRay, const ReturnVal &ret, const
     Ray ray(ret.point + ret.normal * pScene->shadowRayEps, direction, primeRay.time);
 
     // Find nearest intersection of ray with all objects to see if there is a shadow.
-    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->objects, pScene->instances);
+    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->topLevel);
 
     if (nearestRet.full)
     {
@@ -593,68 +753,333 @@ bool EnvironmentLight::IsShadow(const Ray &primeRay, const ReturnVal &ret, const
     return false;
 }
 
-Eigen::Vector3f EnvironmentLight::Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat,
-        const Eigen::Vector3f& direction) const{
-    float nh = ret.normal.dot(direction);
-    float alpha = std::max(0.0f, nh);
+Eigen::Vector3f EnvironmentLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler){
+    float u = sampler.Next();
+    float v = sampler.Next();
+    if (_distribution.Total() <= 0){
+        return {0, 0, 0};
+    }
+
+    Vector3f color = {0, 0, 0};
+    Vector3f wo = -primeRay.direction;
+    float pdf;
+    Vector3f direction = SampleDirection(u, v, pdf);
+
+    // Light from below the surface does not contribute.
+    if (pdf > 0 && direction.dot(ret.normal) > 0 && !IsShadow(primeRay, ret, direction)){
+        Vector3f radiance = ComputeLightContribution(direction) / pdf;
+        if (mat->_brdfType == NoBRDF){
+            return Reflect(direction, wo, ret, radiance, mat);
+        }
 
-    Vector3f diffuseColor;
-    if (ret.dm == ReplaceKd){
-        diffuseColor = (ComputeLightContribution(ret, direction).cwiseProduct((ret.textureColor / ret.textureNormalizer) * alpha));
+        float weight = PowerHeuristic(pdf, PdfBRDF(direction, wo, ret, mat));
+        color += BRDF(direction, wo, ret, radiance, mat) * weight;
     }
-    else if (ret.dm == BlendKd){
-        Vector3f blended = (mat->diffuseRef + (ret.textureColor / ret.textureNormalizer)) * 0.5f;
-        diffuseColor = (ComputeLightContribution(ret, direction).cwiseProduct(blended * alpha));
+
+    if (mat->_brdfType == NoBRDF){
+        return color;
     }
-    else{
-        diffuseColor = (ComputeLightContribution(ret, direction).cwiseProduct(mat->diffuseRef * alpha));
+
+    // A second direction from the BRDF, weighted against the map's distribution.
+    float lobe = sampler.Next();
+    float brdfU = sampler.Next();
+    float brdfV = sampler.Next();
+    float brdfPdf;
+    direction = SampleBRDF(wo, ret, mat, lobe, brdfU, brdfV, brdfPdf);
+    if (brdfPdf > 0 && direction.dot(ret.normal) > 0 && !IsShadow(primeRay, ret, direction)){
+        float weight = PowerHeuristic(brdfPdf, Pdf(direction));
+        color += BRDF(direction, wo, ret, ComputeLightContribution(direction) / brdfPdf, mat) * weight;
     }
-    return diffuseColor;
+
+    return color;
 }
 
-Eigen::Vector3f EnvironmentLight::Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat,
-        const Eigen::Vector3f& direction) const{
-    // Compute specular color at given point with given light.
+// ------------------------------------------------------ //
+// -------------------- Object Light -------------------- //
+// ------------------------------------------------------ //
+
+ObjectLight::ObjectLight(int materialIndex, const Eigen::Vector3f& radiance, int sampleCount){
+    _materialIndex = materialIndex;
+    _radiance = radiance;
+    _sampleCount = std::max(1, sampleCount);
+    _type = Object;
+}
+
+LightType ObjectLight::GetType() const {
+    return _type;
+}
+
+bool ObjectLight::IsShadow(const Ray &primeRay, const ReturnVal &ret, const Eigen::Vector3f& sample) const {
+    // Origin is moved with epsilon to avoid self intersection, and the ray aims at the
+    // sample from there, since the light itself is in the scene and is hit at the sample.
+    Vector3f origin = ret.point + ret.normal * pScene->shadowRayEps;
+    Vector3f direction = sample - origin;
+    float distance = direction.norm();
+    Ray ray(origin, direction / distance, primeRay.time);
+
+    // Only hits clearly before the sample block it.
+    ReturnVal nearestRet = BVHMethods::FindIntersection(ray, pScene->topLevel);
+
+    if (nearestRet.full)
+    {
+        bool objectBlocksLight = (origin - nearestRet.point).norm() < distance - pScene->shadowRayEps;
+        return objectBlocksLight;
+    }
+
+    return false;
+}
+
+Eigen::Vector3f ObjectLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler){
+    Vector3f color = {0,0,0};
     Vector3f wo = -primeRay.direction;
-    Vector3f h = (wo + direction) / (wo + direction).norm();
-    float nh = ret.normal.dot(h);
-    float alpha = std::max(0.0f, nh);
-
-    Vector3f specularColor = ComputeLightContribution(ret, direction).cwiseProduct(
-            mat->specularRef * pow(alpha, mat->phongExp));
-    return specularColor;
-}
-
-Eigen::Vector3f EnvironmentLight::BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat){
-    Vector3f direction;
-    Vector3f sample;
-    Vector3f u = GeometryHelpers::GetOrthonormalUVector(ret.normal);
-    Vector3f w = ret.normal.cross(u);
-
-    while(true){
-        float x = dist(mt) * 2 - 1.0f;
-        float y = dist(mt) * 2 - 1.0f;
-        float z = dist(mt) * 2 - 1.0f;
-
-        sample = ret.point + u * x + ret.normal * y + w * z;
-        // check these random numbers.
-        //direction = {x,y,z};
-        direction = sample - ret.point;
-
-        if (direction.dot(ret.normal) > 0 && direction.norm() <= 1){
-            direction = direction.normalized();
-            break;
+
+    for (int i = 0; i < _sampleCount; i++){
+        float u = sampler.Next();
+        float v = sampler.Next();
+        float w = sampler.Next();
+
+        Vector3f sample;
+        float pdf;
+        if (SamplePoint(ret.point, u, v, w, sample, pdf) && !IsShadow(primeRay, ret, sample)){
+            Vector3f radiance = _radiance / pdf;
+            Vector3f wi = (sample - ret.point).normalized();
+            if (mat->_brdfType == NoBRDF){
+                color += Reflect(wi, wo, ret, radiance, mat);
+            }
+            else{
+                float weight = PowerHeuristic(pdf, PdfBRDF(wi, wo, ret, mat));
+                color += BRDF(wi, wo, ret, radiance, mat) * weight;
+            }
+        }
+
+        if (mat->_brdfType == NoBRDF){
+            continue;
+        }
+
+        // A direction from the BRDF counts when the first thing it hits is this light.
+        float lobe = sampler.Next();
+        float brdfU = sampler.Next();
+        float brdfV = sampler.Next();
+        float brdfPdf;
+        Vector3f wi = SampleBRDF(wo, ret, mat, lobe, brdfU, brdfV, brdfPdf);
+        if (brdfPdf > 0 && wi.dot(ret.normal) > 0){
+            Ray ray(ret.point + ret.normal * pScene->shadowRayEps, wi, primeRay.time);
+            ReturnVal hit = BVHMethods::FindIntersection(ray, pScene->topLevel);
+            if (hit.full && hit.matIndex == _materialIndex){
+                float weight = PowerHeuristic(brdfPdf, Pdf(ret.point, hit.point, hit.normal));
+                color += BRDF(wi, wo, ret, _radiance / brdfPdf, mat) * weight;
+            }
         }
     }
 
-    if (IsShadow(primeRay, ret, direction)){
-        return {0, 0, 0};
+    return color / _sampleCount;
+}
+
+// ---------------------------------------------------- //
+// -------------------- Mesh Light -------------------- //
+// ---------------------------------------------------- //
+
+MeshLight::MeshLight(Mesh* mesh, int materialIndex, const Eigen::Vector3f& radiance, int sampleCount)
+    : ObjectLight(materialIndex, radiance, sampleCount){
+    _mesh = mesh;
+    _area = 0;
+}
+
+void MeshLight::Prepare() {
+    const std::vector<Triangle*>& faces = _mesh->GetFaces();
+    int faceSize = faces.size();
+    std::vector<float> areas(faceSize);
+    _corners.resize(faceSize * 3);
+    _area = 0;
+
+    float _max = std::numeric_limits<float>::max();
+    _box = BBox{Vector3f{_max, _max, _max}, Vector3f{-_max, -_max, -_max}};
+    for (int i = 0; i < faceSize; i++){
+        _corners[i * 3] = Transforming::TransformPoint(pScene->vertices[faces[i]->GetIndexOne() - 1], *_mesh->transformationMatrix);
+        _corners[i * 3 + 1] = Transforming::TransformPoint(pScene->vertices[faces[i]->GetIndexTwo() - 1], *_mesh->transformationMatrix);
+        _corners[i * 3 + 2] = Transforming::TransformPoint(pScene->vertices[faces[i]->GetIndexThree() - 1], *_mesh->transformationMatrix);
+
+        Vector3f a = _corners[i * 3];
+        Vector3f b = _corners[i * 3 + 1];
+        Vector3f c = _corners[i * 3 + 2];
+        areas[i] = 0.5f * (b - a).cross(c - a).norm();
+        _area += areas[i];
+        _box.minPoint = _box.minPoint.cwiseMin(a).cwiseMin(b).cwiseMin(c);
+        _box.maxPoint = _box.maxPoint.cwiseMax(a).cwiseMax(b).cwiseMax(c);
+    }
+
+    _faces = AliasTable(areas);
+}
+
+bool MeshLight::SamplePoint(const Eigen::Vector3f& p, float u, float v, float w, Eigen::Vector3f& sample, float& pdf) const {
+    if (_area <= 0){
+        return false;
+    }
+
+    float remapped;
+    int face = _faces.Sample(u, remapped);
+    Vector3f a = _corners[face * 3];
+    Vector3f b = _corners[face * 3 + 1];
+    Vector3f c = _corners[face * 3 + 2];
+
+    // Uniform point in the triangle.
+    float root = sqrt(v);
+    sample = a * (1 - root) + b * (root * (1 - w)) + c * (root * w);
+    pdf = Pdf(p, sample, (b - a).cross(c - a).normalized());
+    return pdf > 0 && std::isfinite(pdf);
+}
+
+// Uniform by area, converted to solid angle at p.
+float MeshLight::Pdf(const Eigen::Vector3f& p, const Eigen::Vector3f& hit, const Eigen::Vector3f& normal) const {
+    Vector3f direction = hit - p;
+    float distanceSquared = direction.squaredNorm();
+    float cosTheta = std::abs(direction.normalized().dot(normal));
+    if (cosTheta <= 0 || _area <= 0){
+        return 0;
+    }
+    return distanceSquared / (cosTheta * _area);
+}
+
+bool MeshLight::GetBounds(LightBounds& bounds) const {
+    bounds.box = _box;
+
+    // Faces may point anywhere, and both of their sides emit.
+    bounds.axis = {0, 1, 0};
+    bounds.thetaO = M_PI;
+    bounds.thetaE = M_PI / 2;
+    bounds.power = 2 * M_PI * _area * _radiance.mean();
+    return _area > 0;
+}
+
+// Points are uniform by area as in SamplePoint, and leave either side of their
+// face in a cosine weighted direction.
+bool MeshLight::EmitPhoton(SamplerContext& sampler, const BBox&, Ray& ray, Eigen::Vector3f& power) const {
+    if (_area <= 0){
+        return false;
+    }
+
+    float remapped;
+    int face = _faces.Sample(sampler.Next(), remapped);
+    Vector3f a = _corners[face * 3];
+    Vector3f b = _corners[face * 3 + 1];
+    Vector3f c = _corners[face * 3 + 2];
+    float root = sqrt(sampler.Next());
+    float w = sampler.Next();
+    Vector3f point = a * (1 - root) + b * (root * (1 - w)) + c * (root * w);
+
+    Vector3f normal = (b - a).cross(c - a).normalized();
+    if (sampler.Next() < 0.5f){
+        normal = -normal;
+    }
+    float u = sampler.Next();
+    float v = sampler.Next();
+    Vector3f direction = GeometryHelpers::SampleCosineHemisphere(normal, u, v);
+
+    ray = Ray(point + normal * pScene->shadowRayEps, direction, sampler.Get(Time));
+    power = _radiance * (2 * M_PI * _area);
+    return true;
+}
+
+// ------------------------------------------------------ //
+// -------------------- Sphere Light -------------------- //
+// ------------------------------------------------------ //
+
+SphereLight::SphereLight(Sphere* sphere, int materialIndex, const Eigen::Vector3f& radiance, int sampleCount)
+    : ObjectLight(materialIndex, radiance, sampleCount){
+    _sphere = sphere;
+    _radius = 0;
+}
+
+void SphereLight::Prepare() {
+    glm::mat4 model = *_sphere->transformationMatrix;
+    Vector3f center = _sphere->GetCenter();
+    _center = Transforming::TransformPoint(center, model);
+
+    // Scaling is taken as uniform, so any point of the surface gives the radius.
+    Vector3f surface = Transforming::TransformPoint(center + Vector3f(_sphere->GetRadius(), 0, 0), model);
+    _radius = (surface - _center).norm();
+}
+
+bool SphereLight::SamplePoint(const Eigen::Vector3f& p, float u, float v, float, Eigen::Vector3f& sample, float& pdf) const {
+    Vector3f toCenter = _center - p;
+    float distanceSquared = toCenter.squaredNorm();
+    float radiusSquared = _radius * _radius;
+    float phi = 2 * M_PI * v;
+
+    // Inside the sphere every direction sees it, so sample the whole surface.
+    if (distanceSquared <= radiusSquared){
+        float z = 1 - 2 * u;
+        float r = sqrt(std::max(0.0f, 1 - z * z));
+        Vector3f normal = {r * std::cos(phi), r * std::sin(phi), z};
+        sample = _center + normal * _radius;
+        pdf = Pdf(p, sample, normal);
+        return pdf > 0 && std::isfinite(pdf);
     }
 
-    if (mat->_brdfType != NoBRDF){
-        Vector3f radiance = ComputeLightContribution(ret, direction);
-        return BRDF(direction, -primeRay.direction, ret, radiance, mat);
+    // Uniform direction in the cone, written so that small cones keep their precision.
+    float sinSquaredMax = radiusSquared / distanceSquared;
+    float cosMax = sqrt(std::max(0.0f, 1 - sinSquaredMax));
+    float oneMinusCos = u * sinSquaredMax / (1 + cosMax);
+    float cosTheta = 1 - oneMinusCos;
+    float sinTheta = sqrt(std::max(0.0f, oneMinusCos * (2 - oneMinusCos)));
+
+    float distance = sqrt(distanceSquared);
+    Vector3f axis = toCenter / distance;
+    Vector3f t = GeometryHelpers::GetOrthonormalUVector(axis);
+    Vector3f b = axis.cross(t);
+    Vector3f direction = t * (sinTheta * std::cos(phi)) + b * (sinTheta * std::sin(phi)) + axis * cosTheta;
+
+    // Nearest point of the sphere along the direction.
+    float along = distance * cosTheta;
+    float halfChord = sqrt(std::max(0.0f, radiusSquared - distanceSquared * sinTheta * sinTheta));
+    sample = p + direction * (along - halfChord);
+    pdf = Pdf(p, sample, Vector3f(0, 0, 0));
+    return pdf > 0 && std::isfinite(pdf);
+}
+
+float SphereLight::Pdf(const Eigen::Vector3f& p, const Eigen::Vector3f& hit, const Eigen::Vector3f& normal) const {
+    float distanceSquared = (_center - p).squaredNorm();
+    float radiusSquared = _radius * _radius;
+    if (distanceSquared <= radiusSquared){
+        Vector3f direction = hit - p;
+        float cosTheta = std::abs(direction.normalized().dot(normal));
+        if (cosTheta <= 0){
+            return 0;
+        }
+        return direction.squaredNorm() / (cosTheta * 4 * M_PI * radiusSquared);
+    }
+
+    float sinSquaredMax = radiusSquared / distanceSquared;
+    float cosMax = sqrt(std::max(0.0f, 1 - sinSquaredMax));
+    float solidAngle = 2 * M_PI * sinSquaredMax / (1 + cosMax);
+    return solidAngle > 0 ? 1.0f / solidAngle : 0;
+}
+
+bool SphereLight::GetBounds(LightBounds& bounds) const {
+    Vector3f extent = {_radius, _radius, _radius};
+    bounds.box.minPoint = _center - extent;
+    bounds.box.maxPoint = _center + extent;
+    bounds.axis = {0, 1, 0};
+    bounds.thetaO = M_PI;
+    bounds.thetaE = M_PI / 2;
+    bounds.power = M_PI * 4 * M_PI * _radius * _radius * _radiance.mean();
+    return _radius > 0;
+}
+
+bool SphereLight::EmitPhoton(SamplerContext& sampler, const BBox&, Ray& ray, Eigen::Vector3f& power) const {
+    if (_radius <= 0){
+        return false;
     }
 
-    return Diffuse(primeRay, ret, mat, direction) + Specular(primeRay, ret, mat, direction);
+    float u = sampler.Next();
+    float v = sampler.Next();
+    Vector3f normal = GeometryHelpers::SampleUniformSphere(u, v);
+    u = sampler.Next();
+    v = sampler.Next();
+    Vector3f direction = GeometryHelpers::SampleCosineHemisphere(normal, u, v);
+
+    Vector3f point = _center + normal * (_radius + pScene->shadowRayEps);
+    ray = Ray(point, direction, sampler.Get(Time));
+    power = _radiance * (M_PI * 4 * M_PI * _radius * _radius);
+    return true;
 }
@@ -7,29 +7,60 @@
 #include "Shape.h"
 #include "Helper.h"
 #include "Material.h"
+#include "Sampler.h"
+#include "Distribution.h"
 #include <random>
 
-enum LightType{Point, Area, Directional, Spot, Environment};
+enum LightType{Point, Area, Directional, Spot, Environment, Object};
 
-class Light{
-private:
-    float _epsilon = 0.001f;
+// Where a light is and where it shines, for choosing among many lights. Light
+// leaves along directions within thetaO of axis, and spreads up to thetaE past
+// them. Power is a scalar estimate of the total emitted power.
+typedef struct LightBounds
+{
+    BBox box;
+    Eigen::Vector3f axis;
+    float thetaO;
+    float thetaE;
+    float power;
+} LightBounds;
 
+class Light{
 protected:
     LightType _type;
+    // Entry of the light in the per-thread occluder cache.
+    int _occluderSlot;
 
 public:
     Light();
-    float DistributionTS(float alpha, int phongExp);
-    float GeometryTS(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const Eigen::Vector3f& wh,
-                     const ReturnVal& ret);
-    float FresnelTwo(const Eigen::Vector3f& ray, const ReturnVal& ret, Material* mat);
-    float Fresnel(float n_t, float k_t, const Eigen::Vector3f& ray, const Eigen::Vector3f& normal);
-    Eigen::Vector3f TermBRDF(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const ReturnVal& ret, Material* mat);
-    Eigen::Vector3f BRDF(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret,
+
+    // BRDF terms depend only on the material, so integrators use them without a light.
+    static float GeometryTS(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const Eigen::Vector3f& wh,
+                            const ReturnVal& ret);
+    static float FresnelTwo(const Eigen::Vector3f& ray, const ReturnVal& ret, Material* mat);
+    static float Fresnel(float n_t, float k_t, const Eigen::Vector3f& ray, const Eigen::Vector3f& normal);
+    static Eigen::Vector3f TermBRDF(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const ReturnVal& ret,
+                                    Material* mat);
+    static Eigen::Vector3f BRDF(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret,
             const Eigen::Vector3f &radiance, Material* mat);
+    static Eigen::Vector3f Reflect(const Eigen::Vector3f &wi, const Eigen::Vector3f &wo, const ReturnVal& ret,
+            const Eigen::Vector3f &radiance, Material* mat);
+    static Eigen::Vector3f SampleBRDF(const Eigen::Vector3f& wo, const ReturnVal& ret, Material* mat, float lobe,
+                                      float u, float v, float& pdf);
+    static float PdfBRDF(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const ReturnVal& ret, Material* mat);
+    static float PowerHeuristic(float pdf, float otherPdf);
     virtual LightType GetType() const = 0;
-    virtual Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat) = 0;
+    // Lights at infinity have no bounds and return false.
+    virtual bool GetBounds(LightBounds& bounds) const;
+    // Called once object transformations are known, before rendering starts.
+    virtual void Prepare();
+    // Scalar estimate of the emitted power, for sharing photons among lights. Lights
+    // at infinity are bounded by sceneBox. Zero for lights that emit no photons.
+    virtual float PhotonPower(const BBox& sceneBox) const;
+    // Starts a photon path. power is the emitted flux over the density of the ray, so
+    // it averages to the total flux of the light over many photons.
+    virtual bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
+    virtual Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler) = 0;
 };
 
 class PointLight : public Light
@@ -44,14 +75,13 @@ public:
 
     Eigen::Vector3f ComputeLightContribution(const Eigen::Vector3f& p) const;
     LightType GetType() const;
+    bool GetBounds(LightBounds& bounds) const;
+    bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
     bool IsShadow(const Ray& primeRay, const ReturnVal& ret) const;
-    Eigen::Vector3f Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
-    Eigen::Vector3f Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
-    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat);
+    Eigen::Vector3f ShadeUnoccluded(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
+    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
 };
 
-#endif
-
 class DirectionalLight : public Light
 {
 private:
@@ -62,10 +92,10 @@ public:
 
     Eigen::Vector3f ComputeLightContribution(const Eigen::Vector3f& p) const;
     LightType GetType() const;
+    float PhotonPower(const BBox& sceneBox) const;
+    bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
     bool IsShadow(const Ray& primeRay, const ReturnVal& ret) const;
-    Eigen::Vector3f Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
-    Eigen::Vector3f Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
-    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat);
+    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
 };
 
 class SpotLight : public Light{
@@ -85,10 +115,10 @@ public:
 
     Eigen::Vector3f ComputeLightContribution(const Eigen::Vector3f& p) const;
     LightType GetType() const;
+    bool GetBounds(LightBounds& bounds) const;
+    bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
     bool IsShadow(const Ray& primeRay, const ReturnVal& ret) const;
-    Eigen::Vector3f Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
-    Eigen::Vector3f Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat) const;
-    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat);
+    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
 };
 
 class AreaLight : public Light{
@@ -100,40 +130,115 @@ private:
 
     Eigen::Vector3f _u;
     Eigen::Vector3f _v;
+    Eigen::Vector3f _corner;
 
-    //std::random_device rd;
-    //std::mt19937 mt;
-    //std::uniform_real_distribution<float> dist;
+    // Samples are taken on a gridSize x gridSize grid, so the count is rounded up to a square.
+    int _gridSize;
 
     float FindAreaFactor(const Eigen::Vector3f& p, const Eigen::Vector3f& sample) const;
+    bool SampleSolidAngle(const Eigen::Vector3f& p, float u, float v, Eigen::Vector3f& sample, float& solidAngle) const;
+    float Pdf(const Eigen::Vector3f& p, const Eigen::Vector3f& sample) const;
+    bool Intersect(const Eigen::Vector3f& p, const Eigen::Vector3f& direction, Eigen::Vector3f& hit) const;
 
 public:
-    AreaLight(const Eigen::Vector3f& position, const Eigen::Vector3f& normal, const Eigen::Vector3f& radiance, float size);
+    AreaLight(const Eigen::Vector3f& position, const Eigen::Vector3f& normal, const Eigen::Vector3f& radiance, float size,
+              int sampleCount);
 
     Eigen::Vector3f ComputeLightContribution(const Eigen::Vector3f& p, const Eigen::Vector3f& sample) const;
     LightType GetType() const;
+    bool GetBounds(LightBounds& bounds) const;
+    bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
     bool IsShadow(const Ray& primeRay, const ReturnVal& ret, const Eigen::Vector3f& sample) const;
-    Eigen::Vector3f Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat, const Eigen::Vector3f& sample) const;
-    Eigen::Vector3f Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat, const Eigen::Vector3f& sample) const;
-    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat);
+    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
 };
 
 class EnvironmentLight : public Light{
 private:
     Texture* _image;
 
-    std::random_device rd;
-    std::mt19937 mt;
-    std::uniform_real_distribution<float> dist;
+    // Luminance of the map weighted by sin(theta), built once when the map is loaded.
+    Distribution2D _distribution;
+
+    void BuildDistribution();
 
 public:
     EnvironmentLight(std::string imageName);
     Texture* GetTexture();
 
-    Eigen::Vector3f ComputeLightContribution(const ReturnVal& ret, const Eigen::Vector3f& direction) const;
+    Eigen::Vector3f ComputeLightContribution(const Eigen::Vector3f& direction) const;
+    Eigen::Vector3f SampleDirection(float u, float v, float& pdf) const;
+    float Pdf(const Eigen::Vector3f& direction) const;
     LightType GetType() const;
     bool IsShadow(const Ray& primeRay, const ReturnVal& ret, const Eigen::Vector3f& direction) const;
-    Eigen::Vector3f Diffuse(const Ray& primeRay, const ReturnVal& ret, Material* mat, const Eigen::Vector3f& direction) const;
-    Eigen::Vector3f Specular(const Ray& primeRay, const ReturnVal& ret, Material* mat, const Eigen::Vector3f& direction) const;
-    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat);
-};
\ No newline at end of file
+    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
+};
+
+// An emissive object of the scene. Rays hit it like any other object, and its
+// material carries the radiance, so a hit on materialIndex is a hit on the light.
+// Direct light takes one sample on the surface and one from the BRDF, weighted
+// with the power heuristic as for area lights.
+class ObjectLight : public Light{
+protected:
+    int _materialIndex;
+    Eigen::Vector3f _radiance;
+    int _sampleCount;
+
+    // Picks a point on the surface seen from p. pdf is with respect to solid angle at p.
+    virtual bool SamplePoint(const Eigen::Vector3f& p, float u, float v, float w, Eigen::Vector3f& sample,
+                             float& pdf) const = 0;
+    // Density of SamplePoint choosing the surface point hit, whose normal is normal.
+    virtual float Pdf(const Eigen::Vector3f& p, const Eigen::Vector3f& hit, const Eigen::Vector3f& normal) const = 0;
+
+public:
+    ObjectLight(int materialIndex, const Eigen::Vector3f& radiance, int sampleCount);
+
+    LightType GetType() const;
+    bool IsShadow(const Ray& primeRay, const ReturnVal& ret, const Eigen::Vector3f& sample) const;
+    Eigen::Vector3f BasicShading(const Ray& primeRay, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
+};
+
+// Every face of the mesh emits, on both sides. Points are uniform by area: a
+// face is picked from a table weighted by face area, then a point in the face.
+class MeshLight : public ObjectLight{
+private:
+    Mesh* _mesh;
+
+    // Corners of the faces in world space, three per face.
+    std::vector<Eigen::Vector3f> _corners;
+    AliasTable _faces;
+    float _area;
+    BBox _box;
+
+protected:
+    bool SamplePoint(const Eigen::Vector3f& p, float u, float v, float w, Eigen::Vector3f& sample, float& pdf) const;
+    float Pdf(const Eigen::Vector3f& p, const Eigen::Vector3f& hit, const Eigen::Vector3f& normal) const;
+
+public:
+    MeshLight(Mesh* mesh, int materialIndex, const Eigen::Vector3f& radiance, int sampleCount);
+
+    void Prepare();
+    bool GetBounds(LightBounds& bounds) const;
+    bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
+};
+
+// Points outside the sphere sample the cone of directions it subtends, so
+// every sample lands on the visible cap.
+class SphereLight : public ObjectLight{
+private:
+    Sphere* _sphere;
+    Eigen::Vector3f _center;
+    float _radius;
+
+protected:
+    bool SamplePoint(const Eigen::Vector3f& p, float u, float v, float w, Eigen::Vector3f& sample, float& pdf) const;
+    float Pdf(const Eigen::Vector3f& p, const Eigen::Vector3f& hit, const Eigen::Vector3f& normal) const;
+
+public:
+    SphereLight(Sphere* sphere, int materialIndex, const Eigen::Vector3f& radiance, int sampleCount);
+
+    void Prepare();
+    bool GetBounds(LightBounds& bounds) const;
+    bool EmitPhoton(SamplerContext& sampler, const BBox& sceneBox, Ray& ray, Eigen::Vector3f& power) const;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include "LightSampler.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+
+namespace LightSampling{
+    bool ParseLightSamplingMode(const std::string& name, LightSamplingMode& mode){
+        if (name == "all"){
+            mode = AllLights;
+        }
+        else if (name == "power"){
+            mode = PowerLightSampling;
+        }
+        else if (name == "tree"){
+            mode = TreeLightSampling;
+        }
+        else{
+            return false;
+        }
+
+        return true;
+    }
+}
+
+namespace {
+    float SafeAcos(float x){
+        return acos(std::max(-1.0f, std::min(1.0f, x)));
+    }
+
+    // Smallest cone that holds both cones (Estevez and Kulla, 2018).
+    void UnionCone(const LightBounds& a, const LightBounds& b, LightBounds& result){
+        if (b.thetaO > a.thetaO){
+            UnionCone(b, a, result);
+            return;
+        }
+
+        result.thetaE = std::max(a.thetaE, b.thetaE);
+        float thetaD = SafeAcos(a.axis.dot(b.axis));
+        if (std::min(thetaD + b.thetaO, (float)M_PI) <= a.thetaO){
+            result.axis = a.axis;
+            result.thetaO = a.thetaO;
+            return;
+        }
+
+        float thetaO = (a.thetaO + thetaD + b.thetaO) * 0.5f;
+        Vector3f rotationAxis = a.axis.cross(b.axis);
+        if (thetaO >= M_PI || rotationAxis.norm() < 1e-6f){
+            result.axis = a.axis;
+            result.thetaO = M_PI;
+            return;
+        }
+
+        result.axis = AngleAxisf(thetaO - a.thetaO, rotationAxis.normalized()) * a.axis;
+        result.thetaO = thetaO;
+    }
+
+    LightBounds Union(const LightBounds& a, const LightBounds& b){
+        LightBounds result;
+        result.box.minPoint = a.box.minPoint.cwiseMin(b.box.minPoint);
+        result.box.maxPoint = a.box.maxPoint.cwiseMax(b.box.maxPoint);
+        result.power = a.power + b.power;
+        UnionCone(a, b, result);
+        return result;
+    }
+}
+
+LightSampler::LightSampler(const std::vector<Light*>& lights, LightSamplingMode mode)
+{
+    this->mode = mode;
+
+    int lightSize = lights.size();
+    for (int i = 0; i < lightSize; i++){
+        LightBounds bounds;
+        if (mode != AllLights && lights[i]->GetBounds(bounds) && bounds.power > 0){
+            sampled.push_back(i);
+            sampledBounds.push_back(bounds);
+        }
+        else{
+            unsampled.push_back(i);
+        }
+    }
+
+    if (sampled.empty()){
+        return;
+    }
+
+    if (mode == PowerLightSampling){
+        std::vector<float> powers;
+        int sampledSize = sampled.size();
+        for (int i = 0; i < sampledSize; i++){
+            powers.push_back(sampledBounds[i].power);
+        }
+        powerTable = AliasTable(powers);
+    }
+    else{
+        std::vector<int> items;
+        int sampledSize = sampled.size();
+        for (int i = 0; i < sampledSize; i++){
+            items.push_back(i);
+        }
+        nodes.reserve(2 * sampledSize - 1);
+        BuildNode(items, 0, sampledSize);
+    }
+}
+
+const std::vector<int>& LightSampler::GetUnsampledLights() const
+{
+    return unsampled;
+}
+
+int LightSampler::SampledLightCount() const
+{
+    return sampled.size();
+}
+
+// Splits the lights at the median of the longest axis of their centers.
+int LightSampler::BuildNode(std::vector<int>& items, int begin, int end)
+{
+    int index = nodes.size();
+    nodes.push_back(LightNode());
+
+    if (end - begin == 1){
+        nodes[index].bounds = sampledBounds[items[begin]];
+        nodes[index].left = -1;
+        nodes[index].right = -1;
+        nodes[index].light = items[begin];
+        return index;
+    }
+
+    Vector3f minCenter = Vector3f::Constant(INFINITY);
+    Vector3f maxCenter = Vector3f::Constant(-INFINITY);
+    for (int i = begin; i < end; i++){
+        const BBox& box = sampledBounds[items[i]].box;
+        Vector3f center = (box.minPoint + box.maxPoint) * 0.5f;
+        minCenter = minCenter.cwiseMin(center);
+        maxCenter = maxCenter.cwiseMax(center);
+    }
+
+    int axis;
+    (maxCenter - minCenter).maxCoeff(&axis);
+    int middle = (begin + end) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+                     [this, axis](int a, int b){
+        return sampledBounds[a].box.minPoint[axis] + sampledBounds[a].box.maxPoint[axis] <
+               sampledBounds[b].box.minPoint[axis] + sampledBounds[b].box.maxPoint[axis];
+    });
+
+    int left = BuildNode(items, begin, middle);
+    int right = BuildNode(items, middle, end);
+    nodes[index].bounds = Union(nodes[left].bounds, nodes[right].bounds);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].light = -1;
+    return index;
+}
+
+// Power over squared distance, or zero when the point is outside every cone of
+// emission in the node. The distance is clamped to the size of the node so close
+// nodes do not take all samples.
+float LightSampler::Importance(const LightBounds& bounds, const Eigen::Vector3f& point) const
+{
+    Vector3f center = (bounds.box.minPoint + bounds.box.maxPoint) * 0.5f;
+    float radius = (bounds.box.maxPoint - bounds.box.minPoint).norm() * 0.5f;
+    Vector3f toPoint = point - center;
+    float distance = toPoint.norm();
+
+    if (bounds.thetaO < M_PI && distance > radius){
+        float theta = SafeAcos(bounds.axis.dot(toPoint / distance));
+        float thetaU = asin(radius / distance);
+        if (theta - bounds.thetaO - thetaU >= bounds.thetaE){
+            return 0;
+        }
+    }
+
+    float distanceSquare = std::max(distance * distance, radius * radius);
+    return bounds.power / std::max(distanceSquare, 1e-8f);
+}
+
+int LightSampler::Sample(const Eigen::Vector3f& point, float u, float& probability) const
+{
+    probability = 0;
+    if (sampled.empty()){
+        return -1;
+    }
+
+    if (mode == PowerLightSampling){
+        float remapped;
+        int index = powerTable.Sample(u, remapped);
+        probability = powerTable.Probability(index);
+        return sampled[index];
+    }
+
+    // Walk down the tree, choosing each child in proportion to its importance.
+    probability = 1;
+    int node = 0;
+    while (nodes[node].light == -1){
+        float leftImportance = Importance(nodes[nodes[node].left].bounds, point);
+        float rightImportance = Importance(nodes[nodes[node].right].bounds, point);
+        if (leftImportance + rightImportance <= 0){
+            probability = 0;
+            return -1;
+        }
+
+        float leftProbability = leftImportance / (leftImportance + rightImportance);
+        if (u < leftProbability){
+            u = u / leftProbability;
+            probability *= leftProbability;
+            node = nodes[node].left;
+        }
+        else{
+            u = (u - leftProbability) / (1 - leftProbability);
+            probability *= 1 - leftProbability;
+            node = nodes[node].right;
+        }
+        u = std::min(u, 0.99999994f);
+    }
+
+    return sampled[nodes[node].light];
+}
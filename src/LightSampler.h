@@ -0,0 +1,51 @@
+#ifndef _LIGHTSAMPLER_H_
+#define _LIGHTSAMPLER_H_
+
+#include "defs.h"
+#include "Eigen/Dense"
+#include "Light.h"
+#include "Distribution.h"
+#include <string>
+#include <vector>
+
+// Chooses which light a shading point sends its shadow rays to. Lights without
+// bounds (directional and environment lights) are always shaded. The others are
+// picked by power alone, or through a light BVH that also weighs distance and
+// the direction the lights face.
+class LightSampler
+{
+public:
+    LightSampler(const std::vector<Light*>& lights, LightSamplingMode mode);
+
+    // Lights that are shaded at every point instead of being sampled.
+    const std::vector<int>& GetUnsampledLights() const;
+    int SampledLightCount() const;
+
+    // Returns the index of the chosen light and the probability it was chosen
+    // with, or -1 when no light can reach the point.
+    int Sample(const Eigen::Vector3f& point, float u, float& probability) const;
+
+private:
+    typedef struct LightNode
+    {
+        LightBounds bounds;
+        int left, right;
+        int light;
+    } LightNode;
+
+    LightSamplingMode mode;
+    std::vector<int> unsampled;
+    std::vector<int> sampled;
+    std::vector<LightBounds> sampledBounds;
+    AliasTable powerTable;
+    std::vector<LightNode> nodes;
+
+    int BuildNode(std::vector<int>& items, int begin, int end);
+    float Importance(const LightBounds& bounds, const Eigen::Vector3f& point) const;
+};
+
+namespace LightSampling{
+    bool ParseLightSamplingMode(const std::string& name, LightSamplingMode& mode);
+}
+
+#endif
@@ -1,5 +1,34 @@
 #include "Material.h"
+#include "BRDFKernels.h"
+#include <cmath>
 
 Material::Material(void)
 {
 }
+
+void Material::Prepare(void)
+{
+	brdfKernel = BRDFKernels::Select(_brdfType);
+
+	// The normalized BRDFs conserve energy: kd / pi, and the specular lobe
+	// scaled so that it integrates to ks.
+	float diffuseNormalization = 1;
+	float specularNormalization = 1;
+	if (_brdfType == NoBRDF)
+	{
+		diffuseNormalization = 1 / M_PI;
+	}
+	else if (_brdfType == Mpn || _brdfType == Ts || _brdfType == Tsf)
+	{
+		diffuseNormalization = 1 / M_PI;
+		specularNormalization = (phongExp + 2) / (2 * M_PI);
+	}
+	else if (_brdfType == Mbpn)
+	{
+		diffuseNormalization = 1 / M_PI;
+		specularNormalization = (phongExp + 8) / (8 * M_PI);
+	}
+
+	diffuseTerm = diffuseRef * diffuseNormalization;
+	specularTerm = specularRef * specularNormalization;
+}
@@ -7,6 +7,12 @@
 enum MaterialType{Normal, Mirror, Conductor, Dielectric};
 enum BRDFType{NoBRDF, Obp, Mbp, Mbpn, Op, Mp, Mpn, Ts, Tsf};
 
+class Material;
+
+// BRDF for light arriving along wi and leaving along wo, compiled for one BRDFType.
+typedef Eigen::Vector3f (*BRDFKernel)(const Eigen::Vector3f& wi, const Eigen::Vector3f& wo, const ReturnVal& ret,
+		const Material* mat);
+
 class Material
 {
 public:
@@ -26,8 +32,19 @@ public:
 	float roughness;
 	Eigen::Vector3f absorptionCoefficient;
 
+	// Emitted radiance. Only the materials of light meshes and light spheres emit.
+	Eigen::Vector3f radiance = Eigen::Vector3f(0, 0, 0);
+
+	// Set by Prepare once the material is loaded: the kernel of _brdfType, and the
+	// reflectances with the normalization of that BRDF applied.
+	BRDFKernel brdfKernel = nullptr;
+	Eigen::Vector3f diffuseTerm;
+	Eigen::Vector3f specularTerm;
+
 	Material(void);
 
+	void Prepare(void);
+
 private:
 
 };
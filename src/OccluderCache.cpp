@@ -0,0 +1,100 @@
+#include "OccluderCache.h"
+#include "Instance.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace Eigen;
+
+namespace {
+    typedef struct Occluder
+    {
+        const Shape* primitive;
+        const Instance* instance;
+    } Occluder;
+
+    // Only the owning thread writes the counters, so they are bumped without a
+    // locked add.
+    typedef struct ThreadCache
+    {
+        std::vector<Occluder> occluders;
+        std::atomic<long long> tests;
+        std::atomic<long long> hits;
+    } ThreadCache;
+
+    std::atomic<int> slotCount(0);
+    std::mutex registryMutex;
+    std::vector<ThreadCache*> registry;
+    thread_local ThreadCache* threadCache = nullptr;
+
+    ThreadCache& LocalCache(){
+        if (threadCache == nullptr){
+            threadCache = new ThreadCache;
+            threadCache->tests = 0;
+            threadCache->hits = 0;
+
+            std::lock_guard<std::mutex> lock(registryMutex);
+            registry.push_back(threadCache);
+        }
+        return *threadCache;
+    }
+
+    void Increment(std::atomic<long long>& counter){
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+namespace OccluderCache{
+    int NewSlot(){
+        return slotCount.fetch_add(1);
+    }
+
+    bool Blocks(int slot, const Ray& ray, const Vector3f& point, float lightDistance){
+        ThreadCache& cache = LocalCache();
+        Increment(cache.tests);
+        if (slot >= (int)cache.occluders.size() || cache.occluders[slot].primitive == nullptr){
+            return false;
+        }
+
+        const Occluder& occluder = cache.occluders[slot];
+        ReturnVal hit = occluder.instance->IntersectPrimitive(ray, occluder.primitive);
+        if (!hit.full || (point - hit.point).norm() >= lightDistance){
+            return false;
+        }
+
+        Increment(cache.hits);
+        return true;
+    }
+
+    void Store(int slot, const ReturnVal& occluder){
+        // Every scene object sits in one instance of the top level. Primitives of
+        // nested groups would need the whole chain of transforms, so they are skipped.
+        if (occluder.primitive == nullptr || occluder.instanceDepth != 1){
+            return;
+        }
+
+        ThreadCache& cache = LocalCache();
+        if (slot >= (int)cache.occluders.size()){
+            cache.occluders.resize(slot + 1, Occluder{nullptr, nullptr});
+        }
+        cache.occluders[slot] = Occluder{occluder.primitive, occluder.instance};
+    }
+
+    long long TestCount(){
+        std::lock_guard<std::mutex> lock(registryMutex);
+        long long total = 0;
+        for (ThreadCache* cache : registry){
+            total += cache->tests.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    long long HitCount(){
+        std::lock_guard<std::mutex> lock(registryMutex);
+        long long total = 0;
+        for (ThreadCache* cache : registry){
+            total += cache->hits.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+}
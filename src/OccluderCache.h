@@ -0,0 +1,24 @@
+#ifndef _OCCLUDERCACHE_H_
+#define _OCCLUDERCACHE_H_
+
+#include "Ray.h"
+#include "defs.h"
+#include "Eigen/Dense"
+
+// Last primitive that blocked a shadow ray towards each light, kept per thread.
+// Neighbouring pixels are usually cut off from a light by the same triangle, so
+// testing that triangle first skips the traversal for most shadowed points.
+// Lights take a slot each with NewSlot.
+namespace OccluderCache{
+    int NewSlot();
+
+    // True if the cached occluder of slot hits ray closer to point than lightDistance.
+    bool Blocks(int slot, const Ray& ray, const Eigen::Vector3f& point, float lightDistance);
+    void Store(int slot, const ReturnVal& occluder);
+
+    // Totals over all threads. Read them while no thread is rendering.
+    long long TestCount();
+    long long HitCount();
+}
+
+#endif
@@ -0,0 +1,134 @@
+#include "Packet.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace Eigen;
+
+namespace Packets{
+    int LaneCount(uint64_t mask){
+        return __builtin_popcountll(mask);
+    }
+
+    int FirstLane(uint64_t mask){
+        return __builtin_ctzll(mask);
+    }
+}
+
+RayPacket::RayPacket()
+{
+    rays.reserve(packetSize);
+    Clear();
+}
+
+void RayPacket::Clear()
+{
+    rays.clear();
+    size = 0;
+    hasFrustum = false;
+}
+
+int RayPacket::Add(const Ray& ray, float maxDistance)
+{
+    int lane = size++;
+    rays.push_back(ray);
+    originX[lane] = ray.origin[0];
+    originY[lane] = ray.origin[1];
+    originZ[lane] = ray.origin[2];
+    inverseX[lane] = 1.0f / ray.direction[0];
+    inverseY[lane] = 1.0f / ray.direction[1];
+    inverseZ[lane] = 1.0f / ray.direction[2];
+    this->maxDistance[lane] = maxDistance;
+    return lane;
+}
+
+void RayPacket::Prepare()
+{
+    hasFrustum = size > 0;
+    if (!hasFrustum){
+        return;
+    }
+
+    commonOrigin = rays[0].origin;
+    minInverse = Vector3f{inverseX[0], inverseY[0], inverseZ[0]};
+    maxInverse = minInverse;
+    for (int i = 1; i < size && hasFrustum; i++){
+        Vector3f inverse{inverseX[i], inverseY[i], inverseZ[i]};
+        hasFrustum = rays[i].origin == commonOrigin;
+        minInverse = minInverse.cwiseMin(inverse);
+        maxInverse = maxInverse.cwiseMax(inverse);
+    }
+
+    // The interval test needs every lane in the same octant and finite reciprocals.
+    for (int axis = 0; axis < 3 && hasFrustum; axis++){
+        hasFrustum = std::isfinite(minInverse[axis]) && std::isfinite(maxInverse[axis]) &&
+                     (minInverse[axis] > 0) == (maxInverse[axis] > 0);
+    }
+}
+
+int RayPacket::Size() const
+{
+    return size;
+}
+
+uint64_t RayPacket::Lanes() const
+{
+    return size == 64 ? ~0ull : (1ull << size) - 1;
+}
+
+const Ray& RayPacket::GetRay(int lane) const
+{
+    return rays[lane];
+}
+
+float RayPacket::GetMaxDistance(int lane) const
+{
+    return maxDistance[lane];
+}
+
+// Every lane enters the box no earlier than the largest lower bound of its
+// entry distances and leaves no later than the smallest upper bound of its exit
+// distances, so if those bounds cross, no lane hits the box.
+bool RayPacket::FrustumMisses(const BBox& box) const
+{
+    if (!hasFrustum){
+        return false;
+    }
+
+    float enter = 0;
+    float exit = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++){
+        float nearSlab = (minInverse[axis] > 0 ? box.minPoint[axis] : box.maxPoint[axis]) - commonOrigin[axis];
+        float farSlab = (minInverse[axis] > 0 ? box.maxPoint[axis] : box.minPoint[axis]) - commonOrigin[axis];
+        enter = std::max(enter, std::min(nearSlab * minInverse[axis], nearSlab * maxInverse[axis]));
+        exit = std::min(exit, std::max(farSlab * minInverse[axis], farSlab * maxInverse[axis]));
+    }
+
+    return enter > exit;
+}
+
+// Unlike BVH::RayBBoxIntersection, this multiplies by the reciprocal direction
+// and also drops boxes behind the origin or past the lane's max distance. At box
+// boundaries the two tests can round differently, so a packet trace may pick a
+// different one of two nearly equal hits than the scalar trace.
+uint64_t RayPacket::BoxMask(const BBox& box, uint64_t mask) const
+{
+    bool hit[packetSize];
+    for (int i = 0; i < size; i++){
+        float x0 = (box.minPoint[0] - originX[i]) * inverseX[i];
+        float x1 = (box.maxPoint[0] - originX[i]) * inverseX[i];
+        float y0 = (box.minPoint[1] - originY[i]) * inverseY[i];
+        float y1 = (box.maxPoint[1] - originY[i]) * inverseY[i];
+        float z0 = (box.minPoint[2] - originZ[i]) * inverseZ[i];
+        float z1 = (box.maxPoint[2] - originZ[i]) * inverseZ[i];
+        float enter = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::min(z0, z1));
+        float exit = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::max(z0, z1));
+        hit[i] = enter <= exit && exit >= 0 && enter <= maxDistance[i];
+    }
+
+    uint64_t result = 0;
+    for (int i = 0; i < size; i++){
+        result |= (uint64_t)hit[i] << i;
+    }
+    return result & mask;
+}
@@ -0,0 +1,61 @@
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include <cstdint>
+#include <vector>
+#include "Ray.h"
+#include "defs.h"
+#include "Eigen/Dense"
+
+// Lanes in a packet, an 8 x 8 block of pixels for camera rays.
+const int packetWidth = 8;
+const int packetSize = packetWidth * packetWidth;
+
+// Below this many active lanes a packet continues one ray at a time.
+const int minPacketLanes = 8;
+
+// Rays traced through the BVH together. Lane components are kept in separate
+// arrays so the box test is a plain loop the compiler can vectorize, and the
+// lanes that hit a box are returned as a bit mask. When all rays share an
+// origin and a direction octant, the packet also keeps interval bounds of the
+// reciprocal directions, which reject a box for every lane with one test.
+class RayPacket
+{
+public:
+    RayPacket();
+
+    void Clear();
+    int Add(const Ray& ray, float maxDistance);
+    void Prepare();
+
+    int Size() const;
+    uint64_t Lanes() const;
+    const Ray& GetRay(int lane) const;
+    float GetMaxDistance(int lane) const;
+
+    bool FrustumMisses(const BBox& box) const;
+    uint64_t BoxMask(const BBox& box, uint64_t mask) const;
+
+private:
+    std::vector<Ray> rays;
+    int size;
+    float originX[packetSize];
+    float originY[packetSize];
+    float originZ[packetSize];
+    float inverseX[packetSize];
+    float inverseY[packetSize];
+    float inverseZ[packetSize];
+    float maxDistance[packetSize];
+
+    bool hasFrustum;
+    Eigen::Vector3f commonOrigin;
+    Eigen::Vector3f minInverse;
+    Eigen::Vector3f maxInverse;
+};
+
+namespace Packets{
+    int LaneCount(uint64_t mask);
+    int FirstLane(uint64_t mask);
+}
+
+#endif
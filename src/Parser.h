@@ -3,6 +3,9 @@
 
 #include "Instance.h"
 #include "Texture.h"
+#include "Tile.h"
+#include "ThreadPool.h"
+#include "LightSampler.h"
 
 using namespace tinyxml2;
 using namespace Eigen;
@@ -49,6 +52,273 @@ namespace Parser{
         }
     }
 
+    void ParseRenderSettings(XMLNode* pRoot, int &tileSize, TileOrder &tileOrder, int &threadCount, bool &pinThreads,
+            bool &deterministic, unsigned int &seed, bool &concurrentCameras, SamplerType &samplerType){
+        XMLElement* pElement;
+
+        tileSize = defaultTileSize;
+        tileOrder = MortonOrder;
+        threadCount = 0;
+        pinThreads = false;
+        deterministic = false;
+        seed = 0;
+        concurrentCameras = false;
+        samplerType = RandomSamplerType;
+
+        // Zero threads means one per CPU the process may use.
+        pElement = pRoot->FirstChildElement("ThreadCount");
+        if (pElement != nullptr){
+            pElement->QueryIntText(&threadCount);
+        }
+
+        pElement = pRoot->FirstChildElement("PinThreads");
+        if (pElement != nullptr){
+            pElement->QueryBoolText(&pinThreads);
+        }
+
+        // A deterministic render gives the same image for any thread count and tile order.
+        pElement = pRoot->FirstChildElement("Deterministic");
+        if (pElement != nullptr){
+            pElement->QueryBoolText(&deterministic);
+        }
+
+        pElement = pRoot->FirstChildElement("Seed");
+        if (pElement != nullptr){
+            pElement->QueryUnsignedText(&seed);
+            deterministic = true;
+        }
+
+        pElement = pRoot->FirstChildElement("Sampler");
+        if (pElement != nullptr){
+            std::string type = pElement->GetText() ? pElement->GetText() : "";
+            if (!Sampling::ParseSamplerType(type, samplerType)){
+                std::cerr << "Unknown Sampler " << type << ", using random." << std::endl;
+            }
+        }
+
+        // Render the tiles of all cameras from one queue instead of one camera after another.
+        pElement = pRoot->FirstChildElement("ConcurrentCameras");
+        if (pElement != nullptr){
+            pElement->QueryBoolText(&concurrentCameras);
+        }
+
+        pElement = pRoot->FirstChildElement("TileSize");
+        if (pElement != nullptr){
+            pElement->QueryIntText(&tileSize);
+            if (tileSize < 1){
+                std::cerr << "TileSize must be positive, using " << defaultTileSize << "." << std::endl;
+                tileSize = defaultTileSize;
+            }
+        }
+
+        pElement = pRoot->FirstChildElement("TileOrder");
+        if (pElement != nullptr){
+            std::string order = pElement->GetText() ? pElement->GetText() : "";
+            if (order == "spiral"){
+                tileOrder = SpiralOrder;
+            }
+            else if (order == "scanline"){
+                tileOrder = ScanlineOrder;
+            }
+            else if (order == "cost"){
+                tileOrder = CostOrder;
+            }
+            else if (order != "morton"){
+                std::cerr << "Unknown TileOrder " << order << ", using morton." << std::endl;
+            }
+        }
+    }
+
+    void ParseProgressive(XMLNode* pRoot, bool &progressive, float &timeBudget, float &snapshotInterval,
+            int &targetSamples){
+        progressive = false;
+        timeBudget = 0;
+        snapshotInterval = 0;
+        targetSamples = 0;
+
+        // Zero means no limit for the budget and the snapshots. A zero target means
+        // rendering until the budget is spent, or NumSamples without a budget.
+        XMLElement* pElement = pRoot->FirstChildElement("Progressive");
+        if (pElement == nullptr){
+            return;
+        }
+
+        progressive = true;
+        XMLElement* progressiveElement = pElement->FirstChildElement("TimeBudget");
+        if (progressiveElement != nullptr){
+            progressiveElement->QueryFloatText(&timeBudget);
+        }
+        progressiveElement = pElement->FirstChildElement("SnapshotInterval");
+        if (progressiveElement != nullptr){
+            progressiveElement->QueryFloatText(&snapshotInterval);
+        }
+        progressiveElement = pElement->FirstChildElement("TargetSamples");
+        if (progressiveElement != nullptr){
+            progressiveElement->QueryIntText(&targetSamples);
+        }
+    }
+
+    void ParseLightSampling(XMLNode* pRoot, LightSamplingMode &lightSampling, int &shadowRayBudget){
+        lightSampling = AllLights;
+        shadowRayBudget = 1;
+
+        XMLElement* pElement = pRoot->FirstChildElement("LightSampling");
+        if (pElement == nullptr){
+            return;
+        }
+
+        XMLElement* samplingElement = pElement->FirstChildElement("Mode");
+        if (samplingElement != nullptr){
+            std::string mode = samplingElement->GetText() ? samplingElement->GetText() : "";
+            if (!LightSampling::ParseLightSamplingMode(mode, lightSampling)){
+                std::cerr << "Unknown LightSampling mode " << mode << ", using all." << std::endl;
+            }
+        }
+
+        // Shadow rays per shading point for the sampled lights.
+        samplingElement = pElement->FirstChildElement("ShadowRays");
+        if (samplingElement != nullptr){
+            samplingElement->QueryIntText(&shadowRayBudget);
+            if (shadowRayBudget < 1){
+                std::cerr << "ShadowRays must be positive, using 1." << std::endl;
+                shadowRayBudget = 1;
+            }
+        }
+    }
+
+    void ParseIntegrator(XMLNode* pRoot, IntegratorType &integrator, int &rouletteDepth, bool &stochasticDielectrics,
+            float &pruneThreshold){
+        integrator = WhittedIntegrator;
+        rouletteDepth = 3;
+        stochasticDielectrics = false;
+        pruneThreshold = 0;
+
+        XMLElement* pElement = pRoot->FirstChildElement("Integrator");
+        if (pElement == nullptr){
+            return;
+        }
+
+        const char* type = pElement->Attribute("type");
+        if (type != nullptr){
+            if (!ParseIntegratorType(type, integrator)){
+                std::cerr << "Unknown Integrator " << type << ", using whitted." << std::endl;
+            }
+        }
+
+        // Bounces before Russian roulette may end a path.
+        XMLElement* integratorElement = pElement->FirstChildElement("RouletteDepth");
+        if (integratorElement != nullptr){
+            integratorElement->QueryIntText(&rouletteDepth);
+        }
+
+        // Whitted only: follow one branch at dielectric hits, and randomly drop
+        // branches whose weight is below the threshold. Zero never prunes.
+        integratorElement = pElement->FirstChildElement("StochasticDielectrics");
+        if (integratorElement != nullptr){
+            integratorElement->QueryBoolText(&stochasticDielectrics);
+        }
+        integratorElement = pElement->FirstChildElement("PruneThreshold");
+        if (integratorElement != nullptr){
+            integratorElement->QueryFloatText(&pruneThreshold);
+        }
+    }
+
+    void ParseWavefront(XMLNode* pRoot, bool &wavefront, int &wavefrontBatch, bool &reorderRays){
+        wavefront = false;
+        wavefrontBatch = defaultWavefrontBatch;
+        reorderRays = true;
+
+        XMLElement* pElement = pRoot->FirstChildElement("Wavefront");
+        if (pElement == nullptr){
+            return;
+        }
+
+        // Camera rays traced together. Rows of a tile are added until a batch is full.
+        wavefront = true;
+        XMLElement* wavefrontElement = pElement->FirstChildElement("BatchSize");
+        if (wavefrontElement != nullptr){
+            wavefrontElement->QueryIntText(&wavefrontBatch);
+            if (wavefrontBatch < 1){
+                std::cerr << "BatchSize must be positive, using " << defaultWavefrontBatch << "." << std::endl;
+                wavefrontBatch = defaultWavefrontBatch;
+            }
+        }
+
+        // Sort secondary rays and packed shadow rays by direction octant and origin
+        // before they are intersected.
+        wavefrontElement = pElement->FirstChildElement("ReorderRays");
+        if (wavefrontElement != nullptr){
+            wavefrontElement->QueryBoolText(&reorderRays);
+        }
+    }
+
+    void ParsePacketTraversal(XMLNode* pRoot, bool &packetTraversal){
+        packetTraversal = false;
+
+        // Camera rays and point light shadow rays go through the BVH in packets.
+        XMLElement* pElement = pRoot->FirstChildElement("PacketTraversal");
+        if (pElement != nullptr){
+            pElement->QueryBoolText(&packetTraversal);
+        }
+    }
+
+    void ParseOccluderCache(XMLNode* pRoot, bool &occluderCache){
+        occluderCache = true;
+
+        // Point and spot light shadow rays first test the primitive that blocked the last one.
+        XMLElement* pElement = pRoot->FirstChildElement("OccluderCache");
+        if (pElement != nullptr){
+            pElement->QueryBoolText(&occluderCache);
+        }
+    }
+
+    void ParseCaustics(XMLNode* pRoot, int &causticPhotons, float &photonRadius){
+        causticPhotons = 0;
+        photonRadius = 0;
+
+        XMLElement* pElement = pRoot->FirstChildElement("Caustics");
+        if (pElement == nullptr){
+            return;
+        }
+
+        // Photons emitted from the lights before rendering, for the whitted integrator.
+        XMLElement* causticsElement = pElement->FirstChildElement("PhotonCount");
+        if (causticsElement != nullptr){
+            causticsElement->QueryIntText(&causticPhotons);
+        }
+
+        // Lookup radius of the density estimate. Zero picks one from the photons found.
+        causticsElement = pElement->FirstChildElement("Radius");
+        if (causticsElement != nullptr){
+            causticsElement->QueryFloatText(&photonRadius);
+        }
+    }
+
+    void ParseIrradianceCache(XMLNode* pRoot, bool &useIrradianceCache, float &cacheTolerance, int &cacheSamples){
+        useIrradianceCache = false;
+        cacheTolerance = 0.2f;
+        cacheSamples = 128;
+
+        XMLElement* pElement = pRoot->FirstChildElement("IrradianceCache");
+        if (pElement == nullptr){
+            return;
+        }
+        // Deterministic renders leave the cache off: its records depend on the render order.
+        useIrradianceCache = true;
+
+        // Largest interpolation error allowed. Smaller values store more records.
+        XMLElement* cacheElement = pElement->FirstChildElement("Tolerance");
+        if (cacheElement != nullptr){
+            cacheElement->QueryFloatText(&cacheTolerance);
+        }
+
+        // Hemisphere rays traced for each new record.
+        cacheElement = pElement->FirstChildElement("Samples");
+        if (cacheElement != nullptr){
+            cacheElement->QueryIntText(&cacheSamples);
+        }
+    }
+
     void ParseCameras(XMLNode* pRoot, std::vector<Camera*> &cameras){
         const char* str;
         XMLError eResult;
@@ -157,8 +427,29 @@ namespace Parser{
                 imgPlane.right = x;
             }
 
-            cameras.push_back(new Camera(id, numSamples, imageName, pos, gaze, up, imgPlane, focusDistance, apertureSize,
-                    isDof, isLeftHanded));
+            Camera* camera = new Camera(id, numSamples, imageName, pos, gaze, up, imgPlane, focusDistance, apertureSize,
+                    isDof, isLeftHanded);
+
+            // Parse adaptive sampling.
+            camElement = pCamera->FirstChildElement("AdaptiveSampling");
+            if (camElement){
+                camera->adaptive.enabled = true;
+                XMLElement* adaptiveElement = camElement->FirstChildElement("MinSamples");
+                if (adaptiveElement){
+                    adaptiveElement->QueryIntText(&camera->adaptive.minSamples);
+                }
+                adaptiveElement = camElement->FirstChildElement("Threshold");
+                if (adaptiveElement){
+                    adaptiveElement->QueryFloatText(&camera->adaptive.threshold);
+                }
+                adaptiveElement = camElement->FirstChildElement("SampleCountImage");
+                if (adaptiveElement && adaptiveElement->GetText()){
+                    strncpy(camera->adaptive.countImageName, adaptiveElement->GetText(), 63);
+                    camera->adaptive.countImageName[63] = '\0';
+                }
+            }
+
+            cameras.push_back(camera);
             pCamera = pCamera->NextSiblingElement("Camera");
         }
     }
@@ -468,6 +759,8 @@ namespace Parser{
                 materials[curr]->absorptionCoefficient(2) = 0.0;
             }
 
+            materials[curr]->Prepare();
+
             // Move onto the next element.
             pMaterial = pMaterial->NextSiblingElement("Material");
         }
@@ -513,6 +806,7 @@ namespace Parser{
             }
         }
 
+        std::vector<std::future<Texture*>> loading;
         XMLElement* textureElement;
         XMLElement* pTextureMap = pElement->FirstChildElement("TextureMap");
         while(pTextureMap != nullptr){
@@ -594,14 +888,25 @@ namespace Parser{
                 textureElement->QueryFloatText(&bumpFactor);
             }
 
+            // Image files are decoded on the pool; the texture order is kept by collecting futures in order.
             if (isImage){
-                textures.push_back(new Texture(images[imageId-1], dm, interpolation, ImageTexture, normalizer, bumpFactor));
+                std::string imageName = images[imageId-1];
+                loading.push_back(pPool->Submit([imageName, dm, interpolation, normalizer, bumpFactor]() mutable {
+                    return new Texture(imageName, dm, interpolation, ImageTexture, normalizer, bumpFactor);
+                }));
             }
             else{
-                textures.push_back(new Texture(dm, interpolation, PerlinTexture, nc, normalizer, noiseScale, bumpFactor));
+                std::promise<Texture*> perlinTexture;
+                perlinTexture.set_value(new Texture(dm, interpolation, PerlinTexture, nc, normalizer, noiseScale, bumpFactor));
+                loading.push_back(perlinTexture.get_future());
             }
             pTextureMap = pTextureMap->NextSiblingElement("TextureMap");
         }
+
+        int loadingSize = loading.size();
+        for (int i = 0; i < loadingSize; i++){
+            textures.push_back(loading[i].get());
+        }
     }
 
     void ParseTransformations(XMLNode* pRoot, std::vector<Transformation*> &translations,
@@ -795,77 +1100,412 @@ namespace Parser{
         }
     }
 
-    void ParseObjects(XMLNode* pRoot, const char* xmlPath, std::vector<Shape*> &objects, std::vector<Instance*> &instances,
-            std::vector<Vector3f> &vertices, std::vector<Vector2f> &textureCoordinates){
+    // Parses the motion of an object or instance. MotionBlur is a translation reached at time 1,
+    // Motion holds keyframes with optional Translation, Rotation and Scaling at a given time.
+    MotionTrack* ParseMotion(XMLElement* pObject){
         const char* str;
         XMLError eResult;
+        std::vector<Keyframe> keyframes;
+        Keyframe identity = {0, glm::vec3(0, 0, 0), glm::quat(1, 0, 0, 0), glm::vec3(1, 1, 1)};
 
-        XMLElement* pElement = pRoot->FirstChildElement("Objects");
+        XMLElement* objElement = pObject->FirstChildElement("MotionBlur");
+        if (objElement != nullptr){
+            Keyframe key = identity;
+            key.time = 1;
+            str = objElement->GetText();
+            sscanf(str, "%f %f %f", &key.translation[0], &key.translation[1], &key.translation[2]);
 
-        // Parse spheres
-        std::cout << "- Parsing spheres." << std::endl;
-        XMLElement* pObject = pElement->FirstChildElement("Sphere");
+            keyframes.push_back(identity);
+            keyframes.push_back(key);
+            return new MotionTrack(keyframes);
+        }
+
+        objElement = pObject->FirstChildElement("Motion");
+        if (objElement == nullptr){
+            return nullptr;
+        }
+
+        XMLElement* keyElement;
+        XMLElement* pKeyframe = objElement->FirstChildElement("Keyframe");
+        while (pKeyframe != nullptr){
+            Keyframe key = identity;
+            eResult = pKeyframe->QueryFloatAttribute("time", &key.time);
+
+            keyElement = pKeyframe->FirstChildElement("Translation");
+            if (keyElement != nullptr){
+                str = keyElement->GetText();
+                sscanf(str, "%f %f %f", &key.translation[0], &key.translation[1], &key.translation[2]);
+            }
+
+            keyElement = pKeyframe->FirstChildElement("Rotation");
+            if (keyElement != nullptr){
+                float angle;
+                glm::vec3 axis;
+                str = keyElement->GetText();
+                sscanf(str, "%f %f %f %f", &angle, &axis[0], &axis[1], &axis[2]);
+                key.rotation = glm::angleAxis(glm::radians(angle), glm::normalize(axis));
+            }
+
+            keyElement = pKeyframe->FirstChildElement("Scaling");
+            if (keyElement != nullptr){
+                str = keyElement->GetText();
+                sscanf(str, "%f %f %f", &key.scale[0], &key.scale[1], &key.scale[2]);
+            }
+
+            keyframes.push_back(key);
+            pKeyframe = pKeyframe->NextSiblingElement("Keyframe");
+        }
+
+        if (keyframes.empty()){
+            return nullptr;
+        }
+
+        return new MotionTrack(keyframes);
+    }
+
+    // Parses a MeshInstance element. The base is given by exactly one of baseMeshId, baseGroupId or
+    // baseInstanceId, and may only refer to elements parsed before this one.
+    Instance* ParseInstance(XMLElement* pObject, std::vector<Shape*> &objects, int meshStartIndex,
+            std::vector<Group*> &groups, std::vector<Instance*> &parsedInstances){
+        const char* str;
+        XMLError eResult;
         XMLElement* objElement;
-        while (pObject != nullptr)
-        {
-            int id;
-            int matIndex;
-            int cIndex;
-            float R;
-            bool isBlur = false;
-            glm::vec3 blurTransformation = {0,0,0};
-            std::vector<Transformation*> transformations;
 
-            eResult = pObject->QueryIntAttribute("id", &id);
-            objElement = pObject->FirstChildElement("Material");
+        int id, baseId;
+        int matIndex = -1;
+        bool resetTransform = false;
+        std::vector<Transformation*> transformations;
+        Shape* base = nullptr;
+        Instance* baseInstance = nullptr;
+
+        eResult = pObject->QueryIntAttribute("id", &id);
+        eResult = pObject->QueryBoolAttribute("resetTransform", &resetTransform);
+
+        if (pObject->QueryIntAttribute("baseMeshId", &baseId) == XML_SUCCESS){
+            int objectSize = objects.size();
+            for(int i = meshStartIndex; i < objectSize; i++){
+                if (objects[i]->id == baseId){
+                    base = objects[i];
+                }
+            }
+        }
+        else if (pObject->QueryIntAttribute("baseGroupId", &baseId) == XML_SUCCESS){
+            int groupSize = groups.size();
+            for(int i = 0; i < groupSize; i++){
+                if (groups[i]->id == baseId){
+                    base = groups[i];
+                }
+            }
+        }
+        else if (pObject->QueryIntAttribute("baseInstanceId", &baseId) == XML_SUCCESS){
+            int instanceSize = parsedInstances.size();
+            for(int i = 0; i < instanceSize; i++){
+                if (parsedInstances[i]->id == baseId){
+                    baseInstance = parsedInstances[i];
+                    base = baseInstance->base;
+                    matIndex = baseInstance->matIndex;
+                }
+            }
+        }
+
+        if (base == nullptr){
+            std::cerr << "Base of mesh instance " << id << " not found, skipping." << std::endl;
+            return nullptr;
+        }
+
+        // Material is optional. Without it the materials of the base are used.
+        objElement = pObject->FirstChildElement("Material");
+        if (objElement != nullptr){
             eResult = objElement->QueryIntText(&matIndex);
+        }
 
-            // Parse object transformations.
-            objElement = pObject->FirstChildElement("Transformations");
-            if (objElement != nullptr){
-                str = objElement->GetText();
-                ParseObjectTransformations(str, transformations);
+        // Parse object transformations.
+        objElement = pObject->FirstChildElement("Transformations");
+        if (objElement != nullptr){
+            str = objElement->GetText();
+            ParseObjectTransformations(str, transformations);
+        }
+
+        // Parse motion blur and keyframed motion.
+        MotionTrack* motion = ParseMotion(pObject);
+
+        return new Instance(id, base, baseInstance, matIndex, resetTransform, transformations, motion);
+    }
+
+    // Parses a Sphere or LightSphere element. The caller reads the material and motion.
+    Sphere* ParseSphere(XMLElement* pObject, int matIndex, MotionTrack* motion){
+        const char* str;
+        XMLError eResult;
+        XMLElement* objElement;
+
+        int id;
+        int cIndex;
+        float R;
+        std::vector<Transformation*> transformations;
+
+        eResult = pObject->QueryIntAttribute("id", &id);
+
+        // Parse object transformations.
+        objElement = pObject->FirstChildElement("Transformations");
+        if (objElement != nullptr){
+            str = objElement->GetText();
+            ParseObjectTransformations(str, transformations);
+        }
+
+        // Parse texture id
+        std::vector<int> textures;
+        int textureOne, textureTwo;
+        objElement = pObject->FirstChildElement("Textures");
+        if (objElement != nullptr){
+            str = objElement->GetText();
+            bool isTwo = false;
+            for (int i = 0; str[i] != '\0'; i++){
+                if (str[i] == ' '){
+                    isTwo = true;
+                }
             }
 
-            // Parse texture id
-            std::vector<int> textures;
-            int textureOne, textureTwo;
-            objElement = pObject->FirstChildElement("Textures");
-            if (objElement != nullptr){
-                str = objElement->GetText();
-                bool isTwo = false;
-                for (int i = 0; str[i] != '\0'; i++){
-                    if (str[i] == ' '){
-                        isTwo = true;
-                    }
+            if (isTwo){
+                sscanf(str, "%d %d", &textureOne, &textureTwo);
+                textures.push_back(textureOne);
+                textures.push_back(textureTwo);
+            }
+            else{
+                sscanf(str, "%d", &textureOne);
+                textures.push_back(textureOne);
+            }
+        }
+
+        objElement = pObject->FirstChildElement("Center");
+        eResult = objElement->QueryIntText(&cIndex);
+        objElement = pObject->FirstChildElement("Radius");
+        eResult = objElement->QueryFloatText(&R);
+
+        Sphere* sphere = new Sphere(id, matIndex, cIndex, R, transformations, motion);
+        sphere->textures = textures;
+        return sphere;
+    }
+
+    // Parses a Mesh or LightMesh element, with faces given inline or in a PLY file. The caller
+    // reads the material and motion.
+    Mesh* ParseMesh(XMLElement* pObject, const char* xmlPath, int matIndex, MotionTrack* motion,
+            std::vector<Vector3f> &vertices, std::vector<Vector2f> &textureCoordinates){
+        const char* str;
+        XMLError eResult;
+        XMLElement* objElement;
+
+        int id, p1Index, p2Index, p3Index, cursor, vertexOffset, textureOffset;
+        cursor = 0;
+        vertexOffset = 0;
+        textureOffset = 0;
+
+        std::vector<Triangle*> faces;
+        std::vector<Transformation*> transformations;
+
+        eResult = pObject->QueryIntAttribute("id", &id);
+
+        // Parse Is Smooth
+        bool isSmooth = false;
+        const XMLAttribute* attr = pObject->FirstAttribute();
+        while (attr != nullptr)
+        {
+            if (std::strncmp(attr->Name(), "shadingMode", 11) != 0)
+            {
+                attr = attr->Next();
+                continue;
+            }
+
+            if (std::strncmp(attr->Value(), "smooth", 6) == 0)
+            {
+                isSmooth = true;
+            }
+            break;
+        }
+
+        // Parse object transformations.
+        objElement = pObject->FirstChildElement("Transformations");
+        if (objElement != nullptr){
+            str = objElement->GetText();
+            ParseObjectTransformations(str, transformations);
+        }
+
+        // Parse texture id
+        std::vector<int> textures;
+        int textureOne, textureTwo;
+        objElement = pObject->FirstChildElement("Textures");
+        if (objElement != nullptr){
+            str = objElement->GetText();
+            bool isTwo = false;
+            for (int i = 0; str[i] != '\0'; i++){
+                if (str[i] == ' '){
+                    isTwo = true;
                 }
+            }
 
-                if (isTwo){
-                    sscanf(str, "%d %d", &textureOne, &textureTwo);
-                    textures.push_back(textureOne);
-                    textures.push_back(textureTwo);
+            if (isTwo){
+                sscanf(str, "%d %d", &textureOne, &textureTwo);
+                textures.push_back(textureOne);
+                textures.push_back(textureTwo);
+            }
+            else{
+                sscanf(str, "%d", &textureOne);
+                textures.push_back(textureOne);
+            }
+        }
+
+        objElement = pObject->FirstChildElement("Faces");
+
+        // Parse PLY File ---------> BEGIN.
+        bool isPly = false;
+        attr = objElement->FirstAttribute();
+        while (attr != nullptr)
+        {
+            if (std::strncmp(attr->Name(), "plyFile", 7) != 0)
+            {
+                attr = attr->Next();
+                continue;
+            }
+
+            isPly = true;
+            break;
+        }
+        if (isPly)
+        {
+            // Get path of ply file.
+            std::string plyPath = "";
+            int lastIndex = 0;
+            for (int i = 0; xmlPath[i] != '\0'; i++){
+                if (xmlPath[i] == '/'){
+                    lastIndex = i;
+                }
+            }
+            for (int i = 0; i <= lastIndex; i++){
+                plyPath += xmlPath[i];
+            }
+            plyPath += attr->Value();
+
+            happly::PLYData plyIn(plyPath);
+
+            textureOffset = textureCoordinates.size() + 1;
+            if (plyIn.getElement("vertex").hasProperty("u")){
+                std::vector<double> u = plyIn.getElement("vertex").getProperty<double>("u");
+                std::vector<double> v = plyIn.getElement("vertex").getProperty<double>("v");
+
+                Vector2f txtCoordinate;
+                int uSize = u.size();
+                for (int i = 0; i < uSize; i++){
+                    txtCoordinate[0] = u[i];
+                    txtCoordinate[1] = v[i];
+                    textureCoordinates.push_back(txtCoordinate);
+                }
+            }
+
+            std::vector<std::vector<size_t>> fInd = plyIn.getFaceIndices<size_t>();
+            int fIndSize = fInd.size();
+            int vertexCount = vertices.size() + 1;
+            for (int i = 0; i < fIndSize; i++)
+            {
+                if (fInd[i].size() == 4){
+                    p1Index = fInd[i][0] + vertexCount;
+                    p2Index = fInd[i][1] + vertexCount;
+                    p3Index = fInd[i][2] + vertexCount;
+                    faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
+
+                    p1Index = fInd[i][2] + vertexCount;
+                    p2Index = fInd[i][3] + vertexCount;
+                    p3Index = fInd[i][0] + vertexCount;
+                    faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
                 }
                 else{
-                    sscanf(str, "%d", &textureOne);
-                    textures.push_back(textureOne);
+                    p1Index = fInd[i][0] + vertexCount;
+                    p2Index = fInd[i][1] + vertexCount;
+                    p3Index = fInd[i][2] + vertexCount;
+                    faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
                 }
             }
 
-            // Parse motion blur.
-            objElement = pObject->FirstChildElement("MotionBlur");
-            if (objElement != nullptr){
-                isBlur = true;
-                str = objElement->GetText();
-                sscanf(str, "%f %f %f", &blurTransformation[0], &blurTransformation[1], &blurTransformation[2]);
+            std::vector<std::array<double, 3>> vPos = plyIn.getVertexPositions();
+            int vPosSize = vPos.size();
+            Vector3f vertex;
+            for (int i = 0; i < vPosSize; i++)
+            {
+                vertex[0] = vPos[i][0];
+                vertex[1] = vPos[i][1];
+                vertex[2] = vPos[i][2];
+                vertices.push_back(vertex);
             }
 
-            objElement = pObject->FirstChildElement("Center");
-            eResult = objElement->QueryIntText(&cIndex);
-            objElement = pObject->FirstChildElement("Radius");
-            eResult = objElement->QueryFloatText(&R);
+            vertexOffset = vertexCount;
+            Mesh* mesh = new Mesh(id, matIndex, faces, transformations, motion, isSmooth);
+            mesh->textures = textures;
+            mesh->textureOffset = textureOffset - vertexOffset;
+            return mesh;
+        }
+        // Parse PLY File ---------> COMPLETED.
 
-            objects.push_back(new Sphere(id, matIndex, cIndex, R, transformations, blurTransformation, isBlur));
-            objects[objects.size()-1]->textures = textures;
+        cursor = 0;
+        objElement->QueryIntAttribute("vertexOffset", &vertexOffset);
+        objElement->QueryIntAttribute("textureOffset", &textureOffset);
+        str = objElement->GetText();
+        while (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
+        {
+            cursor++;
+        }
+        while (str[cursor] != '\0')
+        {
+            for (int cnt = 0; cnt < 3; cnt++)
+            {
+                if (cnt == 0)
+                {
+                    p1Index = atoi(str + cursor) + vertexOffset;
+                }
+                else if (cnt == 1)
+                {
+                    p2Index = atoi(str + cursor) + vertexOffset;
+                }
+                else
+                {
+                    p3Index = atoi(str + cursor) + vertexOffset;
+                }
+                while (str[cursor] != '\0' && str[cursor] != ' ' && str[cursor] != '\t' && str[cursor] != '\n')
+                {
+                    cursor++;
+                }
+                while (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
+                {
+                    cursor++;
+                }
+            }
+            faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
+        }
+
+        Mesh* mesh = new Mesh(id, matIndex, faces, transformations, motion, isSmooth);
+        mesh->textures = textures;
+        mesh->textureOffset = textureOffset - vertexOffset;
+        return mesh;
+    }
+
+    void ParseObjects(XMLNode* pRoot, const char* xmlPath, std::vector<Shape*> &objects, std::vector<Group*> &groups,
+            std::vector<Instance*> &instances, std::vector<Vector3f> &vertices, std::vector<Vector2f> &textureCoordinates){
+        const char* str;
+        XMLError eResult;
+
+        XMLElement* pElement = pRoot->FirstChildElement("Objects");
+
+        // Parse spheres
+        std::cout << "- Parsing spheres." << std::endl;
+        XMLElement* pObject = pElement->FirstChildElement("Sphere");
+        XMLElement* objElement;
+        while (pObject != nullptr)
+        {
+            int matIndex;
+            objElement = pObject->FirstChildElement("Material");
+            eResult = objElement->QueryIntText(&matIndex);
+
+            // Parse motion blur and keyframed motion.
+            MotionTrack* motion = ParseMotion(pObject);
+
+            objects.push_back(ParseSphere(pObject, matIndex, motion));
 
             pObject = pObject->NextSiblingElement("Sphere");
         }
@@ -880,8 +1520,6 @@ namespace Parser{
             int p1Index;
             int p2Index;
             int p3Index;
-            bool isBlur = false;
-            glm::vec3 blurTransformation = {0,0,0};
             std::vector<Transformation*> transformations;
 
             eResult = pObject->QueryIntAttribute("id", &id);
@@ -919,19 +1557,14 @@ namespace Parser{
                 }
             }
 
-            // Parse motion blur.
-            objElement = pObject->FirstChildElement("MotionBlur");
-            if (objElement != nullptr){
-                isBlur = true;
-                str = objElement->GetText();
-                sscanf(str, "%f %f %f", &blurTransformation[0], &blurTransformation[1], &blurTransformation[2]);
-            }
+            // Parse motion blur and keyframed motion.
+            MotionTrack* motion = ParseMotion(pObject);
 
             objElement = pObject->FirstChildElement("Indices");
             str = objElement->GetText();
             sscanf(str, "%d %d %d", &p1Index, &p2Index, &p3Index);
 
-            objects.push_back(new Triangle(id, matIndex, p1Index, p2Index, p3Index, transformations, blurTransformation, isBlur));
+            objects.push_back(new Triangle(id, matIndex, p1Index, p2Index, p3Index, transformations, motion));
             objects[objects.size()-1]->textures = textures;
 
             pObject = pObject->NextSiblingElement("Triangle");
@@ -943,254 +1576,142 @@ namespace Parser{
         pObject = pElement->FirstChildElement("Mesh");
         while (pObject != nullptr)
         {
-            int id, matIndex, p1Index, p2Index, p3Index, cursor, vertexOffset, textureOffset;
-            cursor = 0;
-            vertexOffset = 0;
-            textureOffset = 0;
-            bool isBlur = false;
-
-            glm::vec3 blurTransformation = {0,0,0};
-            std::vector<Triangle*> faces;
-            std::vector<Transformation*> transformations;
+            int matIndex;
+            objElement = pObject->FirstChildElement("Material");
+            eResult = objElement->QueryIntText(&matIndex);
 
-            eResult = pObject->QueryIntAttribute("id", &id);
+            // Parse motion blur and keyframed motion.
+            MotionTrack* motion = ParseMotion(pObject);
 
-            // Parse Is Smooth
-            bool isSmooth = false;
-            const XMLAttribute* attr = pObject->FirstAttribute();
-            while (attr != nullptr)
-            {
-                if (std::strncmp(attr->Name(), "shadingMode", 11) != 0)
-                {
-                    attr = attr->Next();
-                    continue;
-                }
+            objects.push_back(ParseMesh(pObject, xmlPath, matIndex, motion, vertices, textureCoordinates));
 
-                if (std::strncmp(attr->Value(), "smooth", 6) == 0)
-                {
-                    isSmooth = true;
-                }
-                break;
-            }
+            pObject = pObject->NextSiblingElement("Mesh");
+        }
 
-            objElement = pObject->FirstChildElement("Material");
-            eResult = objElement->QueryIntText(&matIndex);
+        // Parse instance groups.
+        std::vector<Instance*> parsedInstances;
+        std::cout << "- Parsing instance groups." << std::endl;
+        pObject = pElement->FirstChildElement("InstanceGroup");
+        while(pObject != nullptr){
+            int id;
+            std::vector<Instance*> members;
+            std::vector<Transformation*> transformations;
 
-            // Parse object transformations.
+            eResult = pObject->QueryIntAttribute("id", &id);
+
+            // Parse group transformations.
             objElement = pObject->FirstChildElement("Transformations");
             if (objElement != nullptr){
                 str = objElement->GetText();
                 ParseObjectTransformations(str, transformations);
             }
 
-            // Parse texture id
-            std::vector<int> textures;
-            int textureOne, textureTwo;
-            objElement = pObject->FirstChildElement("Textures");
-            if (objElement != nullptr){
-                str = objElement->GetText();
-                bool isTwo = false;
-                for (int i = 0; str[i] != '\0'; i++){
-                    if (str[i] == ' '){
-                        isTwo = true;
-                    }
-                }
-
-                if (isTwo){
-                    sscanf(str, "%d %d", &textureOne, &textureTwo);
-                    textures.push_back(textureOne);
-                    textures.push_back(textureTwo);
-                }
-                else{
-                    sscanf(str, "%d", &textureOne);
-                    textures.push_back(textureOne);
+            objElement = pObject->FirstChildElement("MeshInstance");
+            while(objElement != nullptr){
+                Instance* instance = ParseInstance(objElement, objects, meshStartIndex, groups, parsedInstances);
+                if (instance != nullptr){
+                    members.push_back(instance);
+                    parsedInstances.push_back(instance);
                 }
+                objElement = objElement->NextSiblingElement("MeshInstance");
             }
 
-            // Parse motion blur.
-            objElement = pObject->FirstChildElement("MotionBlur");
-            if (objElement != nullptr){
-                isBlur = true;
-                str = objElement->GetText();
-                sscanf(str, "%f %f %f", &blurTransformation[0], &blurTransformation[1], &blurTransformation[2]);
-            }
-
-            objElement = pObject->FirstChildElement("Faces");
-
-            // Parse PLY File ---------> BEGIN.
-            bool isPly = false;
-            attr = objElement->FirstAttribute();
-            while (attr != nullptr)
-            {
-                if (std::strncmp(attr->Name(), "plyFile", 7) != 0)
-                {
-                    attr = attr->Next();
-                    continue;
-                }
-
-                isPly = true;
-                break;
-            }
-            if (isPly)
-            {
-                // Get path of ply file.
-                std::string plyPath = "";
-                int lastIndex = 0;
-                for (int i = 0; xmlPath[i] != '\0'; i++){
-                    if (xmlPath[i] == '/'){
-                        lastIndex = i;
-                    }
-                }
-                for (int i = 0; i <= lastIndex; i++){
-                    plyPath += xmlPath[i];
-                }
-                plyPath += attr->Value();
-
-                happly::PLYData plyIn(plyPath);
-
-                textureOffset = textureCoordinates.size() + 1;
-                if (plyIn.getElement("vertex").hasProperty("u")){
-                    std::vector<double> u = plyIn.getElement("vertex").getProperty<double>("u");
-                    std::vector<double> v = plyIn.getElement("vertex").getProperty<double>("v");
-
-                    Vector2f txtCoordinate;
-                    for (int i = 0; i < u.size(); i++){
-                        txtCoordinate[0] = u[i];
-                        txtCoordinate[1] = v[i];
-                        textureCoordinates.push_back(txtCoordinate);
-                    }
-                }
-
-                std::vector<std::vector<size_t>> fInd = plyIn.getFaceIndices<size_t>();
-                int fIndSize = fInd.size();
-                int vertexCount = vertices.size() + 1;
-                for (int i = 0; i < fIndSize; i++)
-                {
-                    if (fInd[i].size() == 4){
-                        p1Index = fInd[i][0] + vertexCount;
-                        p2Index = fInd[i][1] + vertexCount;
-                        p3Index = fInd[i][2] + vertexCount;
-                        faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
-
-                        p1Index = fInd[i][2] + vertexCount;
-                        p2Index = fInd[i][3] + vertexCount;
-                        p3Index = fInd[i][0] + vertexCount;
-                        faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
-                    }
-                    else{
-                        p1Index = fInd[i][0] + vertexCount;
-                        p2Index = fInd[i][1] + vertexCount;
-                        p3Index = fInd[i][2] + vertexCount;
-                        faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
-                    }
-                }
+            Group* group = new Group(id, members, transformations);
+            if (group->depth > maxGroupDepth){
+                std::cerr << "Instance group " << id << " is nested deeper than " << maxGroupDepth
+                          << " levels, skipping." << std::endl;
 
-                std::vector<std::array<double, 3>> vPos = plyIn.getVertexPositions();
-                int vPosSize = vPos.size();
-                Vector3f vertex;
-                for (int i = 0; i < vPosSize; i++)
-                {
-                    vertex[0] = vPos[i][0];
-                    vertex[1] = vPos[i][1];
-                    vertex[2] = vPos[i][2];
-                    vertices.push_back(vertex);
+                // Its members must not be found by later instances either.
+                parsedInstances.resize(parsedInstances.size() - members.size());
+                int memberSize = members.size();
+                for (int i = 0; i < memberSize; i++){
+                    delete members[i];
                 }
-
-                vertexOffset = vertexCount;
-                objects.push_back(new Mesh(id, matIndex, faces, transformations, blurTransformation, isBlur, isSmooth));
-                objects[objects.size()-1]->textures = textures;
-                objects[objects.size()-1]->textureOffset = textureOffset - vertexOffset;
-
-                pObject = pObject->NextSiblingElement("Mesh");
-                continue;
-            }
-            // Parse PLY File ---------> COMPLETED.
-
-            cursor = 0;
-            objElement->QueryIntAttribute("vertexOffset", &vertexOffset);
-            objElement->QueryIntAttribute("textureOffset", &textureOffset);
-            str = objElement->GetText();
-            while (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-            {
-                cursor++;
+                delete group;
             }
-            while (str[cursor] != '\0')
-            {
-                for (int cnt = 0; cnt < 3; cnt++)
-                {
-                    if (cnt == 0)
-                    {
-                        p1Index = atoi(str + cursor) + vertexOffset;
-                    }
-                    else if (cnt == 1)
-                    {
-                        p2Index = atoi(str + cursor) + vertexOffset;
-                    }
-                    else
-                    {
-                        p3Index = atoi(str + cursor) + vertexOffset;
-                    }
-                    while (str[cursor] != ' ' && str[cursor] != '\t' && str[cursor] != '\n')
-                    {
-                        cursor++;
-                    }
-                    while (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-                    {
-                        cursor++;
-                    }
-                }
-                faces.push_back(new Triangle(-1, matIndex, p1Index, p2Index, p3Index, isSmooth));
+            else{
+                groups.push_back(group);
             }
 
-            objects.push_back(new Mesh(id, matIndex, faces, transformations, blurTransformation, isBlur, isSmooth));
-            objects[objects.size()-1]->textures = textures;
-            objects[objects.size()-1]->textureOffset = textureOffset - vertexOffset;
-
-            pObject = pObject->NextSiblingElement("Mesh");
+            pObject = pObject->NextSiblingElement("InstanceGroup");
         }
 
         // Parse mesh instances.
         std::cout << "- Parsing meshes instances." << std::endl;
         pObject = pElement->FirstChildElement("MeshInstance");
         while(pObject != nullptr){
-            int id, baseMeshId, matIndex;
-            bool resetTransform = false;
-            bool isBlur = false;
-            glm::vec3 blurTransformation = {0,0,0};
-            std::vector<Transformation*> transformations;
-            Shape* baseMesh;
+            Instance* instance = ParseInstance(pObject, objects, meshStartIndex, groups, parsedInstances);
+            if (instance != nullptr){
+                instances.push_back(instance);
+                parsedInstances.push_back(instance);
+            }
+            pObject = pObject->NextSiblingElement("MeshInstance");
+        }
+    }
 
-            eResult = pObject->QueryIntAttribute("id", &id);
-            eResult = pObject->QueryIntAttribute("baseMeshId", &baseMeshId);
-            eResult = pObject->QueryBoolAttribute("resetTransform", &resetTransform);
+    // Parses the LightMesh and LightSphere elements of Objects. Each gets its own copy of its
+    // material that carries the radiance, so a hit on that material is a hit on the light. They
+    // do not move and are parsed after the mesh instances, so they cannot be instanced.
+    void ParseLightObjects(XMLNode* pRoot, const char* xmlPath, std::vector<Shape*> &objects,
+            std::vector<Light*> &lights, std::vector<Material*> &materials, std::vector<Vector3f> &vertices,
+            std::vector<Vector2f> &textureCoordinates){
+        const char* str;
+        XMLError eResult;
 
-            objElement = pObject->FirstChildElement("Material");
-            eResult = objElement->QueryIntText(&matIndex);
+        XMLElement* pElement = pRoot->FirstChildElement("Objects");
+        const char* names[2] = {"LightMesh", "LightSphere"};
+
+        std::cout << "- Parsing light objects." << std::endl;
+        for (int k = 0; k < 2; k++){
+            XMLElement* pObject = pElement->FirstChildElement(names[k]);
+            while (pObject != nullptr){
+                int id = 0;
+                int matIndex = 0;
+                int sampleCount = 1;
+                Vector3f radiance = {0, 0, 0};
+                XMLElement* objElement;
+
+                eResult = pObject->QueryIntAttribute("id", &id);
+                objElement = pObject->FirstChildElement("Material");
+                if (objElement != nullptr){
+                    eResult = objElement->QueryIntText(&matIndex);
+                }
+                objElement = pObject->FirstChildElement("Radiance");
+                if (objElement != nullptr){
+                    str = objElement->GetText();
+                    sscanf(str, "%f %f %f", &radiance(0), &radiance(1), &radiance(2));
+                }
+                objElement = pObject->FirstChildElement("NumSamples");
+                if (objElement != nullptr){
+                    eResult = objElement->QueryIntText(&sampleCount);
+                }
 
-            // Parse object transformations.
-            objElement = pObject->FirstChildElement("Transformations");
-            if (objElement != nullptr){
-                str = objElement->GetText();
-                ParseObjectTransformations(str, transformations);
-            }
+                int materialSize = materials.size();
+                if (matIndex < 1 || matIndex > materialSize){
+                    std::cerr << "Material of " << names[k] << " " << id << " not found, skipping." << std::endl;
+                    pObject = pObject->NextSiblingElement(names[k]);
+                    continue;
+                }
 
-            // Parse motion blur.
-            objElement = pObject->FirstChildElement("MotionBlur");
-            if (objElement != nullptr){
-                isBlur = true;
-                str = objElement->GetText();
-                sscanf(str, "%f %f %f", &blurTransformation[0], &blurTransformation[1], &blurTransformation[2]);
-            }
+                Material* material = new Material(*materials[matIndex - 1]);
+                material->radiance = radiance;
+                materials.push_back(material);
+                int lightMatIndex = materials.size();
+                material->id = lightMatIndex;
 
-            int objectSize = objects.size();
-            for(int i = meshStartIndex; i < objectSize; i++){
-                if (objects[i]->id == baseMeshId){
-                    baseMesh = objects[i];
+                if (k == 0){
+                    Mesh* mesh = ParseMesh(pObject, xmlPath, lightMatIndex, nullptr, vertices, textureCoordinates);
+                    objects.push_back(mesh);
+                    lights.push_back(new MeshLight(mesh, lightMatIndex, radiance, sampleCount));
+                }
+                else{
+                    Sphere* sphere = ParseSphere(pObject, lightMatIndex, nullptr);
+                    objects.push_back(sphere);
+                    lights.push_back(new SphereLight(sphere, lightMatIndex, radiance, sampleCount));
                 }
-            }
 
-            instances.push_back(new Instance(id, baseMesh, matIndex, resetTransform, transformations, blurTransformation, isBlur));
-            pObject = pObject->NextSiblingElement("MeshInstance");
+                pObject = pObject->NextSiblingElement(names[k]);
+            }
         }
     }
 
@@ -1293,8 +1814,13 @@ namespace Parser{
             sscanf(str, "%f %f %f", &radiance(0), &radiance(1), &radiance(2));
             lightElement = pLight->FirstChildElement("Size");
             eResult = lightElement->QueryFloatText(&size);
+            int sampleCount = 1;
+            lightElement = pLight->FirstChildElement("NumSamples");
+            if (lightElement != nullptr){
+                eResult = lightElement->QueryIntText(&sampleCount);
+            }
 
-            lights.push_back(new AreaLight(position, direction, radiance, size));
+            lights.push_back(new AreaLight(position, direction, radiance, size, sampleCount));
 
             pLight = pLight->NextSiblingElement("AreaLight");
         }
@@ -0,0 +1,97 @@
+#include "PhotonMap.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <cmath>
+#include <functional>
+
+namespace {
+    const int chunkSize = 4096;
+
+    // Runs body(begin, end) on the pool for consecutive chunks of [0, count).
+    void ForChunks(int count, const std::function<void(int, int)>& body){
+        int chunkCount = (count + chunkSize - 1) / chunkSize;
+        pPool->ParallelFor(0, chunkCount, [count, &body](int chunk){
+            body(chunk * chunkSize, std::min(count, (chunk + 1) * chunkSize));
+        });
+    }
+}
+
+PhotonMap::PhotonMap()
+{
+    radius = 0;
+    cellSize = 0;
+    mask = 0;
+}
+
+int PhotonMap::Size() const
+{
+    return photons.size();
+}
+
+float PhotonMap::GetRadius() const
+{
+    return radius;
+}
+
+int PhotonMap::Cell(float coordinate) const
+{
+    return (int)std::floor(coordinate / cellSize);
+}
+
+uint32_t PhotonMap::Slot(int x, int y, int z) const
+{
+    // Spatial hash of Teschner et al.
+    return (((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u)) & mask;
+}
+
+// A counting sort by slot. Slots are counted and filled with atomics, then each
+// slot is put back in photon order, so the map is the same for any thread count.
+void PhotonMap::Build(std::vector<Photon>& stored, float radius)
+{
+    this->radius = radius;
+    cellSize = 2 * radius;
+
+    int count = stored.size();
+    uint32_t tableSize = 1;
+    while (tableSize < (uint32_t)count){
+        tableSize <<= 1;
+    }
+    mask = tableSize - 1;
+
+    std::vector<uint32_t> slots(count);
+    std::vector<std::atomic<int>> cursors(tableSize);
+    ForChunks(count, [this, &stored, &slots, &cursors](int begin, int end){
+        for (int i = begin; i < end; i++){
+            const Eigen::Vector3f& p = stored[i].position;
+            slots[i] = Slot(Cell(p[0]), Cell(p[1]), Cell(p[2]));
+            cursors[slots[i]].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    slotStart.resize(tableSize + 1);
+    slotStart[0] = 0;
+    for (uint32_t i = 0; i < tableSize; i++){
+        slotStart[i + 1] = slotStart[i] + cursors[i].load(std::memory_order_relaxed);
+        cursors[i].store(slotStart[i], std::memory_order_relaxed);
+    }
+
+    std::vector<int> order(count);
+    ForChunks(count, [&slots, &cursors, &order](int begin, int end){
+        for (int i = begin; i < end; i++){
+            order[cursors[slots[i]].fetch_add(1, std::memory_order_relaxed)] = i;
+        }
+    });
+
+    ForChunks(tableSize, [this, &order](int begin, int end){
+        for (int i = begin; i < end; i++){
+            std::sort(order.begin() + slotStart[i], order.begin() + slotStart[i + 1]);
+        }
+    });
+
+    photons.resize(count);
+    ForChunks(count, [this, &stored, &order](int begin, int end){
+        for (int i = begin; i < end; i++){
+            photons[i] = stored[order[i]];
+        }
+    });
+}
@@ -0,0 +1,90 @@
+#ifndef _PHOTONMAP_H_
+#define _PHOTONMAP_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "Eigen/Dense"
+
+// A photon where it landed on a diffuse surface. direction is the way it was
+// travelling, power the flux it carries.
+typedef struct Photon
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f direction;
+    Eigen::Vector3f power;
+} Photon;
+
+// Photons sorted into a hashed grid with cells twice as wide as the lookup
+// radius, so a lookup visits at most 2 x 2 x 2 cells. Cells that hash to the
+// same slot share it, and lookups check the distance of every photon they see.
+class PhotonMap
+{
+public:
+    PhotonMap();
+
+    // Takes the photons found by the emission pass. Runs on the worker pool.
+    void Build(std::vector<Photon>& photons, float radius);
+    int Size() const;
+    float GetRadius() const;
+
+    // Calls visit(photon, squaredDistance) for every photon within the radius of point.
+    template <class F>
+    void Lookup(const Eigen::Vector3f& point, F visit) const;
+
+private:
+    std::vector<Photon> photons;
+    // Photons of slot i are [slotStart[i], slotStart[i + 1]).
+    std::vector<int> slotStart;
+    float radius;
+    float cellSize;
+    uint32_t mask;
+
+    int Cell(float coordinate) const;
+    uint32_t Slot(int x, int y, int z) const;
+};
+
+template <class F>
+void PhotonMap::Lookup(const Eigen::Vector3f& point, F visit) const
+{
+    if (photons.empty()){
+        return;
+    }
+
+    // The radius is half a cell, so the photons in range lie in the cell of the
+    // point and the neighbour on the nearer side along each axis. Bounding the
+    // range with Cell(point +- radius) instead can round to three cells.
+    int cells[3][2];
+    for (int axis = 0; axis < 3; axis++){
+        float scaled = point[axis] / cellSize;
+        int cell = (int)std::floor(scaled);
+        cells[axis][0] = cell;
+        cells[axis][1] = scaled - cell < 0.5f ? cell - 1 : cell + 1;
+    }
+
+    // Neighbouring cells may share a slot, which must be read only once.
+    uint32_t visited[8];
+    int visitedCount = 0;
+    float radiusSquared = radius * radius;
+    for (int x : cells[0]){
+        for (int y : cells[1]){
+            for (int z : cells[2]){
+                uint32_t slot = Slot(x, y, z);
+                if (std::find(visited, visited + visitedCount, slot) != visited + visitedCount){
+                    continue;
+                }
+                visited[visitedCount++] = slot;
+
+                for (int i = slotStart[slot]; i < slotStart[slot + 1]; i++){
+                    float squaredDistance = (photons[i].position - point).squaredNorm();
+                    if (squaredDistance < radiusSquared){
+                        visit(photons[i], squaredDistance);
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
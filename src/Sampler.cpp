@@ -0,0 +1,279 @@
+#include "Sampler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Sampling{
+    // Output permutation of PCG applied to a single LCG step.
+    uint32_t PcgHash(uint32_t value){
+        uint32_t state = value * 747796405u + 2891336453u;
+        uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        return (word >> 22u) ^ word;
+    }
+
+    Sampler* CreateSampler(SamplerType type){
+        if (type == HaltonSamplerType){
+            return new HaltonSampler();
+        }
+        else if (type == SobolSamplerType){
+            return new SobolSampler();
+        }
+        else if (type == CMJSamplerType){
+            return new CMJSampler();
+        }
+
+        return new RandomSampler();
+    }
+
+    bool ParseSamplerType(const std::string& name, SamplerType& type){
+        if (name == "random"){
+            type = RandomSamplerType;
+        }
+        else if (name == "halton"){
+            type = HaltonSamplerType;
+        }
+        else if (name == "sobol"){
+            type = SobolSamplerType;
+        }
+        else if (name == "cmj"){
+            type = CMJSamplerType;
+        }
+        else{
+            return false;
+        }
+
+        return true;
+    }
+}
+
+namespace {
+    const int haltonPrimeCount = 32;
+    const int haltonPrimes[haltonPrimeCount] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                                                59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+
+    float ToUnitFloat(uint32_t bits){
+        // Upper 24 bits give a float in [0, 1) without rounding up to 1.
+        return (bits >> 8) * (1.0f / 16777216.0f);
+    }
+
+    float HashToUnit(uint32_t pixelKey, int sampleIndex, int dimension){
+        return ToUnitFloat(Sampling::PcgHash(Sampling::PcgHash(pixelKey + sampleIndex) ^ Sampling::PcgHash(dimension)));
+    }
+
+    uint32_t ReverseBits(uint32_t x){
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Hash based Owen scrambling (Laine and Karras, as used by Burley).
+    uint32_t OwenScramble(uint32_t x, uint32_t seed){
+        x = ReverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return ReverseBits(x);
+    }
+
+    // Kensler's hash based permutation of [0, length).
+    uint32_t Permute(uint32_t i, uint32_t length, uint32_t p){
+        uint32_t w = length - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do{
+            i ^= p; i *= 0xe170893du;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8; i *= 0x0929eb3fu;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1; i *= 1 | p >> 27;
+            i *= 0x6935fa69u;
+            i ^= (i & w) >> 11; i *= 0x74dcb303u;
+            i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+            i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= length);
+        return (i + p) % length;
+    }
+
+    float KenslerRandom(uint32_t i, uint32_t p){
+        i ^= p;
+        i ^= i >> 17;
+        i ^= i >> 10; i *= 0xb36534e5u;
+        i ^= i >> 12;
+        i ^= i >> 21; i *= 0x93fc4795u;
+        i ^= 0xdf6e307fu;
+        i ^= i >> 17; i *= 1 | p >> 18;
+        return ToUnitFloat(i);
+    }
+
+    // Radical inverse with Owen scrambling: each digit goes through a random
+    // permutation chosen by the seed and all digits before it. Digits continue
+    // past the end of the index down to float precision, so its trailing zeros
+    // are scrambled too.
+    float RadicalInverse(int base, uint32_t index, uint32_t seed){
+        float inverseBase = 1.0f / base;
+        float factor = inverseBase;
+        float result = 0;
+        uint32_t prefix = seed;
+        while (factor > 1e-7f){
+            uint32_t digit = index % base;
+            result += Permute(digit, base, prefix) * factor;
+            prefix = Sampling::PcgHash(prefix ^ digit);
+            index /= base;
+            factor *= inverseBase;
+        }
+        return result;
+    }
+
+    int GridSize(int sampleCount){
+        int n = 1;
+        while (n * n < sampleCount){
+            n++;
+        }
+        return n;
+    }
+}
+
+Sampler::~Sampler()
+{
+
+}
+
+float RandomSampler::Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const
+{
+    float u = HashToUnit(pixelKey, sampleIndex, dimension);
+    if (dimension == PixelX || dimension == PixelY){
+        // Cells are visited in a shuffled order, so any prefix of the samples covers the pixel evenly.
+        int n = GridSize(sampleCount);
+        int cell = sampleCount > 1 ? Permute(sampleIndex % sampleCount, sampleCount, pixelKey) : 0;
+        cell = dimension == PixelX ? cell % n : cell / n;
+        return (cell + u) / n;
+    }
+
+    return u;
+}
+
+float HaltonSampler::Get(uint32_t pixelKey, int sampleIndex, int, int dimension) const
+{
+    // Dimensions past the prime table fall back to independent values.
+    if (dimension >= haltonPrimeCount){
+        return HashToUnit(pixelKey, sampleIndex, dimension);
+    }
+
+    uint32_t seed = Sampling::PcgHash(pixelKey ^ Sampling::PcgHash(dimension));
+    float value = RadicalInverse(haltonPrimes[dimension], sampleIndex, seed);
+    return value < 1.0f ? value : 0.0f;
+}
+
+SobolSampler::SobolSampler()
+{
+    // Direction numbers of the first four Sobol dimensions (Joe and Kuo).
+    const int degree[4] = {0, 1, 2, 3};
+    const uint32_t coefficients[4] = {0, 0, 1, 1};
+    const uint32_t initial[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+    for (int bit = 0; bit < 32; bit++){
+        directions[0][bit] = 1u << (31 - bit);
+    }
+
+    for (int d = 1; d < 4; d++){
+        int s = degree[d];
+        uint32_t v[33];
+        for (int i = 1; i <= s; i++){
+            v[i] = initial[d][i - 1] << (32 - i);
+        }
+        for (int i = s + 1; i <= 32; i++){
+            v[i] = v[i - s] ^ (v[i - s] >> s);
+            for (int k = 1; k < s; k++){
+                v[i] ^= ((coefficients[d] >> (s - 1 - k)) & 1) * v[i - k];
+            }
+        }
+        for (int bit = 0; bit < 32; bit++){
+            directions[d][bit] = v[bit + 1];
+        }
+    }
+}
+
+float SobolSampler::Get(uint32_t pixelKey, int sampleIndex, int, int dimension) const
+{
+    uint32_t groupSeed = Sampling::PcgHash(pixelKey ^ Sampling::PcgHash(dimension / 4));
+    int component = dimension % 4;
+
+    // Shuffle the sample order per group so groups are not correlated with each other.
+    uint32_t index = OwenScramble(sampleIndex, groupSeed);
+
+    uint32_t x = 0;
+    for (int bit = 0; bit < 32 && index != 0; bit++, index >>= 1){
+        if (index & 1){
+            x ^= directions[component][bit];
+        }
+    }
+
+    return ToUnitFloat(OwenScramble(x, Sampling::PcgHash(groupSeed + component)));
+}
+
+float CMJSampler::Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const
+{
+    if (sampleCount < 1){
+        sampleCount = 1;
+    }
+
+    int m = std::max(1, (int)std::sqrt((float)sampleCount));
+    int n = (sampleCount + m - 1) / m;
+    uint32_t pattern = Sampling::PcgHash(pixelKey ^ Sampling::PcgHash(dimension / 2));
+
+    // Samples past the pattern size wrap around with a different shuffle.
+    uint32_t s = Permute(sampleIndex % sampleCount, sampleCount, pattern * 0x51633e2du + sampleIndex / sampleCount);
+
+    if (dimension % 2 == 0){
+        uint32_t sy = Permute(s / m, n, pattern * 0x63d83595u);
+        float jx = KenslerRandom(s, pattern * 0xa399d265u);
+        return ((s % m) + (sy + jx) / n) / m;
+    }
+
+    uint32_t sx = Permute(s % m, m, pattern * 0xa511e9b3u);
+    float jy = KenslerRandom(s, pattern * 0x711ad6a5u);
+    float value = ((s / m) + (sx + jy) / m) / n;
+    return value < 1.0f ? value : 0.0f;
+}
+
+SamplerContext::SamplerContext(const Sampler* sampler, uint32_t seed)
+{
+    this->sampler = sampler;
+    this->seed = Sampling::PcgHash(seed);
+    this->pixelKey = this->seed;
+    this->sampleIndex = 0;
+    this->sampleCount = 1;
+    this->dimension = FirstPathDimension;
+}
+
+void SamplerContext::StartPixel(int x, int y)
+{
+    pixelKey = Sampling::PcgHash(seed + Sampling::PcgHash(x + Sampling::PcgHash(y)));
+    StartSample(0, 1);
+}
+
+void SamplerContext::StartSample(int sampleIndex, int sampleCount)
+{
+    this->sampleIndex = sampleIndex;
+    this->sampleCount = sampleCount;
+    dimension = FirstPathDimension;
+}
+
+float SamplerContext::Get(SampleDimension dimension) const
+{
+    return sampler->Get(pixelKey, sampleIndex, sampleCount, dimension);
+}
+
+float SamplerContext::Next()
+{
+    return sampler->Get(pixelKey, sampleIndex, sampleCount, dimension++);
+}
@@ -0,0 +1,84 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include <cstdint>
+#include <string>
+
+enum SamplerType{RandomSamplerType, HaltonSamplerType, SobolSamplerType, CMJSamplerType};
+
+// Camera dimensions have fixed indices, so every sample of a pixel uses the same
+// dimension for the same purpose. Shading draws the dimensions after them in order.
+enum SampleDimension{PixelX, PixelY, LensU, LensV, Time, FirstPathDimension};
+
+// Produces the value of one dimension of one sample of one pixel. Implementations
+// must be pure functions of their arguments so renders stay reproducible.
+class Sampler
+{
+public:
+    virtual ~Sampler();
+    virtual float Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const = 0;
+};
+
+// Independent values, with the pixel position jittered on a sqrt(N) x sqrt(N) grid.
+class RandomSampler : public Sampler
+{
+public:
+    float Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const;
+};
+
+// Halton sequence with one prime base per dimension, Owen scrambled per pixel
+// and dimension so the high prime bases are not correlated with each other.
+class HaltonSampler : public Sampler
+{
+public:
+    float Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const;
+};
+
+// Owen scrambled Sobol sequence. Dimensions are taken four at a time from a
+// 4D Sobol pattern that is shuffled and scrambled per pixel and per group.
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler();
+    float Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const;
+
+private:
+    uint32_t directions[4][32];
+};
+
+// Correlated multi-jittered pattern (Kensler). Dimensions are used in pairs.
+class CMJSampler : public Sampler
+{
+public:
+    float Get(uint32_t pixelKey, int sampleIndex, int sampleCount, int dimension) const;
+};
+
+// Random numbers for one render thread. Values depend only on (seed, pixel,
+// sample, dimension) rather than the state of a shared generator, so a pixel
+// gets the same numbers no matter which thread renders it or in which order.
+class SamplerContext
+{
+public:
+    SamplerContext(const Sampler* sampler, uint32_t seed);
+
+    void StartPixel(int x, int y);
+    void StartSample(int sampleIndex, int sampleCount);
+    float Get(SampleDimension dimension) const;
+    float Next();
+
+private:
+    const Sampler* sampler;
+    uint32_t seed;
+    uint32_t pixelKey;
+    int sampleIndex;
+    int sampleCount;
+    int dimension;
+};
+
+namespace Sampling{
+    uint32_t PcgHash(uint32_t value);
+    Sampler* CreateSampler(SamplerType type);
+    bool ParseSamplerType(const std::string& name, SamplerType& type);
+}
+
+#endif
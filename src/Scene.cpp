@@ -2,6 +2,7 @@
 #include "Camera.h"
 #include "BVH.h"
 #include "Light.h"
+#include "LightSampler.h"
 #include "Material.h"
 #include "Shape.h"
 #include "tinyxml2.h"
@@ -9,11 +10,20 @@
 #include "Image.h"
 #include <algorithm>
 #include <thread>
+#include <chrono>
+#include <random>
 #include <cmath>
+#include <iterator>
 #include "happly.h"
 #include "Parser.h"
 #include "Helper.h"
 #include "Perlin.h"
+#include "ThreadPool.h"
+#include "Packet.h"
+#include "PhotonMap.h"
+#include "IrradianceCache.h"
+#include "OccluderCache.h"
+#include "BRDFKernels.h"
 #include "glm/gtx/string_cast.hpp"
 
 using namespace Eigen;
@@ -29,7 +39,7 @@ Vector3f Scene::ambient(Material* mat)
 	return ambientColor;
 }
 
-ShadingComponent Scene::MirrorReflectance(const Ray& ray, const ReturnVal& ret, Material* mat)
+Ray Scene::ReflectedRay(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler)
 {
 	// Angle computations.
 	Vector3f wo = -ray.direction;
@@ -41,20 +51,26 @@ ShadingComponent Scene::MirrorReflectance(const Ray& ray, const ReturnVal& ret,
     if (mat->isRough){
         Vector3f uVector = GeometryHelpers::GetOrthonormalUVector(wr);
         Vector3f vVector = wr.cross(uVector);
-        float uChi = dist(mt) - 0.5f;
-        float vChi = dist(mt) - 0.5f;
+        float uChi = sampler.Next() - 0.5f;
+        float vChi = sampler.Next() - 0.5f;
         wr = (wr + ((uVector * uChi + vVector * vChi) * mat->roughness)).normalized();
     }
 
+	return Ray(ret.point + ret.normal * shadowRayEps, wr, ray.time);
+}
+
+ShadingComponent Scene::MirrorReflectance(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler)
+{
 	// Check intersection of new ray.
-	Ray reflectedRay(ret.point + ret.normal * shadowRayEps, wr, ray.time);
-    ReturnVal nearestRet = BVHMethods::FindIntersection(reflectedRay, objects, instances);
-	int materialIndex = nearestRet.matIndex - 1;
+	Ray reflectedRay = ReflectedRay(ray, ret, mat, sampler);
+    ReturnVal nearestRet = BVHMethods::FindIntersection(reflectedRay, topLevel);
+	Material* material = nearestRet.full ? materials[nearestRet.matIndex - 1] : nullptr;
 
-	return ShadingComponent{ reflectedRay, nearestRet, materials[materialIndex] };
+	return ShadingComponent{ reflectedRay, nearestRet, material };
 }
 
-DielectricComponent Scene::DielectricRefraction(const Ray& ray, const ReturnVal& ret, Material* mat)
+Ray Scene::RefractedRay(const Ray& ray, const ReturnVal& ret, Material* mat, float& fresnel, bool& isEntering,
+		bool& isTir)
 {
 	// Compute refracted ray.
 	float dotProduct = ray.direction.dot(ret.normal);
@@ -63,7 +79,7 @@ DielectricComponent Scene::DielectricRefraction(const Ray& ray, const ReturnVal&
 	// -- Check entering or exiting.
 	float snell = 0;
 	Vector3f normal;
-	bool isEntering = false;
+	isEntering = false;
 	float n_t = 0;
 	float n_i = 0;
 
@@ -86,209 +102,1681 @@ DielectricComponent Scene::DielectricRefraction(const Ray& ray, const ReturnVal&
 		isEntering = false;
 	}
 
-	float cosTheta = -ray.direction.dot(normal);
-	Vector3f leftPart = (ray.direction + normal * cosTheta) * snell;
-	float squareRootPart = 1 - pow(snell, 2) * (1 - pow(cosTheta, 2));
+	float cosTheta = -ray.direction.dot(normal);
+	Vector3f leftPart = (ray.direction + normal * cosTheta) * snell;
+	float squareRootPart = 1 - pow(snell, 2) * (1 - pow(cosTheta, 2));
+
+	isTir = false;
+	if (squareRootPart < 0)
+	{
+		isTir = true;
+	}
+
+	squareRootPart = sqrt(squareRootPart);
+	Vector3f tDirection = leftPart - (normal * squareRootPart);
+	tDirection = tDirection.normalized();
+	Ray tRay(ret.point - shadowRayEps * normal, tDirection, ray.time);
+
+	// Fresnel
+	fresnel = FresnelReflectance(n_t, n_i, ray, tRay, normal);
+	return tRay;
+}
+
+DielectricComponent Scene::DielectricRefraction(const Ray& ray, const ReturnVal& ret, Material* mat)
+{
+	float fresnel;
+	bool isEntering;
+	bool isTir;
+	Ray tRay = RefractedRay(ray, ret, mat, fresnel, isEntering, isTir);
+
+	// Return dielectric component.
+    ReturnVal nearestRet = BVHMethods::FindIntersection(tRay, topLevel);
+	Material* material = nearestRet.full ? materials[nearestRet.matIndex - 1] : nullptr;
+
+	float beerDistance = (nearestRet.point - ret.point).norm();
+	Vector3f beer = BeerAttenuation(mat->absorptionCoefficient, beerDistance);
+
+	return DielectricComponent{ tRay, nearestRet, material, fresnel, beer, isEntering, isTir };
+}
+
+float Scene::FresnelReflectance(float n_t, float n_i, const Ray& iRay, const Ray& tRay, const Vector3f& normal)
+{
+	float cos_t = -tRay.direction.dot(normal);
+	float cos_i = -iRay.direction.dot(normal);
+
+	float rParallel = (n_t * cos_i - n_i * cos_t) / (n_t * cos_i + n_i * cos_t);
+	float rPerpendicular = (n_i * cos_i - n_t * cos_t) / (n_i * cos_i + n_t * cos_t);
+	return (0.5f) * (pow(rParallel, 2) + pow(rPerpendicular, 2));
+}
+
+float Scene::BeerLaw(float sigma_t, float distance)
+{
+	return exp(-sigma_t * distance);
+}
+
+Vector3f Scene::BeerAttenuation(const Vector3f& sigma, float distance)
+{
+	return Vector3f(BeerLaw(sigma[0], distance), BeerLaw(sigma[1], distance), BeerLaw(sigma[2], distance));
+}
+
+float Scene::ConductorFresnel(float n_t, float k_t, const Ray& ray, const Vector3f& normal)
+{
+	float cos_t = -ray.direction.dot(normal);
+	float twoNtCost = 2 * n_t * cos_t;
+	float cosSquared = pow(cos_t, 2);
+	float nt_ktSquare = pow(n_t, 2) + pow(k_t, 2);
+
+	float rs = (nt_ktSquare - twoNtCost + cosSquared) / (nt_ktSquare + twoNtCost + cosSquared);
+	float rp = (nt_ktSquare * cosSquared - twoNtCost + 1) / (nt_ktSquare * cosSquared + twoNtCost + 1);
+
+	return (0.5f) * (rs + rp);
+}
+
+// Decides whether a branch with the given accumulated weight is traced. Branches
+// below the prune threshold survive with probability weight / threshold and are
+// scaled up when they do, so pruning does not change the expected color.
+bool Scene::KeepBranch(const Vector3f& weight, float& scale, SamplerContext& sampler)
+{
+	scale = 1;
+	float strength = weight.maxCoeff();
+	if (pruneThreshold <= 0 || strength >= pruneThreshold)
+	{
+		return true;
+	}
+
+	float survival = std::max(strength, 0.0f) / pruneThreshold;
+	if (sampler.Next() >= survival)
+	{
+		return false;
+	}
+
+	scale = 1 / survival;
+	return true;
+}
+
+// A branch color is scaled by its Fresnel factor first and tinted second.
+// Renders with pruning and stochastic dielectrics off rely on that order to
+// round the same as full branching always has.
+Vector3f Scene::ReflectedBranch(const Ray& ray, const ReturnVal& ret, Material* mat, float factor, const Vector3f& tint,
+		int depth, SamplerContext& sampler, const Vector3f& weight)
+{
+	float scale;
+	Vector3f branchWeight = weight.cwiseProduct(tint) * factor;
+	if (!KeepBranch(branchWeight, scale, sampler))
+	{
+		return Vector3f{ 0, 0, 0 };
+	}
+
+	ShadingComponent sc = MirrorReflectance(ray, ret, mat, sampler);
+	Vector3f color = RecursiveShading(sc.ray, sc.ret, sc.mat, depth - 1, sampler, branchWeight * scale);
+	return tint.cwiseProduct(factor * color) * scale;
+}
+
+Vector3f Scene::RefractedBranch(const DielectricComponent& dc, float factor, const Vector3f& tint, int depth,
+		SamplerContext& sampler, const Vector3f& weight)
+{
+	float scale;
+	Vector3f branchWeight = weight.cwiseProduct(tint) * factor;
+	if (!KeepBranch(branchWeight, scale, sampler))
+	{
+		return Vector3f{ 0, 0, 0 };
+	}
+
+	Vector3f color = RecursiveShading(dc.ray, dc.ret, dc.mat, depth - 1, sampler, branchWeight * scale);
+	return tint.cwiseProduct(factor * color) * scale;
+}
+
+// Traces the reflected and the transmitted branch of a dielectric hit. With
+// stochastic dielectrics only one of them is traced, picked with the Fresnel
+// probability and divided by it.
+void Scene::DielectricBranches(const Ray& ray, const ReturnVal& ret, Material* mat, const DielectricComponent& dc,
+		const Vector3f& reflectTint, const Vector3f& transmitTint, int depth, SamplerContext& sampler,
+		const Vector3f& weight, Vector3f& transmittedColor, Vector3f& reflectedColor)
+{
+	reflectedColor = Vector3f(0, 0, 0);
+	transmittedColor = Vector3f(0, 0, 0);
+
+	if (stochasticDielectrics)
+	{
+		float fresnel = std::max(0.0f, std::min(1.0f, dc.fresnel));
+		if (sampler.Next() < fresnel)
+		{
+			reflectedColor = ReflectedBranch(ray, ret, mat, dc.fresnel / fresnel, reflectTint, depth, sampler, weight);
+		}
+		else
+		{
+			transmittedColor = RefractedBranch(dc, (1 - dc.fresnel) / (1 - fresnel), transmitTint, depth, sampler, weight);
+		}
+	}
+	else
+	{
+		transmittedColor = RefractedBranch(dc, 1 - dc.fresnel, transmitTint, depth, sampler, weight);
+		reflectedColor = ReflectedBranch(ray, ret, mat, dc.fresnel, reflectTint, depth, sampler, weight);
+	}
+
+	transmittedColor = NanCheck(transmittedColor);
+	reflectedColor = NanCheck(reflectedColor);
+}
+
+Vector3f Scene::RecursiveShading(const Ray& ray, const ReturnVal& ret, Material* mat, int depth, SamplerContext& sampler,
+		const Vector3f& weight)
+{
+	if (!ret.full)
+	{
+		return Vector3f{ 0, 0, 0 };
+	}
+
+	// Every ray here is a camera or specular ray, so light objects it hits are seen directly.
+	const Vector3f& emitted = mat->radiance;
+	if (mat->type == Normal || depth <= 0)
+	{
+		return emitted + BasicShading(ray, ret, mat, sampler) + CausticRadiance(ray, ret, mat);
+	}
+	else if (mat->type == Mirror)
+	{
+		Vector3f reflectedColor = ReflectedBranch(ray, ret, mat, 1, mat->mirrorRef, depth, sampler, weight);
+		return emitted + BasicShading(ray, ret, mat, sampler) + reflectedColor;
+	}
+	else if (mat->type == Dielectric)
+	{
+		DielectricComponent dc = DielectricRefraction(ray, ret, mat);
+		if (dc.isEntering)
+		{
+			Vector3f insideColor, reflectedColor;
+			DielectricBranches(ray, ret, mat, dc, Vector3f(1, 1, 1), dc.beer, depth, sampler, weight, insideColor,
+					reflectedColor);
+			return emitted + BasicShading(ray, ret, mat, sampler) + insideColor + reflectedColor;
+		}
+		else
+		{
+			if (dc.isTir)
+			{
+				Vector3f internalReflection = ReflectedBranch(ray, ret, mat, 1, dc.beer, depth, sampler, weight);
+				return emitted + NanCheck(internalReflection);
+			}
+			else
+			{
+				Vector3f outsideColor, reflectedColor;
+				DielectricBranches(ray, ret, mat, dc, dc.beer, Vector3f(1, 1, 1), depth, sampler, weight, outsideColor,
+						reflectedColor);
+				return emitted + outsideColor + reflectedColor;
+			}
+		}
+	}
+	else
+	{
+		float fresnel = ConductorFresnel(mat->refractionIndex, mat->absorptionIndex, ray, ret.normal);
+		Vector3f reflectedColor = ReflectedBranch(ray, ret, mat, fresnel, mat->mirrorRef, depth, sampler, weight);
+		return emitted + BasicShading(ray, ret, mat, sampler) + reflectedColor;
+	}
+}
+
+// Path tracer with next event estimation. Lights are sampled at every vertex
+// through BasicShading, then the path continues in one direction chosen by the
+// material, so it follows diffuse interreflection as well as specular chains.
+// gathering paths start at a surface that already sampled the lights, so they
+// skip the emission of their first hit, and they never use the irradiance cache.
+Vector3f Scene::PathShading(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler,
+		bool gathering)
+{
+	Vector3f color(0, 0, 0);
+	Vector3f throughput(1, 1, 1);
+	ShadingComponent vertex{ ray, ret, mat };
+	bool specular = false;
+
+	for (int depth = 0; ; depth++)
+	{
+		if (!vertex.ret.full)
+		{
+			// Lights were already sampled at the last diffuse vertex, so only
+			// specular bounces may pick up the environment.
+			if (specular && environmentLightIndex != -1 && lights[environmentLightIndex]->GetType() == Environment)
+			{
+				EnvironmentLight* environment = (EnvironmentLight*)lights[environmentLightIndex];
+				color += throughput.cwiseProduct(environment->ComputeLightContribution(vertex.ray.direction));
+			}
+			break;
+		}
+
+		if (vertex.ret.dm == ReplaceAll)
+		{
+			color += throughput.cwiseProduct(vertex.ret.textureColor);
+			break;
+		}
+
+		// Light objects are sampled at every diffuse vertex, so hitting one counts
+		// only for camera rays and after specular bounces, as for the environment.
+		if ((depth == 0 && !gathering) || specular)
+		{
+			color += throughput.cwiseProduct(vertex.mat->radiance);
+		}
+
+		// Same direct lighting as the recursive integrator. Dielectrics are only
+		// lit from outside.
+		Material* vertexMat = vertex.mat;
+		if (vertexMat->type != Dielectric || vertex.ray.direction.dot(vertex.ret.normal) < 0)
+		{
+			color += throughput.cwiseProduct(BasicShading(vertex.ray, vertex.ret, vertexMat, sampler, nullptr,
+					depth == 0 && !gathering));
+		}
+
+		if (depth >= maxRecursionDepth)
+		{
+			break;
+		}
+
+		// The cache replaces the rest of the path at the first diffuse vertex.
+		Vector3f indirect;
+		if (!gathering && (depth == 0 || specular) && CachedIndirect(vertex.ray, vertex.ret, vertexMat, indirect))
+		{
+			color += throughput.cwiseProduct(indirect);
+			break;
+		}
+
+		// Russian roulette on the throughput, so dim paths end early without bias.
+		if (depth >= rouletteDepth)
+		{
+			float survival = std::min(0.95f, throughput.maxCoeff());
+			if (sampler.Next() >= survival)
+			{
+				break;
+			}
+			throughput /= survival;
+		}
+
+		Vector3f weight;
+		if (!ScatterPath(vertex, weight, specular, sampler))
+		{
+			break;
+		}
+
+		throughput = NanCheck(throughput.cwiseProduct(weight));
+		if (throughput.maxCoeff() <= 0)
+		{
+			break;
+		}
+	}
+
+	return color;
+}
+
+// Moves vertex to the next hit of the path. weight is the BRDF times cosine
+// over the density of the chosen direction.
+bool Scene::ScatterPath(ShadingComponent& vertex, Vector3f& weight, bool& specular, SamplerContext& sampler)
+{
+	Ray nextRay(vertex.ray.time);
+	Vector3f absorption;
+	if (!ScatterRay(vertex, nextRay, weight, absorption, specular, sampler))
+	{
+		return false;
+	}
+
+	// The medium is crossed from the hit point, not from the offset ray origin.
+	ReturnVal nextRet = BVHMethods::FindIntersection(nextRay, topLevel);
+	if (nextRet.full)
+	{
+		weight = weight.cwiseProduct(BeerAttenuation(absorption, (nextRet.point - vertex.ret.point).norm()));
+	}
+	vertex = ShadingComponent{ nextRay, nextRet, nextRet.full ? materials[nextRet.matIndex - 1] : nullptr };
+	return true;
+}
+
+// Picks the next direction of a path without tracing it. absorption is the
+// coefficient of the medium the new ray travels through; the caller applies it
+// once the length of the segment is known.
+bool Scene::ScatterRay(const ShadingComponent& vertex, Ray& nextRay, Vector3f& weight, Vector3f& absorption,
+		bool& specular, SamplerContext& sampler)
+{
+	const Ray& ray = vertex.ray;
+	const ReturnVal& ret = vertex.ret;
+	Material* mat = vertex.mat;
+	absorption = Vector3f(0, 0, 0);
+
+	if (mat->type == Mirror)
+	{
+		weight = mat->mirrorRef;
+		specular = true;
+		nextRay = ReflectedRay(ray, ret, mat, sampler);
+		return true;
+	}
+	else if (mat->type == Conductor)
+	{
+		float fresnel = ConductorFresnel(mat->refractionIndex, mat->absorptionIndex, ray, ret.normal);
+		weight = mat->mirrorRef * fresnel;
+		specular = true;
+		nextRay = ReflectedRay(ray, ret, mat, sampler);
+		return true;
+	}
+	else if (mat->type == Dielectric)
+	{
+		// Reflect with the Fresnel probability and refract otherwise, so one
+		// path follows one branch and the weights need no Fresnel factor.
+		float fresnel;
+		bool isEntering;
+		bool isTir;
+		Ray tRay = RefractedRay(ray, ret, mat, fresnel, isEntering, isTir);
+		specular = true;
+		weight = Vector3f(1, 1, 1);
+		bool reflect = isTir || sampler.Next() < fresnel;
+		if (reflect)
+		{
+			// Reflected inside the object, so the light is absorbed on the way.
+			nextRay = ReflectedRay(ray, ret, mat, sampler);
+			if (!isEntering)
+			{
+				absorption = mat->absorptionCoefficient;
+			}
+		}
+		else
+		{
+			nextRay = tRay;
+			if (isEntering)
+			{
+				absorption = mat->absorptionCoefficient;
+			}
+		}
+		return true;
+	}
+
+	Vector3f wo = -ray.direction;
+	Vector3f wi;
+	if (mat->_brdfType != NoBRDF)
+	{
+		float lobe = sampler.Next();
+		float u = sampler.Next();
+		float v = sampler.Next();
+		float pdf;
+		wi = Light::SampleBRDF(wo, ret, mat, lobe, u, v, pdf);
+		float cosTheta = wi.dot(ret.normal);
+		if (pdf <= 0 || cosTheta <= 0)
+		{
+			return false;
+		}
+		weight = Light::TermBRDF(wi, wo, ret, mat) * (cosTheta / pdf);
+	}
+	else
+	{
+		// Phong materials scatter indirect light as a Lambertian surface with albedo kd.
+		float u = sampler.Next();
+		float v = sampler.Next();
+		wi = GeometryHelpers::SampleCosineHemisphere(ret.normal, u, v);
+		weight = DiffuseAlbedo(ret, mat);
+	}
+
+	specular = false;
+	nextRay = Ray(ret.point + ret.normal * shadowRayEps, wi, ray.time);
+	return true;
+}
+
+Vector3f Scene::DiffuseAlbedo(const ReturnVal& ret, Material* mat)
+{
+	return BRDFKernels::DiffuseColor(ret, mat);
+}
+
+// Photon pass for caustics: light that reaches a diffuse surface only through
+// mirrors, conductors and dielectrics, which shadow rays cannot follow. Lights
+// get photons in proportion to their power. Chunks of photons are traced on all
+// workers, each into its own list, and the lists are joined in chunk order, so
+// the map does not depend on the thread count.
+void Scene::BuildCausticMap()
+{
+	causticMap = nullptr;
+	if (causticPhotons <= 0)
+	{
+		return;
+	}
+	if (integrator != WhittedIntegrator)
+	{
+		std::cout << "Caustic photons are only used by the whitted integrator." << std::endl;
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	BBox sceneBox = topLevel->GetBoundingBox();
+	int lightSize = lights.size();
+	std::vector<float> powers(lightSize);
+	for (int i = 0; i < lightSize; i++)
+	{
+		powers[i] = lights[i]->PhotonPower(sceneBox);
+	}
+	AliasTable lightTable(powers);
+	if (lightTable.Total() <= 0)
+	{
+		std::cout << "No light emits photons, caustics are off." << std::endl;
+		return;
+	}
+
+	const int chunkSize = 4096;
+	int chunkCount = (causticPhotons + chunkSize - 1) / chunkSize;
+	std::vector<std::vector<Photon>> chunks(chunkCount);
+	// Photons are traced on the pool's workers only, as tiles are.
+	pPool->ParallelFor(0, chunkCount, [this, &chunks, &lightTable, &sceneBox, chunkSize](int chunk){
+		// Photons are the samples of one pixel of a stream apart from the cameras.
+		SamplerContext sampler(pixelSampler, ~seed);
+		int end = std::min(causticPhotons, (chunk + 1) * chunkSize);
+		for (int i = chunk * chunkSize; i < end; i++)
+		{
+			sampler.StartSample(i, causticPhotons);
+			float remapped;
+			int light = lightTable.Sample(sampler.Next(), remapped);
+
+			Ray ray(0);
+			Vector3f power;
+			if (lights[light]->EmitPhoton(sampler, sceneBox, ray, power))
+			{
+				power /= lightTable.Probability(light) * causticPhotons;
+				TracePhoton(ray, power, sampler, chunks[chunk]);
+			}
+		}
+	}, false);
+
+	std::vector<Photon> photons;
+	for (int i = 0; i < chunkCount; i++)
+	{
+		photons.insert(photons.end(), chunks[i].begin(), chunks[i].end());
+	}
+	if (photons.empty())
+	{
+		std::cout << "No photon reached a diffuse surface through a specular one, caustics are off." << std::endl;
+		return;
+	}
+
+	// Without a given radius, aim for about 50 photons per lookup if the photons
+	// were spread evenly over the two longest sides of their bounding box.
+	float radius = photonRadius;
+	if (radius <= 0)
+	{
+		Vector3f low = photons[0].position;
+		Vector3f high = low;
+		int photonSize = photons.size();
+		for (int i = 1; i < photonSize; i++)
+		{
+			low = low.cwiseMin(photons[i].position);
+			high = high.cwiseMax(photons[i].position);
+		}
+		Vector3f extent = high - low;
+		std::sort(extent.data(), extent.data() + 3);
+		float area = std::max(extent[1] * extent[2], extent[2] * extent[2] * 1e-4f);
+		radius = std::sqrt(50 * area / (M_PI * photons.size()));
+	}
+
+	causticMap = new PhotonMap();
+	causticMap->Build(photons, radius);
+
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Caustic map: " << causticMap->Size() << " photons stored of " << causticPhotons
+			  << " emitted, radius " << radius << ", in " << elapsed.count() << "s." << std::endl;
+}
+
+// Follows one photon through specular bounces and stores it where it first
+// lands on a diffuse surface. Photons that land there directly are already
+// counted by the shadow rays and are dropped.
+void Scene::TracePhoton(const Ray& ray, const Vector3f& power, SamplerContext& sampler, std::vector<Photon>& stored)
+{
+	ReturnVal ret = BVHMethods::FindIntersection(ray, topLevel);
+	ShadingComponent vertex{ ray, ret, ret.full ? materials[ret.matIndex - 1] : nullptr };
+	Vector3f flux = power;
+
+	for (int depth = 0; depth <= maxRecursionDepth && vertex.ret.full; depth++)
+	{
+		if (vertex.mat->type == Normal)
+		{
+			if (depth > 0)
+			{
+				stored.push_back(Photon{ vertex.ret.point, vertex.ray.direction, flux });
+			}
+			return;
+		}
+
+		Vector3f weight;
+		bool specular;
+		if (!ScatterPath(vertex, weight, specular, sampler))
+		{
+			return;
+		}
+
+		flux = NanCheck(flux.cwiseProduct(weight));
+		if (flux.maxCoeff() <= 0)
+		{
+			return;
+		}
+	}
+}
+
+// Density estimate of the caustic photons around a diffuse hit. Photons are
+// weighted by 1 - d / r, a cone filter that keeps the edges of caustics sharp.
+Vector3f Scene::CausticRadiance(const Ray& ray, const ReturnVal& ret, Material* mat)
+{
+	Vector3f radiance(0, 0, 0);
+	if (causticMap == nullptr || mat->type != Normal)
+	{
+		return radiance;
+	}
+
+	Vector3f wo = -ray.direction;
+	Vector3f albedo = DiffuseAlbedo(ret, mat);
+	float radius = causticMap->GetRadius();
+	causticMap->Lookup(ret.point, [&](const Photon& photon, float squaredDistance){
+		// Only photons arriving on this side, close to the plane of the surface, so
+		// light does not leak around corners or through thin walls.
+		if (photon.direction.dot(ret.normal) >= 0 || std::abs((photon.position - ret.point).dot(ret.normal)) > radius * 0.1f)
+		{
+			return;
+		}
+
+		Vector3f brdf = albedo;
+		if (mat->_brdfType != NoBRDF)
+		{
+			brdf = Light::TermBRDF(-photon.direction, wo, ret, mat);
+		}
+		float weight = 1 - std::sqrt(squaredDistance) / radius;
+		radiance += brdf.cwiseProduct(photon.power) * weight;
+	});
+
+	// The cone filter integrates to pi r^2 / 3 over the disc.
+	return NanCheck(radiance * (3.0f / (M_PI * radius * radius)));
+}
+
+// The cache stands in for diffuse interreflection in the path integrator.
+void Scene::PrepareIrradianceCache()
+{
+	irradianceCache = nullptr;
+	if (!useIrradianceCache)
+	{
+		return;
+	}
+	if (integrator != PathIntegrator)
+	{
+		std::cout << "The irradiance cache is only used by the path integrator." << std::endl;
+		return;
+	}
+	if (deterministic)
+	{
+		// The records that exist depend on which pixels were rendered first.
+		std::cout << "The irradiance cache depends on the render order, so it is off in deterministic renders."
+				  << std::endl;
+		return;
+	}
+
+	irradianceCache = new IrradianceCache(topLevel->GetBoundingBox(), cacheTolerance);
+}
+
+// Indirect light leaving a Phong surface, interpolated from the cache or from a
+// record computed here when none is close enough. Other materials return false
+// and the path goes on.
+bool Scene::CachedIndirect(const Ray& ray, const ReturnVal& ret, Material* mat, Vector3f& indirect)
+{
+	if (irradianceCache == nullptr || mat->type != Normal || mat->_brdfType != NoBRDF || ret.dm == ReplaceAll)
+	{
+		return false;
+	}
+
+	Vector3f irradiance;
+	if (!irradianceCache->Lookup(ret.point, ret.normal, irradiance))
+	{
+		IrradianceRecord record;
+		ComputeIrradiance(ray, ret, record);
+		irradiance = record.irradiance;
+		irradianceCache->Insert(record);
+	}
+
+	// Same Lambertian scattering as the bounce in ScatterRay.
+	indirect = NanCheck(DiffuseAlbedo(ret, mat).cwiseProduct(irradiance) / M_PI);
+	return true;
+}
+
+// Stratified cosine-weighted gather over the hemisphere, M strata in theta
+// (equal in sin^2 theta) by N in phi. The gradients follow Ward and Heckbert:
+// the rotational one from tan theta of every sample, the translational one from
+// the change of radiance across the walls between neighbouring strata, divided
+// by the distance to the nearer of the two surfaces. The gather has its own
+// stream keyed on the record position, so the samples of the pixel that made
+// the record do not depend on whether another thread made one nearby first.
+void Scene::ComputeIrradiance(const Ray& ray, const ReturnVal& ret, IrradianceRecord& record)
+{
+	uint32_t key = seed;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &ret.point[axis], sizeof(bits));
+		key = Sampling::PcgHash(key ^ bits);
+	}
+	SamplerContext sampler(pixelSampler, key);
+
+	int thetaCount = std::max(2, (int)std::round(std::sqrt(cacheSamples / M_PI)));
+	int phiCount = std::max(4, (int)std::round((float)cacheSamples / thetaCount));
+	const Vector3f& normal = ret.normal;
+	Vector3f t = GeometryHelpers::GetOrthonormalUVector(normal);
+	Vector3f b = normal.cross(t);
+	Vector3f origin = ret.point + normal * shadowRayEps;
+
+	std::vector<Vector3f> radiance(thetaCount * phiCount);
+	std::vector<float> distance(thetaCount * phiCount);
+	Vector3f sum(0, 0, 0);
+	Matrix3f rotational = Matrix3f::Zero();
+	float inverseDistanceSum = 0;
+	for (int j = 0; j < thetaCount; j++)
+	{
+		for (int k = 0; k < phiCount; k++)
+		{
+			sampler.StartSample(j * phiCount + k, thetaCount * phiCount);
+			float u = sampler.Next();
+			float v = sampler.Next();
+			float sinTheta = std::sqrt((j + u) / thetaCount);
+			float cosTheta = std::sqrt(std::max(0.0f, 1 - sinTheta * sinTheta));
+			float phi = 2 * M_PI * (k + v) / phiCount;
+			Vector3f side = std::cos(phi) * t + std::sin(phi) * b;
+			Vector3f direction = (sinTheta * side + cosTheta * normal).normalized();
+
+			Ray gatherRay(origin, direction, ray.time);
+			ReturnVal gatherRet = BVHMethods::FindIntersection(gatherRay, topLevel);
+			Vector3f L(0, 0, 0);
+			float r = std::numeric_limits<float>::infinity();
+			if (gatherRet.full)
+			{
+				L = PathShading(gatherRay, gatherRet, materials[gatherRet.matIndex - 1], sampler, true);
+				r = std::max((gatherRet.point - origin).norm(), 1e-6f);
+				inverseDistanceSum += 1 / r;
+			}
+
+			radiance[j * phiCount + k] = L;
+			distance[j * phiCount + k] = r;
+			sum += L;
+
+			// n x direction, over cos theta.
+			Vector3f turn = (-std::sin(phi) * t + std::cos(phi) * b) * (sinTheta / std::max(cosTheta, 1e-3f));
+			rotational += L * turn.transpose();
+		}
+	}
+
+	float scale = M_PI / (thetaCount * phiCount);
+	Matrix3f translational = Matrix3f::Zero();
+	for (int k = 0; k < phiCount; k++)
+	{
+		float phiCenter = 2 * M_PI * (k + 0.5f) / phiCount;
+		Vector3f outward = std::cos(phiCenter) * t + std::sin(phiCenter) * b;
+		float phiEdge = 2 * M_PI * k / phiCount;
+		Vector3f across = -std::sin(phiEdge) * t + std::cos(phiEdge) * b;
+		int previousK = (k + phiCount - 1) % phiCount;
+
+		for (int j = 0; j < thetaCount; j++)
+		{
+			int index = j * phiCount + k;
+			if (j > 0)
+			{
+				// Wall between theta strata j - 1 and j.
+				float sinSquared = (float)j / thetaCount;
+				float r = std::min(distance[index], distance[index - phiCount]);
+				float factor = (2 * M_PI / phiCount) * std::sqrt(sinSquared) * (1 - sinSquared) / r;
+				translational += (radiance[index] - radiance[index - phiCount]) * (factor * outward).transpose();
+			}
+
+			// Wall between phi strata k - 1 and k.
+			float sinCenter = std::sqrt((j + 0.5f) / thetaCount);
+			float r = std::min(distance[index], distance[j * phiCount + previousK]);
+			float factor = 1 / (2 * thetaCount * sinCenter * r);
+			translational += (radiance[index] - radiance[j * phiCount + previousK]) * (factor * across).transpose();
+		}
+	}
+
+	record.position = ret.point;
+	record.normal = normal;
+	record.irradiance = sum * scale;
+	record.rotationalGradient = rotational * scale;
+	record.translationalGradient = translational;
+	// Harmonic mean distance; a gather that saw nothing gets the largest radius.
+	record.radius = inverseDistanceSum > 0 ? thetaCount * phiCount / inverseDistanceSum
+			: std::numeric_limits<float>::max();
+	irradianceCache->ClampRecord(record);
+}
+
+Vector3f Scene::NanCheck(Vector3f checkVector){
+	if (checkVector[0] != checkVector[0] || checkVector[1] != checkVector[1] || checkVector[2] != checkVector[2])
+	{
+		return Vector3f{ 0, 0, 0 };
+	}
+
+	return checkVector;
+}
+
+Eigen::Vector3f Scene::Shading(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler)
+{
+    if (ret.dm == ReplaceAll){
+        return ret.textureColor;
+    }
+
+	// Create a new rawColor (not bounded to 255).
+	Vector3f color;
+	if (integrator == PathIntegrator){
+		color = PathShading(ray, ret, mat, sampler);
+	}
+	else{
+		color = RecursiveShading(ray, ret, mat, maxRecursionDepth, sampler, Vector3f(1, 1, 1));
+	}
+
+	// Clamp and return.
+	return color;
+}
+
+// shadowed, when given, has one entry per unsampled light: 1 or 0 for point
+// lights already tested for shadows in a packet, -1 for lights that test their own.
+Vector3f Scene::BasicShading(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler,
+		const int8_t* shadowed, bool withAmbient)
+{
+	// Create a new rawColor (not bounded to 255).
+	Vector3f rawColor(0, 0, 0);
+
+	// Compute ambient color (no shadow check). Paths take it at the camera hit only.
+	if (withAmbient)
+	{
+		rawColor = ambient(mat);
+	}
+
+	// Lights that are not sampled are shaded at every point.
+	const std::vector<int>& unsampled = lightSampler->GetUnsampledLights();
+	int unsampledSize = unsampled.size();
+	for (int i = 0; i < unsampledSize; i++)
+	{
+		if (shadowed && shadowed[i] != -1)
+		{
+			if (!shadowed[i])
+			{
+				rawColor += ((PointLight*)lights[unsampled[i]])->ShadeUnoccluded(ray, ret, mat);
+			}
+			continue;
+		}
+	    rawColor += lights[unsampled[i]]->BasicShading(ray, ret, mat, sampler);
+	}
+
+	// The other lights get the shadow ray budget. Each pick is divided by its
+	// probability, so the sum stays an unbiased estimate of all of them.
+	if (lightSampler->SampledLightCount() > 0)
+	{
+		for (int i = 0; i < shadowRayBudget; i++)
+		{
+			float probability;
+			int light = lightSampler->Sample(ret.point, sampler.Next(), probability);
+			if (light != -1)
+			{
+				rawColor += lights[light]->BasicShading(ray, ret, mat, sampler) / (probability * shadowRayBudget);
+			}
+		}
+	}
+
+	return rawColor;
+}
+
+void Scene::ThreadedRendering(std::vector<RenderJob*>& jobs, TileQueue& tileQueue, int worker)
+{
+	std::vector<Vector3f> tileBuffer;
+	std::vector<int> countBuffer;
+	Tile tile;
+
+	// Tiles may be stolen halves of another worker's tile once the queue is empty.
+	while (tileQueue.Next(worker, tile))
+	{
+		RenderJob* job = jobs[tile.job];
+		Camera* cam = job->cam;
+
+		// A progressive pass that ran out of time stops taking tiles. The first pass
+		// always completes, so every pixel has a sample even once the budget is spent.
+		if (job->progress && job->progress->hasDeadline && job->progress->firstSample > 0 &&
+				std::chrono::steady_clock::now() >= job->progress->deadline)
+		{
+			return;
+		}
+
+		bool isMultiSample = cam->GetTotalSampleCount() > 1;
+		int tileWidth = tile.x1 - tile.x0;
+		tileBuffer.resize(tileWidth * (tile.y1 - tile.y0));
+		countBuffer.resize(tileBuffer.size());
+
+		// Cameras get different streams from the same seed.
+		SamplerContext sampler(pixelSampler, seed ^ Sampling::PcgHash(cam->id));
+
+		// Render into a local buffer so threads never write next to each other in the image.
+		// Rows are taken one at a time, so a thief can cut off the rows not started yet.
+		int y;
+		int rowsDone = 0;
+		if (wavefront && !cam->adaptive.enabled)
+		{
+			// Rows are collected until their samples fill a batch, then traced together.
+			int rowSamples = tileWidth * (job->progress ? job->progress->passSamples : cam->GetTotalSampleCount());
+			std::vector<int> rows;
+			while (tileQueue.NextRow(worker, y))
+			{
+				rows.push_back(y);
+				rowsDone++;
+				if ((int)rows.size() * rowSamples >= wavefrontBatch)
+				{
+					TraceWavefront(job, tile, rows, sampler, tileBuffer, countBuffer);
+					rows.clear();
+				}
+			}
+			if (!rows.empty())
+			{
+				TraceWavefront(job, tile, rows, sampler, tileBuffer, countBuffer);
+			}
+		}
+		else if (packetTraversal && !job->progress && !isMultiSample)
+		{
+			// Camera rays of 8 x 8 pixel blocks are traced as packets.
+			std::vector<int> rows;
+			while (tileQueue.NextRow(worker, y))
+			{
+				rows.push_back(y);
+				rowsDone++;
+				if (rows.size() == packetWidth)
+				{
+					TracePrimaryPackets(cam, tile, rows, sampler, tileBuffer, countBuffer);
+					rows.clear();
+				}
+			}
+			if (!rows.empty())
+			{
+				TracePrimaryPackets(cam, tile, rows, sampler, tileBuffer, countBuffer);
+			}
+		}
+		while (tileQueue.NextRow(worker, y))
+		{
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				int index = (y - tile.y0) * tileWidth + (x - tile.x0);
+				sampler.StartPixel(x, y);
+				if (job->progress){
+					tileBuffer[index] = SampleRange(x, y, cam, sampler, job->progress->firstSample,
+							job->progress->passSamples, job->progress->totalSamples);
+					countBuffer[index] = job->progress->passSamples;
+				}
+				else if (isMultiSample){
+					tileBuffer[index] = MultiSample(x, y, cam, sampler, countBuffer[index]);
+				}
+				else{
+					tileBuffer[index] = SingleSample(x, y, cam, sampler);
+					countBuffer[index] = 1;
+				}
+			}
+			rowsDone++;
+		}
+
+		if (job->progress)
+		{
+			int width = job->image->width;
+			for (y = tile.y0; y < tile.y0 + rowsDone; y++)
+			{
+				for (int x = tile.x0; x < tile.x1; x++)
+				{
+					int index = (y - tile.y0) * tileWidth + (x - tile.x0);
+					job->progress->sum[y * width + x] += tileBuffer[index];
+					job->progress->counts[y * width + x] += countBuffer[index];
+				}
+			}
+			continue;
+		}
+
+		long long tileSamples = 0;
+		float countScale = 255.0f / cam->GetTotalSampleCount();
+		for (y = tile.y0; y < tile.y0 + rowsDone; y++)
+		{
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				int index = (y - tile.y0) * tileWidth + (x - tile.x0);
+				job->image->setPixelValue(x, y, tileBuffer[index]);
+				tileSamples += countBuffer[index];
+
+				// The sample count image maps the cap to 255.
+				if (job->countImage){
+					float count = countBuffer[index] * countScale;
+					job->countImage->setPixelValue(x, y, Vector3f{count, count, count});
+				}
+			}
+		}
+		job->samplesTaken += tileSamples;
+
+		// The thread finishing the last pixels of an image hands it to the pool for saving.
+		int pixelsDone = rowsDone * tileWidth;
+		if (pixelsDone > 0 && job->remainingPixels.fetch_sub(pixelsDone) == pixelsDone)
+		{
+			SaveJob(job);
+		}
+	}
+}
+
+// Hands a finished image to the pool for saving.
+void Scene::SaveJob(RenderJob* job)
+{
+	job->saved = pPool->Submit([job](){
+		job->image->saveImage(job->cam->imageName);
+		delete job->image;
+
+		if (job->countImage){
+			job->countImage->saveImage(job->cam->adaptive.countImageName);
+			delete job->countImage;
+		}
+
+		if (job->cam->adaptive.enabled){
+			float average = (float)job->samplesTaken / (job->cam->imgPlane.nx * job->cam->imgPlane.ny);
+			std::cout << "Average samples per pixel for " << job->cam->imageName << ": " << average << std::endl;
+		}
+	});
+}
+
+// Breadth first version of the tile loop. All camera rays of the rows are
+// generated up front, and each generation is intersected as a whole, grouped by
+// material and shaded one group at a time. Shading queues the next generation
+// of bounce rays, until no path is left.
+void Scene::TraceWavefront(RenderJob* job, const Tile& tile, const std::vector<int>& rows, SamplerContext& sampler,
+		std::vector<Vector3f>& tileBuffer, std::vector<int>& countBuffer)
+{
+	Camera* cam = job->cam;
+	int tileWidth = tile.x1 - tile.x0;
+	int firstSample = 0;
+	int passSamples = cam->GetTotalSampleCount();
+	int totalSamples = passSamples;
+	if (job->progress)
+	{
+		firstSample = job->progress->firstSample;
+		passSamples = job->progress->passSamples;
+		totalSamples = job->progress->totalSamples;
+	}
+
+	// Paths waiting to be traced, by depth. Whitted paths may split at every
+	// dielectric, so the deepest level is always run first, in chunks of at most
+	// wavefrontBatch states. That bounds the states held at once by about twice
+	// the batch per level instead of letting them double with every bounce.
+	int rowSize = rows.size();
+	std::vector<std::vector<PathState>> pending(1);
+	std::vector<PathState>& cameraRays = pending[0];
+	cameraRays.reserve(rowSize * tileWidth * passSamples);
+	for (int r = 0; r < rowSize; r++)
+	{
+		int y = rows[r];
+		for (int x = tile.x0; x < tile.x1; x++)
+		{
+			int index = (y - tile.y0) * tileWidth + (x - tile.x0);
+			tileBuffer[index] = Vector3f{ 0, 0, 0 };
+			countBuffer[index] = passSamples;
+			sampler.StartPixel(x, y);
+
+			// Single sample renders shoot through the pixel center, as in SingleSample.
+			if (totalSamples == 1)
+			{
+				Ray ray = cam->getPrimaryRay(x, y);
+				cameraRays.push_back(PathState{ ray, ReturnVal(), sampler, Vector3f(1, 1, 1), Vector3f(0, 0, 0),
+						ray.origin, index, x, y, 0, false });
+				continue;
+			}
+
+			Vector3f lbCorner = cam->PixelLBCorner(y, x);
+			for (int i = firstSample; i < firstSample + passSamples; i++)
+			{
+				sampler.StartSample(i, totalSamples);
+				Ray ray = cam->getSampleRay(lbCorner, sampler);
+				cameraRays.push_back(PathState{ ray, ReturnVal(), sampler, Vector3f(1, 1, 1), Vector3f(0, 0, 0),
+						ray.origin, index, x, y, 0, false });
+			}
+		}
+	}
+
+	int materialSize = materials.size();
+	std::vector<int> groupStart(materialSize + 1);
+	std::vector<int> order;
+	std::vector<int> traversal;
+	std::vector<uint32_t> keys;
+	std::vector<PathState> queue;
+	BBox sceneBounds = topLevel->GetBoundingBox();
+	long long rayCount = 0;
+	long long nodeVisits = 0;
+	std::chrono::steady_clock::duration traceTime(0);
+	std::chrono::steady_clock::duration sortTime(0);
+	while (!pending.empty())
+	{
+		int generation = pending.size() - 1;
+		std::vector<PathState>& level = pending[generation];
+		if (level.empty())
+		{
+			pending.pop_back();
+			continue;
+		}
+
+		// Camera rays run at once, so the packets and the sort see all of them.
+		int levelSize = level.size();
+		int chunk = generation == 0 ? levelSize : std::min(levelSize, wavefrontBatch);
+		queue.assign(std::make_move_iterator(level.end() - chunk), std::make_move_iterator(level.end()));
+		level.erase(level.end() - chunk, level.end());
+		pending.emplace_back();
+		std::vector<PathState>& next = pending.back();
+
+		int queueSize = queue.size();
+		std::fill(groupStart.begin(), groupStart.end(), 0);
+
+		// Secondary rays are traced in direction octant and origin order. Camera rays
+		// are coherent already, as they are generated pixel by pixel.
+		auto sortStart = std::chrono::steady_clock::now();
+		if (reorderRays && generation > 0)
+		{
+			keys.resize(queueSize);
+			for (int i = 0; i < queueSize; i++)
+			{
+				keys[i] = BVHMethods::CoherenceKey(queue[i].ray, sceneBounds);
+			}
+			BVHMethods::CoherentOrder(keys, traversal);
+		}
+		else
+		{
+			traversal.resize(queueSize);
+			for (int i = 0; i < queueSize; i++)
+			{
+				traversal[i] = i;
+			}
+		}
+		auto traceStart = std::chrono::steady_clock::now();
+		sortTime += traceStart - sortStart;
+		long long visitsBefore = BVH::NodeVisits();
+
+		// Camera rays of neighboring pixels go through the BVH as packets.
+		if (packetTraversal && generation == 0)
+		{
+			RayPacket packet;
+			ReturnVal hits[packetSize];
+			for (int first = 0; first < queueSize; first += packetSize)
+			{
+				int count = std::min(packetSize, queueSize - first);
+				packet.Clear();
+				for (int i = 0; i < count; i++)
+				{
+					packet.Add(queue[first + i].ray, std::numeric_limits<float>::max());
+				}
+				packet.Prepare();
+				BVHMethods::FindPacketIntersection(packet, topLevel, hits);
+				for (int i = 0; i < count; i++)
+				{
+					queue[first + i].ret = hits[i];
+				}
+			}
+		}
+		else
+		{
+			for (int k = 0; k < queueSize; k++)
+			{
+				PathState& state = queue[traversal[k]];
+				state.ret = BVHMethods::FindIntersection(state.ray, topLevel);
+			}
+		}
+
+		// Finish the rays that leave the scene.
+		for (int k = 0; k < queueSize; k++)
+		{
+			PathState& state = queue[traversal[k]];
+			if (state.ret.full)
+			{
+				float distance = (state.ret.point - state.lastHit).norm();
+				state.weight = state.weight.cwiseProduct(BeerAttenuation(state.absorption, distance));
+				groupStart[materialRank[state.ret.matIndex - 1] + 1]++;
+			}
+			else if (state.depth == 0)
+			{
+				// Same arguments as SingleSample and TraceSample, which differ in order.
+				if (totalSamples == 1)
+				{
+					tileBuffer[state.pixel] += GetBackgroundColor(state.x, state.y, cam, state.ray);
+				}
+				else
+				{
+					tileBuffer[state.pixel] += GetBackgroundColor(state.y, state.x, cam, state.ray);
+				}
+			}
+			else if (integrator == PathIntegrator && state.specular && environmentLightIndex != -1
+					&& lights[environmentLightIndex]->GetType() == Environment)
+			{
+				EnvironmentLight* environment = (EnvironmentLight*)lights[environmentLightIndex];
+				Vector3f radiance = environment->ComputeLightContribution(state.ray.direction);
+				tileBuffer[state.pixel] += state.weight.cwiseProduct(radiance);
+			}
+		}
+
+		traceTime += std::chrono::steady_clock::now() - traceStart;
+		nodeVisits += BVH::NodeVisits() - visitsBefore;
+		rayCount += queueSize;
+
+		// Counting sort of the hits by material rank.
+		for (int m = 0; m < materialSize; m++)
+		{
+			groupStart[m + 1] += groupStart[m];
+		}
+		order.resize(groupStart[materialSize]);
+		std::vector<int> cursor(groupStart.begin(), groupStart.end() - 1);
+		for (int i = 0; i < queueSize; i++)
+		{
+			if (queue[i].ret.full)
+			{
+				order[cursor[materialRank[queue[i].ret.matIndex - 1]]++] = i;
+			}
+		}
+
+		for (int m = 0; m < materialSize; m++)
+		{
+			int groupSize = groupStart[m + 1] - groupStart[m];
+			if (groupSize > 0)
+			{
+				ShadeWavefrontGroup(queue, &order[groupStart[m]], groupSize, next, tileBuffer);
+			}
+		}
+	}
+
+	wavefrontRays += rayCount;
+	wavefrontNodeVisits += nodeVisits;
+	wavefrontTraceNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(traceTime).count();
+	wavefrontSortNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(sortTime).count();
+
+	// Progressive passes keep sums, the others store the average.
+	if (!job->progress)
+	{
+		for (int r = 0; r < rowSize; r++)
+		{
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				tileBuffer[(rows[r] - tile.y0) * tileWidth + (x - tile.x0)] /= passSamples;
+			}
+		}
+	}
+}
+
+// Shades hits that all have the same material, so one kernel runs over the
+// whole group with its branches and material data staying hot.
+void Scene::ShadeWavefrontGroup(std::vector<PathState>& queue, const int* group, int groupSize,
+		std::vector<PathState>& next, std::vector<Vector3f>& tileBuffer)
+{
+	Material* mat = materials[queue[group[0]].ret.matIndex - 1];
+	std::vector<int8_t> shadowed;
+	if (packetTraversal)
+	{
+		PacketShadows(queue, group, groupSize, mat, shadowed);
+	}
+	int lightCount = lightSampler->GetUnsampledLights().size();
+
+	if (integrator == PathIntegrator)
+	{
+		for (int i = 0; i < groupSize; i++)
+		{
+			const int8_t* stateShadowed = shadowed.empty() ? nullptr : &shadowed[i * lightCount];
+			ShadePathVertex(queue[group[i]], mat, stateShadowed, next, tileBuffer);
+		}
+		return;
+	}
 
-	bool isTir = false;
-	if (squareRootPart < 0)
+	for (int i = 0; i < groupSize; i++)
 	{
-		isTir = true;
+		const int8_t* stateShadowed = shadowed.empty() ? nullptr : &shadowed[i * lightCount];
+		ShadeWhittedVertex(queue[group[i]], mat, stateShadowed, next, tileBuffer);
 	}
+}
 
-	squareRootPart = sqrt(squareRootPart);
-	Vector3f tDirection = leftPart - (normal * squareRootPart);
-	tDirection = tDirection.normalized();
-	Ray tRay(ret.point - shadowRayEps * normal, tDirection, ray.time);
+// Whether a shading kernel computes direct light at this state.
+bool Scene::NeedsDirectLight(const PathState& state, Material* mat)
+{
+	if (state.ret.dm == ReplaceAll && (integrator == PathIntegrator || state.depth == 0))
+	{
+		return false;
+	}
 
-	// Return dielectric component.
-    ReturnVal nearestRet = BVHMethods::FindIntersection(tRay, objects, instances);
-	int materialIndex = nearestRet.matIndex - 1;
+	return mat->type != Dielectric || state.ray.direction.dot(state.ret.normal) < 0;
+}
 
-	// Fresnel
-	float fresnel = FresnelReflectance(n_t, n_i, ray, tRay, normal);
-	float beerDistance = (nearestRet.point - ret.point).norm();
+// Shadow tests of a group toward every unsampled point light, traced as packets
+// of rays leaving the light. Rays are packed by octant around the light, so each
+// packet keeps its frustum, and within an octant in the coherence order of the
+// shaded points, so each packet covers nearby points. shadowed gets one entry per
+// state and unsampled light, with -1 for the points left to the light's own test.
+void Scene::PacketShadows(std::vector<PathState>& queue, const int* group, int groupSize, Material* mat,
+		std::vector<int8_t>& shadowed)
+{
+	const std::vector<int>& unsampled = lightSampler->GetUnsampledLights();
+	int lightCount = unsampled.size();
+	shadowed.assign(groupSize * lightCount, -1);
+
+	BBox sceneBounds = topLevel->GetBoundingBox();
+	RayPacket packet;
+	std::vector<int> members;
+	std::vector<int> facing;
+	std::vector<uint32_t> keys;
+	std::vector<int> order;
+	for (int l = 0; l < lightCount; l++)
+	{
+		if (lights[unsampled[l]]->GetType() != Point)
+		{
+			continue;
+		}
+
+		// Only points facing the light are packed. From behind, the reversed ray
+		// could not tell the point's own surface from an occluder. The key takes
+		// the octant from the packet direction and the position from the point.
+		// Without ray reordering only the octant is kept.
+		Vector3f position = ((PointLight*)lights[unsampled[l]])->GetPosition();
+		facing.clear();
+		keys.clear();
+		for (int i = 0; i < groupSize; i++)
+		{
+			const PathState& state = queue[group[i]];
+			Vector3f toPoint = state.ret.point - position;
+			if (NeedsDirectLight(state, mat) && state.ret.normal.dot(toPoint) < 0)
+			{
+				uint32_t key = BVHMethods::CoherenceKey(Ray(state.ret.point, toPoint, state.ray.time), sceneBounds);
+				facing.push_back(i);
+				keys.push_back(reorderRays ? key : key & (7u << 27));
+			}
+		}
+		BVHMethods::CoherentOrder(keys, order);
 
-	float beerRed = BeerLaw(mat->absorptionCoefficient[0], beerDistance);
-	float beerGreen = BeerLaw(mat->absorptionCoefficient[1], beerDistance);
-	float beerBlue = BeerLaw(mat->absorptionCoefficient[2], beerDistance);
-	Vector3f beer = {beerRed, beerGreen, beerBlue};
+		int facingSize = facing.size();
+		for (int k = 0; k < facingSize; k++)
+		{
+			// A new octant starts a new packet.
+			if (packet.Size() > 0 && keys[order[k]] >> 27 != keys[order[k - 1]] >> 27)
+			{
+				TraceShadowPacket(packet, members, l, lightCount, shadowed);
+			}
 
-	return DielectricComponent{ tRay, nearestRet, materials[materialIndex], fresnel, beer, isEntering, isTir };
+			int i = facing[order[k]];
+			const PathState& state = queue[group[i]];
+			Vector3f toOrigin = state.ret.point + state.ret.normal * shadowRayEps - position;
+			float distance = toOrigin.norm();
+			packet.Add(Ray(position, toOrigin / distance, state.ray.time), distance - 2 * shadowRayEps);
+			members.push_back(i);
+			if (packet.Size() == packetSize)
+			{
+				TraceShadowPacket(packet, members, l, lightCount, shadowed);
+			}
+		}
+		if (packet.Size() > 0)
+		{
+			TraceShadowPacket(packet, members, l, lightCount, shadowed);
+		}
+	}
 }
 
-float Scene::FresnelReflectance(float n_t, float n_i, const Ray& iRay, const Ray& tRay, const Vector3f& normal)
+void Scene::TraceShadowPacket(RayPacket& packet, std::vector<int>& members, int light, int lightCount,
+		std::vector<int8_t>& shadowed)
 {
-	float cos_t = -tRay.direction.dot(normal);
-	float cos_i = -iRay.direction.dot(normal);
+	ReturnVal hits[packetSize];
+	packet.Prepare();
+	BVHMethods::FindPacketIntersection(packet, topLevel, hits);
 
-	float rParallel = (n_t * cos_i - n_i * cos_t) / (n_t * cos_i + n_i * cos_t);
-	float rPerpendicular = (n_i * cos_i - n_t * cos_t) / (n_i * cos_i + n_t * cos_t);
-	return (0.5f) * (pow(rParallel, 2) + pow(rPerpendicular, 2));
-}
+	int memberSize = members.size();
+	for (int lane = 0; lane < memberSize; lane++)
+	{
+		bool blocked = hits[lane].full &&
+				(hits[lane].point - packet.GetRay(lane).origin).norm() < packet.GetMaxDistance(lane);
+		shadowed[members[lane] * lightCount + light] = blocked ? 1 : 0;
+	}
 
-float Scene::BeerLaw(float sigma_t, float distance)
-{
-	return exp(-sigma_t * distance);
+	packet.Clear();
+	members.clear();
 }
 
-float Scene::ConductorFresnel(float n_t, float k_t, const Ray& ray, const Vector3f& normal)
+// Single sample pixels of up to packetWidth rows, with the camera rays of each
+// block of packetWidth columns traced as one packet. Shading is the same as in SingleSample.
+void Scene::TracePrimaryPackets(Camera* cam, const Tile& tile, const std::vector<int>& rows, SamplerContext& sampler,
+		std::vector<Vector3f>& tileBuffer, std::vector<int>& countBuffer)
 {
-	float cos_t = -ray.direction.dot(normal);
-	float twoNtCost = 2 * n_t * cos_t;
-	float cosSquared = pow(cos_t, 2);
-	float nt_ktSquare = pow(n_t, 2) + pow(k_t, 2);
+	int tileWidth = tile.x1 - tile.x0;
+	int rowSize = rows.size();
+	int blockWidth = packetWidth;
 
-	float rs = (nt_ktSquare - twoNtCost + cosSquared) / (nt_ktSquare + twoNtCost + cosSquared);
-	float rp = (nt_ktSquare * cosSquared - twoNtCost + 1) / (nt_ktSquare * cosSquared + twoNtCost + 1);
+	RayPacket packet;
+	ReturnVal hits[packetSize];
+	for (int bx = tile.x0; bx < tile.x1; bx += blockWidth)
+	{
+		int bx1 = std::min(bx + blockWidth, tile.x1);
+		packet.Clear();
+		for (int r = 0; r < rowSize; r++)
+		{
+			for (int x = bx; x < bx1; x++)
+			{
+				packet.Add(cam->getPrimaryRay(x, rows[r]), std::numeric_limits<float>::max());
+			}
+		}
+		packet.Prepare();
+		BVHMethods::FindPacketIntersection(packet, topLevel, hits);
 
-	return (0.5f) * (rs + rp);
+		int lane = 0;
+		for (int r = 0; r < rowSize; r++)
+		{
+			for (int x = bx; x < bx1; x++, lane++)
+			{
+				int y = rows[r];
+				int index = (y - tile.y0) * tileWidth + (x - tile.x0);
+				const Ray& ray = packet.GetRay(lane);
+				sampler.StartPixel(x, y);
+				if (hits[lane].full)
+				{
+					tileBuffer[index] = Shading(ray, hits[lane], materials[hits[lane].matIndex - 1], sampler);
+				}
+				else
+				{
+					tileBuffer[index] = GetBackgroundColor(x, y, cam, ray);
+				}
+				countBuffer[index] = 1;
+			}
+		}
+	}
 }
 
-Vector3f Scene::RecursiveShading(const Ray& ray, const ReturnVal& ret, Material* mat, int depth)
+// One level of RecursiveShading. The reflected and refracted rays are queued
+// with their weight instead of being traced right away.
+void Scene::ShadeWhittedVertex(PathState& state, Material* mat, const int8_t* shadowed, std::vector<PathState>& next,
+		std::vector<Vector3f>& tileBuffer)
 {
-	if (!ret.full)
+	const Ray& ray = state.ray;
+	const ReturnVal& ret = state.ret;
+	Vector3f& pixel = tileBuffer[state.pixel];
+	if (state.depth == 0 && ret.dm == ReplaceAll)
 	{
-		return Vector3f{ 0, 0, 0 };
+		pixel += ret.textureColor;
+		return;
 	}
 
+	pixel += state.weight.cwiseProduct(mat->radiance);
+
+	int depth = maxRecursionDepth - state.depth;
 	if (mat->type == Normal || depth <= 0)
 	{
-		return BasicShading(ray, ret, mat);
-	}
-	else if (mat->type == Mirror)
-	{
-		ShadingComponent sc = MirrorReflectance(ray, ret, mat);
-		Vector3f reflectedColor = RecursiveShading(sc.ray, sc.ret, sc.mat, depth - 1);
-		reflectedColor = mat->mirrorRef.cwiseProduct(reflectedColor);
-		return BasicShading(ray, ret, mat) + reflectedColor;
+		Vector3f direct = BasicShading(ray, ret, mat, state.sampler, shadowed);
+		pixel += state.weight.cwiseProduct(direct + CausticRadiance(ray, ret, mat));
+		return;
 	}
-	else if (mat->type == Dielectric)
+
+	Vector3f zero(0, 0, 0);
+	if (mat->type != Dielectric)
 	{
-		DielectricComponent dc = DielectricRefraction(ray, ret, mat);
-		if (dc.isEntering)
+		Vector3f factor = mat->mirrorRef;
+		if (mat->type == Conductor)
 		{
-			Vector3f insideColor = RecursiveShading(dc.ray, dc.ret, dc.mat, depth - 1);
-			insideColor = (1 - dc.fresnel) * insideColor;
-			insideColor = dc.beer.cwiseProduct(insideColor);
+			factor *= ConductorFresnel(mat->refractionIndex, mat->absorptionIndex, ray, ret.normal);
+		}
+		pixel += state.weight.cwiseProduct(BasicShading(ray, ret, mat, state.sampler, shadowed));
+		QueueBranch(state, mat, nullptr, factor, zero, next);
+		return;
+	}
 
-			ShadingComponent sc = MirrorReflectance(ray, ret, mat);
-			Vector3f reflectedColor = RecursiveShading(sc.ray, sc.ret, sc.mat, depth - 1);
-			reflectedColor = dc.fresnel * reflectedColor;
+	float fresnel;
+	bool isEntering;
+	bool isTir;
+	Ray tRay = RefractedRay(ray, ret, mat, fresnel, isEntering, isTir);
+
+	// Light is absorbed along refracted rays going in and reflected rays staying inside.
+	Vector3f inside = mat->absorptionCoefficient;
+	Vector3f reflectAbsorption = isEntering ? zero : inside;
+	Vector3f transmitAbsorption = isEntering ? inside : zero;
+	if (isEntering)
+	{
+		pixel += state.weight.cwiseProduct(BasicShading(ray, ret, mat, state.sampler, shadowed));
+	}
+	else if (isTir)
+	{
+		QueueBranch(state, mat, nullptr, Vector3f(1, 1, 1), inside, next);
+		return;
+	}
 
-			insideColor = NanCheck(insideColor);
-			reflectedColor = NanCheck(reflectedColor);
-			return BasicShading(ray, ret, mat) + insideColor + reflectedColor;
+	Vector3f reflectFactor = Vector3f::Constant(fresnel);
+	Vector3f transmitFactor = Vector3f::Constant(1 - fresnel);
+	if (stochasticDielectrics)
+	{
+		float probability = std::max(0.0f, std::min(1.0f, fresnel));
+		if (state.sampler.Next() < probability)
+		{
+			QueueBranch(state, mat, nullptr, reflectFactor / probability, reflectAbsorption, next);
 		}
 		else
 		{
-			if (dc.isTir)
-			{
-				ShadingComponent sc = MirrorReflectance(ray, ret, mat);
-				Vector3f internalReflection = RecursiveShading(sc.ray, sc.ret, sc.mat, depth - 1);
-				internalReflection = dc.beer.cwiseProduct(internalReflection);
+			QueueBranch(state, mat, &tRay, transmitFactor / (1 - probability), transmitAbsorption, next);
+		}
+		return;
+	}
 
-				internalReflection = NanCheck(internalReflection);
-				return internalReflection;
-			}
-			else
-			{
-				Vector3f outsideColor = RecursiveShading(dc.ray, dc.ret, dc.mat, depth - 1);
-				outsideColor = (1 - dc.fresnel) * outsideColor;
+	QueueBranch(state, mat, &tRay, transmitFactor, transmitAbsorption, next);
+	QueueBranch(state, mat, nullptr, reflectFactor, reflectAbsorption, next);
+}
+
+// Queues the refracted ray, or the mirror reflection when refracted is null,
+// unless the branch is pruned.
+void Scene::QueueBranch(PathState& state, Material* mat, const Ray* refracted, const Vector3f& factor,
+		const Vector3f& absorption, std::vector<PathState>& next)
+{
+	float scale;
+	Vector3f weight = NanCheck(state.weight.cwiseProduct(factor));
+	if (!KeepBranch(weight, scale, state.sampler))
+	{
+		return;
+	}
 
-				ShadingComponent sc = MirrorReflectance(ray, ret, mat);
-				Vector3f reflectedColor = RecursiveShading(sc.ray, sc.ret, sc.mat, depth - 1);
-				reflectedColor = dc.fresnel * reflectedColor;
-				reflectedColor = dc.beer.cwiseProduct(reflectedColor);
+	Ray ray = refracted ? *refracted : ReflectedRay(state.ray, state.ret, mat, state.sampler);
+	next.push_back(PathState{ ray, ReturnVal(), state.sampler, weight * scale, absorption, state.ret.point, state.pixel,
+			state.x, state.y, state.depth + 1, true });
+}
 
-				outsideColor = NanCheck(outsideColor);
-				reflectedColor = NanCheck(reflectedColor);
-				return outsideColor + reflectedColor;
-			}
+// One iteration of the PathShading loop.
+void Scene::ShadePathVertex(PathState& state, Material* mat, const int8_t* shadowed, std::vector<PathState>& next,
+		std::vector<Vector3f>& tileBuffer)
+{
+	const Ray& ray = state.ray;
+	const ReturnVal& ret = state.ret;
+	Vector3f& pixel = tileBuffer[state.pixel];
+	if (ret.dm == ReplaceAll)
+	{
+		pixel += state.weight.cwiseProduct(ret.textureColor);
+		return;
+	}
+
+	if (state.depth == 0 || state.specular)
+	{
+		pixel += state.weight.cwiseProduct(mat->radiance);
+	}
+
+	if (mat->type != Dielectric || ray.direction.dot(ret.normal) < 0)
+	{
+		pixel += state.weight.cwiseProduct(BasicShading(ray, ret, mat, state.sampler, shadowed, state.depth == 0));
+	}
+
+	if (state.depth >= maxRecursionDepth)
+	{
+		return;
+	}
+
+	Vector3f indirect;
+	if ((state.depth == 0 || state.specular) && CachedIndirect(ray, ret, mat, indirect))
+	{
+		pixel += state.weight.cwiseProduct(indirect);
+		return;
+	}
+
+	Vector3f throughput = state.weight;
+	if (state.depth >= rouletteDepth)
+	{
+		float survival = std::min(0.95f, throughput.maxCoeff());
+		if (state.sampler.Next() >= survival)
+		{
+			return;
 		}
+		throughput /= survival;
 	}
-	else
+
+	Ray nextRay(ray.time);
+	Vector3f weight;
+	Vector3f absorption;
+	bool specular;
+	if (!ScatterRay(ShadingComponent{ ray, ret, mat }, nextRay, weight, absorption, specular, state.sampler))
 	{
-		float fresnel = ConductorFresnel(mat->refractionIndex, mat->absorptionIndex, ray, ret.normal);
-		ShadingComponent sc = MirrorReflectance(ray, ret, mat);
-		Vector3f reflectedColor = RecursiveShading(sc.ray, sc.ret, sc.mat, depth - 1);
-		reflectedColor = fresnel * reflectedColor;
-		reflectedColor = mat->mirrorRef.cwiseProduct(reflectedColor);
-		return BasicShading(ray, ret, mat) + reflectedColor;
+		return;
 	}
-}
 
-Vector3f Scene::NanCheck(Vector3f checkVector){
-	if (checkVector[0] != checkVector[0] || checkVector[1] != checkVector[1] || checkVector[2] != checkVector[2])
+	throughput = NanCheck(throughput.cwiseProduct(weight));
+	if (throughput.maxCoeff() <= 0)
 	{
-		return Vector3f{ 0, 0, 0 };
+		return;
 	}
 
-	return checkVector;
+	next.push_back(PathState{ nextRay, ReturnVal(), state.sampler, throughput, absorption, ret.point, state.pixel,
+			state.x, state.y, state.depth + 1, specular });
 }
 
-Eigen::Vector3f Scene::Shading(const Ray& ray, const ReturnVal& ret, Material* mat)
+void Scene::EstimateTileCosts(std::vector<RenderJob*>& jobs, TileQueue& tileQueue)
 {
-    if (ret.dm == ReplaceAll){
-        return ret.textureColor;
-    }
-
-	// Create a new rawColor (not bounded to 255).
-	Vector3f color = RecursiveShading(ray, ret, mat, maxRecursionDepth);
+	// Time one primary sample for every 8th pixel in each direction of a tile,
+	// on the pool's workers only, as the tiles are rendered.
+	int tileCount = tileQueue.Size();
+	std::vector<float> costs(tileCount);
+	pPool->ParallelFor(0, tileCount, [this, &jobs, &tileQueue, &costs](int i){
+		Tile tile = tileQueue.GetTile(i);
+		Camera* cam = jobs[tile.job]->cam;
+		SamplerContext sampler(pixelSampler, seed ^ Sampling::PcgHash(cam->id));
+
+		auto start = std::chrono::steady_clock::now();
+		for (int y = tile.y0; y < tile.y1; y += 8)
+		{
+			for (int x = tile.x0; x < tile.x1; x += 8)
+			{
+				sampler.StartPixel(x, y);
+				SingleSample(x, y, cam, sampler);
+			}
+		}
+		std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+		costs[i] = elapsed.count();
+	}, false);
 
-	// Clamp and return.
-	return color;
+	tileQueue.SortByCost(costs);
 }
 
-Vector3f Scene::BasicShading(const Ray& ray, const ReturnVal& ret, Material* mat)
+void Scene::RenderTiles(std::vector<RenderJob*>& jobs, TileQueue& tileQueue, bool reportIdle)
 {
-	// Create a new rawColor (not bounded to 255).
-	Vector3f rawColor(0, 0, 0);
+	// Workers pull tiles until the queue is empty, so expensive regions do not stall the rest.
+	int workerCount = std::min(pPool->Size(), tileQueue.Size());
+	tileQueue.PrepareWorkers(workerCount);
+
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point phaseStart = Clock::now();
+	std::vector<Clock::time_point> started(workerCount);
+	std::vector<Clock::time_point> finished(workerCount);
+
+	// The calling thread only waits, so --pin covers every render thread.
+	TaskGroup rendering(*pPool, false);
+	for (int t = 0; t < workerCount; t++){
+		rendering.Run([this, &jobs, &tileQueue, &started, &finished, t](){
+			started[t] = Clock::now();
+			ThreadedRendering(jobs, tileQueue, t);
+			finished[t] = Clock::now();
+		});
+	}
+	rendering.Wait();
+
+	if (!reportIdle){
+		return;
+	}
 
-	// Compute ambient color (no shadow check).
-	rawColor = ambient(mat);
+	// Idle time is the wait before a worker starts plus the wait after it runs out of work.
+	Clock::time_point phaseEnd = Clock::now();
+	for (int t = 0; t < workerCount; t++){
+		std::chrono::duration<float> busy = finished[t] - started[t];
+		std::chrono::duration<float> idle = (started[t] - phaseStart) + (phaseEnd - finished[t]);
+		std::cout << "Thread " << t << ": busy " << busy.count() << "s, idle " << idle.count() << "s." << std::endl;
+	}
+}
 
-	// Check shadows for diffuse and specular shading (for every light source).
-	for (int i = 0; i < lights.size(); i++)
+void Scene::SaveProgress(RenderJob* job, const char* imageName)
+{
+	ProgressiveState* progress = job->progress;
+	int width = job->image->width;
+	int height = job->image->height;
+	Image image(width, height);
+	for (int y = 0; y < height; y++)
 	{
-	    /*
-		if (isDark(ray, ret.point, ret, lights[i]))
+		for (int x = 0; x < width; x++)
 		{
-			continue;
+			// The first pass reaches every pixel, so the count is zero only for empty images.
+			int count = progress->counts[y * width + x];
+			Vector3f color = count > 0 ? Vector3f(progress->sum[y * width + x] / count) : Vector3f{0, 0, 0};
+			image.setPixelValue(x, y, color);
 		}
-
-		// No shadow for this light: Add diffuse and specular shading color.
-		rawColor += diffuse(ret, mat, ray, lights[i]);
-		rawColor += specular(ray, ret, mat, lights[i]);*/
-	    rawColor += lights[i]->BasicShading(ray, ret, mat);
 	}
-
-	return rawColor;
+	image.saveImage(imageName);
 }
 
-void Scene::ThreadedRendering(int threadIndex, Image& image, Camera* cam)
+void Scene::RenderProgressive(std::vector<RenderJob*>& jobs, int jobIndex, bool hasDeadline,
+		std::chrono::steady_clock::time_point deadline)
 {
-	bool isMultiSample = cam->GetTotalSampleCount() > 1;
-	int threadCount = 8;
-	int height = image.height;
-	if (isMultiSample){
-        for (int y = 0; y < height; y++)
-        {
-            for (int x = threadIndex; x < image.width; x += threadCount)
-            {
-                image.setPixelValue(x, y, MultiSample(x, y, cam));
-            }
-        }
+	typedef std::chrono::steady_clock Clock;
+	RenderJob* job = jobs[jobIndex];
+	int pixelCount = job->image->width * job->image->height;
+	int target = targetSamples > 0 ? targetSamples : job->cam->GetTotalSampleCount();
+	int totalSamples = target;
+
+	// A budget without a target keeps adding passes until the deadline.
+	if (targetSamples <= 0 && hasDeadline)
+	{
+		target = std::numeric_limits<int>::max();
+		totalSamples = budgetSampleBound;
 	}
-	else{
-        for (int y = 0; y < height; y++)
-        {
-            for (int x = threadIndex; x < image.width; x += threadCount)
-            {
-                image.setPixelValue(x, y, SingleSample(x, y, cam));
-            }
-        }
+
+	ProgressiveState progress;
+	progress.sum.assign(pixelCount, Vector3f{0, 0, 0});
+	progress.counts.assign(pixelCount, 0);
+	progress.totalSamples = totalSamples;
+	progress.hasDeadline = hasDeadline;
+	progress.deadline = deadline;
+	job->progress = &progress;
+
+	// The tiles and their cost order are the same for every pass.
+	TileQueue tileQueue;
+	tileQueue.Append(job->image->width, job->image->height, tileSize, tileOrder, jobIndex);
+	if (tileOrder == CostOrder)
+	{
+		EstimateTileCosts(jobs, tileQueue);
 	}
+
+	Clock::time_point lastSnapshot = Clock::now();
+	int samplesDone = 0;
+	int passSamples = 1;
+	int pass = 0;
+	while (samplesDone < target && (pass == 0 || !(progress.hasDeadline && Clock::now() >= progress.deadline)))
+	{
+		progress.firstSample = samplesDone;
+		progress.passSamples = std::min(passSamples, target - samplesDone);
+
+		Clock::time_point passStart = Clock::now();
+		tileQueue.Reset();
+		RenderTiles(jobs, tileQueue, false);
+		std::chrono::duration<float> passTime = Clock::now() - passStart;
+
+		samplesDone += progress.passSamples;
+		pass++;
+		std::cout << "Pass " << pass << ": " << samplesDone << " spp in " << passTime.count() << "s." << std::endl;
+
+		// Write the best image so far to the output file every snapshot interval.
+		std::chrono::duration<float> sinceSnapshot = Clock::now() - lastSnapshot;
+		if (snapshotInterval > 0 && sinceSnapshot.count() >= snapshotInterval && samplesDone < target)
+		{
+			SaveProgress(job, job->cam->imageName);
+			lastSnapshot = Clock::now();
+		}
+
+		// Passes double in size, but stay within one snapshot interval and the time left.
+		float secondsPerSample = passTime.count() / progress.passSamples;
+		passSamples = progress.passSamples * 2;
+		if (secondsPerSample > 0 && snapshotInterval > 0)
+		{
+			passSamples = std::min(passSamples, std::max(1, (int)(snapshotInterval / secondsPerSample)));
+		}
+		if (secondsPerSample > 0 && progress.hasDeadline)
+		{
+			std::chrono::duration<float> remaining = progress.deadline - Clock::now();
+			passSamples = std::min(passSamples, std::max(1, (int)(remaining.count() / secondsPerSample)));
+		}
+	}
+
+	SaveProgress(job, job->cam->imageName);
+	job->progress = nullptr;
+	delete job->image;
+	job->image = nullptr;
 }
 
 void Scene::renderScene(void)
@@ -297,7 +1785,7 @@ void Scene::renderScene(void)
     perlin = new Perlin();
 
     // Compute object transformation matrices.
-    Transforming::ComputeObjectTransformations(objects, instances, translations, scalings, rotations, composites);
+    Transforming::ComputeObjectTransformations(objects, groups, instances, translations, scalings, rotations, composites);
 
     // Fill in vertex normals.
     Eigen::Vector3f emptyNormal = {0,0,0};
@@ -317,62 +1805,216 @@ void Scene::renderScene(void)
         vertexNormals[i] = vertexNormals[i].normalized();
     }
 
-    // Create BVH for all objects.
-    for (int i = 0; i < objectSize; i++){
+    // Create BVH for all objects. Object BVHs are independent, so they are built in parallel.
+    pPool->ParallelFor(0, objectSize, [this](int i){
         objects[i]->bvh = new BVH(objects[i]);
+    });
+
+    // Create one shared BVH per instance group. A group needs the BVHs of the groups it
+    // contains, so groups are built one depth level at a time.
+    int groupSize = groups.size();
+    for (int depth = 1; depth <= maxGroupDepth; depth++){
+        std::vector<Group*> level;
+        for (int i = 0; i < groupSize; i++){
+            if (groups[i]->depth == depth){
+                level.push_back(groups[i]);
+            }
+        }
+
+        pPool->ParallelFor(0, level.size(), [&level](int i){
+            level[i]->ComputeBounds();
+            level[i]->bvh = new BVH(level[i]);
+        });
     }
 
+    // Create the top level BVH over all objects and instances.
+    topLevel = BVHMethods::BuildTopLevel(objects, instances, objectWrappers);
+
 	// Create BVH.
 	//bvh = new BVH();
 	std::cout << "BVH construction complete." << std::endl;
+	std::cout << "Rendering with " << pPool->Size() << " threads." << std::endl;
+
+	wavefrontRays = 0;
+	wavefrontTraceNanos = 0;
+	wavefrontSortNanos = 0;
+	wavefrontNodeVisits = 0;
+	pixelSampler = Sampling::CreateSampler(samplerType);
+
+	// Light objects find their surfaces in world space.
+	int lightSize = lights.size();
+	for (int i = 0; i < lightSize; i++)
+	{
+		lights[i]->Prepare();
+	}
+	lightSampler = new LightSampler(lights, lightSampling);
+
+	// The wavefront shades materials of the same type and BRDF next to each other.
+	int materialSize = materials.size();
+	std::vector<int> byKind(materialSize);
+	for (int i = 0; i < materialSize; i++)
+	{
+		byKind[i] = i;
+	}
+	std::stable_sort(byKind.begin(), byKind.end(), [this](int a, int b){
+		if (materials[a]->type != materials[b]->type)
+		{
+			return materials[a]->type < materials[b]->type;
+		}
+		return materials[a]->_brdfType < materials[b]->_brdfType;
+	});
+	materialRank.resize(materialSize);
+	for (int i = 0; i < materialSize; i++)
+	{
+		materialRank[byKind[i]] = i;
+	}
+
+	// Without a fixed seed every run gets different noise.
+	if (!deterministic){
+		seed = std::random_device()();
+	}
 
-	// Save an image for all cameras.
-	for (int i = 0; i < cameras.size(); i++)
+	BuildCausticMap();
+	PrepareIrradianceCache();
+
+	// One job per camera. Each image is saved in the background as soon as its last tile is done.
+	std::vector<RenderJob*> jobs;
+	int cameraSize = cameras.size();
+	for (int i = 0; i < cameraSize; i++)
+	{
+		RenderJob* job = new RenderJob;
+		job->cam = cameras[i];
+		job->image = new Image(job->cam->imgPlane.nx, job->cam->imgPlane.ny);
+		job->remainingPixels = job->image->width * job->image->height;
+		job->samplesTaken = 0;
+		job->progress = nullptr;
+		job->countImage = nullptr;
+		if (job->cam->adaptive.countImageName[0] != '\0' && !progressive)
+		{
+			job->countImage = new Image(job->cam->imgPlane.nx, job->cam->imgPlane.ny);
+		}
+		jobs.push_back(job);
+
+		// An empty image has no tile to finish it, so it is saved right away.
+		if (job->remainingPixels == 0 && !progressive)
+		{
+			SaveJob(job);
+		}
+	}
+
+	int jobSize = jobs.size();
+	if (progressive)
+	{
+		// The time left is shared by the cameras that have not rendered yet. Once it
+		// is spent, the remaining cameras get a single pass at the minimum quality.
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point renderStart = Clock::now();
+		for (int i = 0; i < jobSize; i++)
+		{
+			Clock::time_point now = Clock::now();
+			Clock::time_point deadline = now;
+			if (timeBudget > 0)
+			{
+				std::chrono::duration<float> elapsed = now - renderStart;
+				std::chrono::duration<float> cameraBudget(std::max(0.0f, timeBudget - elapsed.count()) / (jobSize - i));
+				deadline = now + std::chrono::duration_cast<Clock::duration>(cameraBudget);
+			}
+			RenderProgressive(jobs, i, timeBudget > 0, deadline);
+		}
+	}
+	else if (concurrentCameras)
+	{
+		// Tiles of all cameras share one queue, so no camera leaves cores idle at its end.
+		TileQueue tileQueue;
+		for (int i = 0; i < jobSize; i++)
+		{
+			tileQueue.Append(jobs[i]->image->width, jobs[i]->image->height, tileSize, tileOrder, i);
+		}
+		if (tileOrder == CostOrder)
+		{
+			EstimateTileCosts(jobs, tileQueue);
+		}
+		RenderTiles(jobs, tileQueue, true);
+	}
+	else
+	{
+		for (int i = 0; i < jobSize; i++)
+		{
+			TileQueue tileQueue;
+			tileQueue.Append(jobs[i]->image->width, jobs[i]->image->height, tileSize, tileOrder, i);
+			if (tileOrder == CostOrder)
+			{
+				EstimateTileCosts(jobs, tileQueue);
+			}
+			RenderTiles(jobs, tileQueue, true);
+		}
+	}
+
+	if (wavefront && wavefrontRays > 0)
 	{
-		Camera* cam = cameras[i];
-		int width, height;
-		width = cam->imgPlane.nx;
-		height = cam->imgPlane.ny;
-		Image image(width, height);
+		// Intersection time leaves out the sort, which is reported on its own.
+		float traceSeconds = wavefrontTraceNanos * 1e-9f;
+		std::cout << "Wavefront: " << wavefrontRays << " rays, " << wavefrontRays / traceSeconds / 1e6f
+				  << " Mrays/s in intersection, " << (float)wavefrontNodeVisits / wavefrontRays
+				  << " BVH nodes visited per ray (ray reordering " << (reorderRays ? "on" : "off") << ")." << std::endl;
+		if (reorderRays)
+		{
+			std::cout << "Ray reordering: " << wavefrontSortNanos * 1e-9f << "s sorting, summed over threads." << std::endl;
+		}
+	}
 
-		//ThreadedRendering(0, std::ref(image), cam);
+	long long occluderTests = OccluderCache::TestCount();
+	if (occluderCache && occluderTests > 0)
+	{
+		std::cout << "Occluder cache: " << 100.0f * OccluderCache::HitCount() / occluderTests << "% of "
+				  << occluderTests << " point and spot light shadow rays blocked by the cached occluder." << std::endl;
+	}
 
-		std::thread threadObj1(&Scene::ThreadedRendering, this, 0, std::ref(image), cam);
-		std::thread threadObj2(&Scene::ThreadedRendering, this, 1, std::ref(image), cam);
-		std::thread threadObj3(&Scene::ThreadedRendering, this, 2, std::ref(image), cam);
-		std::thread threadObj4(&Scene::ThreadedRendering, this, 3, std::ref(image), cam);
-		std::thread threadObj5(&Scene::ThreadedRendering, this, 4, std::ref(image), cam);
-		std::thread threadObj6(&Scene::ThreadedRendering, this, 5, std::ref(image), cam);
-		std::thread threadObj7(&Scene::ThreadedRendering, this, 6, std::ref(image), cam);
-		std::thread threadObj8(&Scene::ThreadedRendering, this, 7, std::ref(image), cam);
+	if (irradianceCache != nullptr && irradianceCache->LookupCount() > 0)
+	{
+		std::cout << "Irradiance cache: " << irradianceCache->RecordCount() << " records, "
+				  << 100.0f * irradianceCache->HitCount() / irradianceCache->LookupCount()
+				  << "% of lookups interpolated." << std::endl;
+	}
 
-		threadObj1.join();
-		threadObj2.join();
-		threadObj3.join();
-		threadObj4.join();
-		threadObj5.join();
-		threadObj6.join();
-		threadObj7.join();
-		threadObj8.join();
+	for (int i = 0; i < jobSize; i++)
+	{
+		if (jobs[i]->saved.valid())
+		{
+			jobs[i]->saved.get();
+		}
+		delete jobs[i];
+	}
 
-		// DON'T FORGET TO CHANGE THREAD COUNT //
+	// The samplers are rebuilt from the scene settings on every render.
+	delete lightSampler;
+	lightSampler = nullptr;
+	delete pixelSampler;
+	pixelSampler = nullptr;
 
-		// Save image.
-		image.saveImage(cam->imageName);
+	// The top level and the wrappers of plain objects are rebuilt on every render too.
+	int wrapperSize = objectWrappers.size();
+	for (int i = 0; i < wrapperSize; i++)
+	{
+		delete objectWrappers[i];
 	}
+	objectWrappers.clear();
+	delete topLevel->bvh;
+	delete topLevel;
+	topLevel = nullptr;
 }
 
-Vector3f Scene::SingleSample(int row, int col, Camera* cam){
+Vector3f Scene::SingleSample(int row, int col, Camera* cam, SamplerContext& sampler){
     Ray ray(0);
     Vector3f color;
     ReturnVal nearestRet;
 
     ray = cam->getPrimaryRay(row, col);
-    nearestRet = BVHMethods::FindIntersection(ray, objects, instances);
+    nearestRet = BVHMethods::FindIntersection(ray, topLevel);
 
     if (nearestRet.full)
     {
-        color = Shading(ray, nearestRet, materials[nearestRet.matIndex - 1]);
+        color = Shading(ray, nearestRet, materials[nearestRet.matIndex - 1], sampler);
     }
 
     else
@@ -383,31 +2025,80 @@ Vector3f Scene::SingleSample(int row, int col, Camera* cam){
     return color;
 }
 
-Vector3f Scene::MultiSample(int col, int row, Camera* cam){
+Vector3f Scene::SampleRange(int col, int row, Camera* cam, SamplerContext& sampler, int firstSample, int count,
+		int totalSamples){
+    // A single sample goes through the pixel center, as in a fixed spp render.
+    if (totalSamples == 1){
+        return SingleSample(col, row, cam, sampler);
+    }
+
+    Vector3f lbCorner = cam->PixelLBCorner(row, col);
+    Vector3f color = {0,0,0};
+    for (int i = firstSample; i < firstSample + count; i++){
+        sampler.StartSample(i, totalSamples);
+        color += TraceSample(col, row, cam, lbCorner, sampler);
+    }
+
+    return color;
+}
+
+Vector3f Scene::TraceSample(int col, int row, Camera* cam, Vector3f& lbCorner, SamplerContext& sampler){
+    Ray sampleRay = cam->getSampleRay(lbCorner, sampler);
+    ReturnVal nearestRet = BVHMethods::FindIntersection(sampleRay, topLevel);
+
+    // If any intersection happened, compute shading.
+    if (nearestRet.full)
+    {
+        return Shading(sampleRay, nearestRet, materials[nearestRet.matIndex - 1], sampler);
+    }
+
+    // Else paint with background color.
+    return GetBackgroundColor(row, col, cam, sampleRay);
+}
+
+Vector3f Scene::MultiSample(int col, int row, Camera* cam, SamplerContext& sampler, int& samplesTaken){
     Vector3f lbCorner = cam->PixelLBCorner(row, col);
     Vector3f color = {0,0,0};
-    ReturnVal nearestRet;
-    Ray sampleRay(0);
 
     int sampleCount = cam->GetTotalSampleCount();
-    for (int i = 0; i < sampleCount; i++){
-        sampleRay = cam->getSampleRay(lbCorner, i);
-        nearestRet = BVHMethods::FindIntersection(sampleRay, objects, instances);
-
-        // If any intersection happened, compute shading.
-        if (nearestRet.full)
-        {
-            color += Shading(sampleRay, nearestRet, materials[nearestRet.matIndex - 1]);
+    if (!cam->adaptive.enabled){
+        for (int i = 0; i < sampleCount; i++){
+            sampler.StartSample(i, sampleCount);
+            color += TraceSample(col, row, cam, lbCorner, sampler);
         }
-            // Else paint with background color.
-        else
-        {
-            color += GetBackgroundColor(row, col, cam, sampleRay);
+
+        samplesTaken = sampleCount;
+        return color / sampleCount;
+    }
+
+    // Adaptive sampling: after the minimum count, stop once the standard error of the
+    // mean luminance falls below the threshold relative to the mean. NumSamples is the cap.
+    int minSamples = std::max(2, std::min(cam->adaptive.minSamples, sampleCount));
+    float mean = 0;
+    float squaredDeviations = 0;
+    int i = 0;
+    while (i < sampleCount){
+        sampler.StartSample(i, sampleCount);
+        Vector3f sample = TraceSample(col, row, cam, lbCorner, sampler);
+        color += sample;
+        i++;
+
+        // Welford's running mean and variance.
+        float luminance = 0.2126f * sample[0] + 0.7152f * sample[1] + 0.0722f * sample[2];
+        float delta = luminance - mean;
+        mean += delta / i;
+        squaredDeviations += delta * (luminance - mean);
+
+        if (i >= minSamples){
+            float standardError = std::sqrt(squaredDeviations / ((i - 1) * i));
+            if (standardError <= cam->adaptive.threshold * std::max(mean, 1.0f)){
+                break;
+            }
         }
     }
 
-    color = color / sampleCount;
-    return color;
+    samplesTaken = i;
+    return color / i;
 }
 
 Vector3f Scene::GetBackgroundColor(int row, int col, Camera* cam, const Ray &ray){
@@ -462,6 +2153,16 @@ Scene::Scene(const char* xmlPath)
 
     std::cout << "Parsing scene attributes." << std::endl;
     Parser::ParseSceneAttributes(pRoot, maxRecursionDepth, backgroundColor, shadowRayEps, intTestEps);
+    Parser::ParseRenderSettings(pRoot, tileSize, tileOrder, threadCount, pinThreads, deterministic, seed,
+            concurrentCameras, samplerType);
+    Parser::ParseProgressive(pRoot, progressive, timeBudget, snapshotInterval, targetSamples);
+    Parser::ParseLightSampling(pRoot, lightSampling, shadowRayBudget);
+    Parser::ParseIntegrator(pRoot, integrator, rouletteDepth, stochasticDielectrics, pruneThreshold);
+    Parser::ParseWavefront(pRoot, wavefront, wavefrontBatch, reorderRays);
+    Parser::ParsePacketTraversal(pRoot, packetTraversal);
+    Parser::ParseOccluderCache(pRoot, occluderCache);
+    Parser::ParseCaustics(pRoot, causticPhotons, photonRadius);
+    Parser::ParseIrradianceCache(pRoot, useIrradianceCache, cacheTolerance, cacheSamples);
 
     std::cout << "Parsing cameras." << std::endl;
 	Parser::ParseCameras(pRoot, cameras);
@@ -484,10 +2185,11 @@ Scene::Scene(const char* xmlPath)
     Parser::ParseTextureCoordinates(pRoot, textureCoordinates);
 
     std::cout << "Parsing objects." << std::endl;
-	Parser::ParseObjects(pRoot, xmlPath, objects, instances, vertices, textureCoordinates);
+	Parser::ParseObjects(pRoot, xmlPath, objects, groups, instances, vertices, textureCoordinates);
 
     std::cout << "Parsing lights." << std::endl;
 	Parser::ParseLights(pRoot, ambientLight, lights, images, environmentLightIndex);
+	Parser::ParseLightObjects(pRoot, xmlPath, objects, lights, materials, vertices, textureCoordinates);
 
 	std::cout << "Parsing complete." << std::endl;
 
@@ -498,7 +2200,4 @@ Scene::Scene(const char* xmlPath)
 	        backgroundTexture = i;
 	    }
 	}
-
-    mt = std::mt19937 (rd());
-    dist = std::uniform_real_distribution<float>(0.0, 1.0);
 }
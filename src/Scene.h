@@ -8,6 +8,9 @@
 #include <string>
 #include <vector>
 #include <random>
+#include <atomic>
+#include <future>
+#include <chrono>
 
 #include "Ray.h"
 #include "defs.h"
@@ -15,6 +18,8 @@
 #include "Image.h"
 #include "Material.h"
 #include "Transformation.h"
+#include "Tile.h"
+#include "Sampler.h"
 
 typedef struct ShadingComponent
 {
@@ -51,18 +56,117 @@ class Perlin;
 
 class Instance;
 
+class Group;
+
+class LightSampler;
+
+class RayPacket;
+
+class PhotonMap;
+
+struct Photon;
+
+class IrradianceCache;
+
+struct IrradianceRecord;
+
+const int defaultWavefrontBatch = 1 << 16;
+
+// Samples per pixel the sample pattern is laid out for when a progressive render
+// has a time budget but no target. Its strata repeat if the render gets past it.
+const int budgetSampleBound = 1 << 12;
+
+// One ray of the wavefront pipeline and the state of the path it belongs to.
+// absorption is the coefficient of the medium the ray travels through and is
+// applied to weight once the distance from lastHit is known. pixel indexes the
+// tile buffer.
+typedef struct PathState
+{
+	Ray ray;
+	ReturnVal ret;
+	SamplerContext sampler;
+	Eigen::Vector3f weight;
+	Eigen::Vector3f absorption;
+	Eigen::Vector3f lastHit;
+	int pixel;
+	int x;
+	int y;
+	int depth;
+	bool specular;
+} PathState;
+
+// Accumulated samples of a progressive render. Each pass adds the samples
+// [firstSample, firstSample + passSamples) of every pixel it reaches.
+typedef struct ProgressiveState
+{
+	std::vector<Eigen::Vector3f> sum;
+	std::vector<int> counts;
+	int firstSample;
+	int passSamples;
+	int totalSamples;
+	bool hasDeadline;
+	std::chrono::steady_clock::time_point deadline;
+} ProgressiveState;
+
+// One camera's image while it renders. remainingPixels counts down as tiles finish.
+// Progressive jobs have a progress state and are saved by the progressive loop instead.
+typedef struct RenderJob
+{
+	Camera* cam;
+	Image* image;
+	Image* countImage;
+	ProgressiveState* progress;
+	std::atomic<int> remainingPixels;
+	std::atomic<long long> samplesTaken;
+	std::future<void> saved;
+} RenderJob;
+
 class Scene
 {
 public:
-    std::random_device rd;
-    std::mt19937 mt;
-    std::uniform_real_distribution<float> dist;
+    bool deterministic;
+    bool concurrentCameras;
+    bool progressive;
+    float timeBudget;
+    float snapshotInterval;
+    int targetSamples;
+    unsigned int seed;
+    SamplerType samplerType;
+    Sampler* pixelSampler;
+    LightSamplingMode lightSampling;
+    int shadowRayBudget;
+    LightSampler* lightSampler;
+    IntegratorType integrator;
+    int rouletteDepth;
+    bool stochasticDielectrics;
+    float pruneThreshold;
+    bool wavefront;
+    int wavefrontBatch;
+    bool reorderRays;
+    bool packetTraversal;
+    bool occluderCache;
+    std::atomic<long long> wavefrontRays;
+    std::atomic<long long> wavefrontTraceNanos;
+    std::atomic<long long> wavefrontSortNanos;
+    std::atomic<long long> wavefrontNodeVisits;
+    std::vector<int> materialRank;
+    int causticPhotons;
+    float photonRadius;
+    PhotonMap* causticMap;
+    bool useIrradianceCache;
+    float cacheTolerance;
+    int cacheSamples;
+    IrradianceCache* irradianceCache;
 
     int environmentLightIndex;
 	int maxRecursionDepth;
 	int backgroundTexture;
 	float intTestEps;
 	float shadowRayEps;
+	int tileSize;
+	TileOrder tileOrder;
+	int threadCount;
+	bool pinThreads;
 	Eigen::Vector3f backgroundColor;
 	Eigen::Vector3f ambientLight;
     Perlin* perlin;
@@ -78,7 +182,10 @@ public:
 	std::vector<Eigen::Vector3f> vertices;
 	std::vector<Eigen::Vector2f> textureCoordinates;
 	std::vector<Shape*> objects;
+	std::vector<Group*> groups;
 	std::vector<Instance*> instances;
+	Group* topLevel;
+	std::vector<Instance*> objectWrappers;
 	std::vector<Eigen::Vector3f> vertexNormals;
 	std::vector<Texture*> textures;
 
@@ -101,15 +208,93 @@ private:
 
 	Eigen::Vector3f ambient(Material* mat);
 
-	Eigen::Vector3f BasicShading(const Ray& ray, const ReturnVal& ret, Material* mat);
+	Eigen::Vector3f BasicShading(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler,
+			const int8_t* shadowed = nullptr, bool withAmbient = true);
+
+	void ThreadedRendering(std::vector<RenderJob*>& jobs, TileQueue& tileQueue, int worker);
+
+	void SaveJob(RenderJob* job);
+
+	void TraceWavefront(RenderJob* job, const Tile& tile, const std::vector<int>& rows, SamplerContext& sampler,
+			std::vector<Eigen::Vector3f>& tileBuffer, std::vector<int>& countBuffer);
+
+	void ShadeWavefrontGroup(std::vector<PathState>& queue, const int* group, int groupSize,
+			std::vector<PathState>& next, std::vector<Eigen::Vector3f>& tileBuffer);
+
+	void ShadeWhittedVertex(PathState& state, Material* mat, const int8_t* shadowed, std::vector<PathState>& next,
+			std::vector<Eigen::Vector3f>& tileBuffer);
+
+	void ShadePathVertex(PathState& state, Material* mat, const int8_t* shadowed, std::vector<PathState>& next,
+			std::vector<Eigen::Vector3f>& tileBuffer);
+
+	bool NeedsDirectLight(const PathState& state, Material* mat);
+
+	void PacketShadows(std::vector<PathState>& queue, const int* group, int groupSize, Material* mat,
+			std::vector<int8_t>& shadowed);
+
+	void TraceShadowPacket(RayPacket& packet, std::vector<int>& members, int light, int lightCount,
+			std::vector<int8_t>& shadowed);
 
-	void ThreadedRendering(int threadIndex, Image& image, Camera* cam);
+	void TracePrimaryPackets(Camera* cam, const Tile& tile, const std::vector<int>& rows, SamplerContext& sampler,
+			std::vector<Eigen::Vector3f>& tileBuffer, std::vector<int>& countBuffer);
 
-	ShadingComponent MirrorReflectance(const Ray& ray, const ReturnVal& ret, Material* mat);
+	void QueueBranch(PathState& state, Material* mat, const Ray* refracted, const Eigen::Vector3f& factor,
+			const Eigen::Vector3f& absorption, std::vector<PathState>& next);
 
-	Eigen::Vector3f RecursiveShading(const Ray& ray, const ReturnVal& ret, Material* mat, int depth);
+	void RenderTiles(std::vector<RenderJob*>& jobs, TileQueue& tileQueue, bool reportIdle);
 
-    Eigen::Vector3f Shading(const Ray& ray, const ReturnVal& ret, Material* mat);
+	void RenderProgressive(std::vector<RenderJob*>& jobs, int jobIndex, bool hasDeadline,
+			std::chrono::steady_clock::time_point deadline);
+
+	void SaveProgress(RenderJob* job, const char* imageName);
+
+	void EstimateTileCosts(std::vector<RenderJob*>& jobs, TileQueue& tileQueue);
+
+	Ray ReflectedRay(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
+
+	ShadingComponent MirrorReflectance(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
+
+	Eigen::Vector3f RecursiveShading(const Ray& ray, const ReturnVal& ret, Material* mat, int depth, SamplerContext& sampler,
+			const Eigen::Vector3f& weight);
+
+	bool KeepBranch(const Eigen::Vector3f& weight, float& scale, SamplerContext& sampler);
+
+	Eigen::Vector3f ReflectedBranch(const Ray& ray, const ReturnVal& ret, Material* mat, float factor,
+			const Eigen::Vector3f& tint, int depth, SamplerContext& sampler, const Eigen::Vector3f& weight);
+
+	Eigen::Vector3f RefractedBranch(const DielectricComponent& dc, float factor, const Eigen::Vector3f& tint, int depth,
+			SamplerContext& sampler, const Eigen::Vector3f& weight);
+
+	void DielectricBranches(const Ray& ray, const ReturnVal& ret, Material* mat, const DielectricComponent& dc,
+			const Eigen::Vector3f& reflectTint, const Eigen::Vector3f& transmitTint, int depth,
+			SamplerContext& sampler, const Eigen::Vector3f& weight, Eigen::Vector3f& transmittedColor,
+			Eigen::Vector3f& reflectedColor);
+
+	Eigen::Vector3f PathShading(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler,
+			bool gathering = false);
+
+	void PrepareIrradianceCache();
+
+	bool CachedIndirect(const Ray& ray, const ReturnVal& ret, Material* mat, Eigen::Vector3f& indirect);
+
+	void ComputeIrradiance(const Ray& ray, const ReturnVal& ret, IrradianceRecord& record);
+
+	bool ScatterPath(ShadingComponent& vertex, Eigen::Vector3f& weight, bool& specular, SamplerContext& sampler);
+
+	bool ScatterRay(const ShadingComponent& vertex, Ray& nextRay, Eigen::Vector3f& weight, Eigen::Vector3f& absorption,
+			bool& specular, SamplerContext& sampler);
+
+	Eigen::Vector3f DiffuseAlbedo(const ReturnVal& ret, Material* mat);
+
+	void BuildCausticMap();
+
+	void TracePhoton(const Ray& ray, const Eigen::Vector3f& power, SamplerContext& sampler, std::vector<Photon>& stored);
+
+	Eigen::Vector3f CausticRadiance(const Ray& ray, const ReturnVal& ret, Material* mat);
+
+    Eigen::Vector3f Shading(const Ray& ray, const ReturnVal& ret, Material* mat, SamplerContext& sampler);
+
+	Ray RefractedRay(const Ray& ray, const ReturnVal& ret, Material* mat, float& fresnel, bool& isEntering, bool& isTir);
 
 	DielectricComponent DielectricRefraction(const Ray& ray, const ReturnVal& ret, Material* mat);
 
@@ -117,11 +302,18 @@ private:
 
 	float BeerLaw(float sigma_t, float distance);
 
+	Eigen::Vector3f BeerAttenuation(const Eigen::Vector3f& sigma, float distance);
+
 	float ConductorFresnel(float n_t, float k_t, const Ray& ray, const Eigen::Vector3f& normal);
 
-    Eigen::Vector3f MultiSample(int row, int col, Camera* cam);
+    Eigen::Vector3f SampleRange(int col, int row, Camera* cam, SamplerContext& sampler, int firstSample, int count,
+            int totalSamples);
+
+    Eigen::Vector3f TraceSample(int col, int row, Camera* cam, Eigen::Vector3f& lbCorner, SamplerContext& sampler);
+
+    Eigen::Vector3f MultiSample(int row, int col, Camera* cam, SamplerContext& sampler, int& samplesTaken);
 
-    Eigen::Vector3f SingleSample(int row, int col, Camera* cam);
+    Eigen::Vector3f SingleSample(int row, int col, Camera* cam, SamplerContext& sampler);
 
 	Color RawColorToColor(Eigen::Vector3f color);
 
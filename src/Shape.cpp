@@ -5,15 +5,17 @@
 #include <limits>
 #include "Helper.h"
 #include "Perlin.h"
+#include "Packet.h"
 
 using namespace Eigen;
 
 Shape::Shape(void)
+    : motion(nullptr)
 {
 }
 
 Shape::Shape(int id, int matIndex)
-    : id(id), matIndex(matIndex)
+    : id(id), matIndex(matIndex), motion(nullptr)
 {
 }
 
@@ -22,7 +24,7 @@ Sphere::Sphere(void)
 }
 
 Sphere::Sphere(int id, int matIndex, int cIndex, float R, const std::vector<Transformation *> &transformations,
-               glm::vec3 &blurTransformation, bool isBlur)
+               MotionTrack* motion)
     : Shape(id, matIndex)
 {
     this->id = id;
@@ -30,8 +32,7 @@ Sphere::Sphere(int id, int matIndex, int cIndex, float R, const std::vector<Tran
     this->cIndex = cIndex;
     this->R = R;
     this->objTransformations = transformations;
-    this->blurTransformation = blurTransformation;
-    this->isBlur = isBlur;
+    this->motion = motion;
 }
 
 Sphere::Sphere(int id, int matIndex, int cIndex, float R)
@@ -66,12 +67,17 @@ Eigen::Vector3f Sphere::GetCenter() const
     return pScene->vertices[cIndex - 1];
 }
 
+float Sphere::GetRadius() const
+{
+    return R;
+}
+
 Triangle::Triangle(void)
 {
 }
 
 Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index, const std::vector<Transformation *> &transformations,
-                   glm::vec3 &blurTransformation, bool isBlur)
+                   MotionTrack* motion)
     : Shape(id, matIndex)
 {
     this->id = id;
@@ -80,8 +86,7 @@ Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index,
     this->p2Index = p2Index;
     this->p3Index = p3Index;
     this->objTransformations = transformations;
-    this->blurTransformation = blurTransformation;
-    this->isBlur = isBlur;
+    this->motion = motion;
 }
 
 Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index, bool isSmooth)
@@ -149,6 +154,7 @@ ReturnVal Triangle::intersect(const Ray &ray) const
         ret.normal = normal / normal.norm();
         ret.point = ray.getPoint(t);
         ret.full = true;
+        ret.primitive = this;
     }
 
     return ret;
@@ -194,15 +200,14 @@ Mesh::Mesh()
 }
 
 Mesh::Mesh(int id, int matIndex, const std::vector<Triangle *> &faces, const std::vector<Transformation *> &transformations,
-           glm::vec3 &blurTransformation, bool isBlur, bool isSmooth)
+           MotionTrack* motion, bool isSmooth)
     : Shape(id, matIndex)
 {
     this->id = id;
     this->matIndex = matIndex;
     this->faces = faces;
     this->objTransformations = transformations;
-    this->blurTransformation = blurTransformation;
-    this->isBlur = isBlur;
+    this->motion = motion;
     this->isSmooth = isSmooth;
 }
 
@@ -243,18 +248,49 @@ void Mesh::FillPrimitives(std::vector<Shape *> &primitives) const
 
 BBox Mesh::GetBoundingBox() const
 {
-    return BBox{};
+    float _max = std::numeric_limits<float>::max();
+    BBox box = {Vector3f{_max, _max, _max}, Vector3f{-_max, -_max, -_max}};
+
+    for (int i = 0; i < faces.size(); i++)
+    {
+        BBox faceBox = faces[i]->GetBoundingBox();
+        box.minPoint = box.minPoint.cwiseMin(faceBox.minPoint);
+        box.maxPoint = box.maxPoint.cwiseMax(faceBox.maxPoint);
+    }
+
+    return box;
 }
 
 Eigen::Vector3f Mesh::GetCenter() const
 {
-    return Vector3f{};
+    BBox box = GetBoundingBox();
+    return (box.minPoint + box.maxPoint) * 0.5f;
+}
+
+const std::vector<Triangle *> &Mesh::GetFaces() const
+{
+    return faces;
 }
 
 void Shape::ComputeSmoothNormals()
 {
 }
 
+// Shapes without a packet version test each active lane on its own. Returns the lanes that hit.
+uint64_t Shape::bvhPacketIntersect(const RayPacket& packet, uint64_t mask, std::vector<int>& txt, int txtOffset,
+                                   ReturnVal* results) const
+{
+    uint64_t hits = 0;
+    for (uint64_t lanes = mask; lanes; lanes &= lanes - 1){
+        int lane = Packets::FirstLane(lanes);
+        results[lane] = bvhIntersect(packet.GetRay(lane), txt, txtOffset);
+        if (results[lane].full){
+            hits |= 1ull << lane;
+        }
+    }
+    return hits;
+}
+
 void Sphere::ComputeSmoothNormals()
 {
 }
@@ -339,6 +375,7 @@ ReturnVal Triangle::bvhIntersect(const Ray &ray, std::vector<int> &txt, int txtO
         ret = TextureComputation(ret, txt, txtOffset, e1, e2, beta, gamma);
 
         ret.full = true;
+        ret.primitive = this;
     }
 
     return ret;
@@ -394,6 +431,7 @@ ReturnVal Sphere::bvhIntersect(const Ray &ray, std::vector<int> &txt, int txtOff
     ret = TextureComputation(ret, txt);
 
     ret.full = true;
+    ret.primitive = this;
     return ret;
 }
 
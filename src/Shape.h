@@ -1,6 +1,7 @@
 #ifndef _SHAPE_H_
 #define _SHAPE_H_
 
+#include <cstdint>
 #include <vector>
 #include "Ray.h"
 #include "Eigen/Dense"
@@ -13,6 +14,8 @@
 // Forward declarations to avoid cyclic references
 class BVH;
 
+class RayPacket;
+
 class Shape
 {
 public:
@@ -22,9 +25,8 @@ public:
     std::vector<int> textures;
     BVH *bvh;
 
-    bool isBlur;
     bool isSmooth;
-    glm::vec3 blurTransformation;
+    MotionTrack* motion;
 
     glm::mat4* transformationMatrix;
     glm::mat4* inverse_tMatrix;
@@ -33,6 +35,8 @@ public:
 
     virtual ReturnVal bvhIntersect(const Ray& ray, std::vector<int>& txt, int txtOffset) const = 0;
     virtual ReturnVal intersect(const Ray& ray) const = 0;
+    virtual uint64_t bvhPacketIntersect(const RayPacket& packet, uint64_t mask, std::vector<int>& txt, int txtOffset,
+                                        ReturnVal* results) const;
     virtual void FillPrimitives(std::vector<Shape*> &primitives) const = 0;
     virtual BBox GetBoundingBox() const = 0;
     virtual void ComputeSmoothNormals();
@@ -42,6 +46,8 @@ public:
 
     Shape(int id, int matIndex);
 
+    virtual ~Shape() {}
+
 private:
 
 };
@@ -52,7 +58,7 @@ public:
     Sphere(void);
 
     Sphere(int id, int matIndex, int cIndex, float R, const std::vector<Transformation*>& transformations,
-            glm::vec3 &blurTransformation, bool isBlur);
+            MotionTrack* motion);
     Sphere(int id, int matIndex, int cIndex, float R);
 
     ReturnVal bvhIntersect(const Ray& ray, std::vector<int>& txt, int txtOffset) const;
@@ -61,6 +67,7 @@ public:
 	BBox GetBoundingBox() const;
     void ComputeSmoothNormals();
 	Eigen::Vector3f GetCenter() const;
+    float GetRadius() const;
     ReturnVal TextureComputation(ReturnVal& ret, std::vector<int>& txt) const;
 
 private:
@@ -74,7 +81,7 @@ public:
     Triangle(void);
 
     Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index, const std::vector<Transformation*>& transformations,
-             glm::vec3 &blurTransformation, bool isBlur);
+             MotionTrack* motion);
     Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index, bool isSmooth);
     int GetIndexOne();
     int GetIndexTwo();
@@ -100,7 +107,7 @@ public:
     Mesh(void);
 
     Mesh(int id, int matIndex, const std::vector<Triangle*>& faces, const std::vector<Transformation*>& transformations,
-         glm::vec3 &blurTransformation, bool isBlur, bool isSmooth);
+         MotionTrack* motion, bool isSmooth);
 
     ReturnVal bvhIntersect(const Ray& ray, std::vector<int>& txt, int txtOffset) const;
     ReturnVal intersect(const Ray& ray) const;
@@ -108,6 +115,7 @@ public:
 	BBox GetBoundingBox() const;
     void ComputeSmoothNormals();
 	Eigen::Vector3f GetCenter() const;
+    const std::vector<Triangle*>& GetFaces() const;
 
 private:
     std::vector<Triangle*> faces;
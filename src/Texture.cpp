@@ -130,6 +130,14 @@ Eigen::Vector3f Texture::GetColorAtCoordinates(float u, float v) {
     }
 }
 
+int Texture::GetWidth() const {
+    return width;
+}
+
+int Texture::GetHeight() const {
+    return height;
+}
+
 bool Texture::IsPNG(const char *filename) {
     int i = 0;
     int c = 0;
@@ -17,6 +17,8 @@ public:
     Eigen::Vector3f GetColorAtPixel(int i, int j);
     Eigen::Vector2f GetChangeAtCoordinates(float u, float v);
     Eigen::Vector3f GetColorAtCoordinates(float u, float v);
+    int GetWidth() const;
+    int GetHeight() const;
 
     DecalMode decalMode;
     Interpolation interpolation;
@@ -0,0 +1,167 @@
+#include "ThreadPool.h"
+#include "Helper.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+ThreadPool::ThreadPool(int threadCount)
+{
+    StartWorkers(threadCount);
+}
+
+ThreadPool::~ThreadPool()
+{
+    StopWorkers();
+}
+
+void ThreadPool::Enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        tasks.push_back(std::move(task));
+    }
+    queueCondition.notify_one();
+}
+
+void ThreadPool::StartWorkers(int threadCount)
+{
+    if (threadCount < 1){
+        threadCount = 1;
+    }
+
+    stopping = false;
+    for (int i = 0; i < threadCount; i++){
+        workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+    }
+}
+
+void ThreadPool::StopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueCondition.notify_all();
+
+    int workerSize = workers.size();
+    for (int i = 0; i < workerSize; i++){
+        workers[i].join();
+    }
+    workers.clear();
+}
+
+void ThreadPool::WorkerLoop()
+{
+    while (true){
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCondition.wait(lock, [this](){ return stopping || !tasks.empty(); });
+
+            // Remaining tasks are still run when stopping, so no future is left unset.
+            if (tasks.empty()){
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+bool ThreadPool::RunPendingTask()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (tasks.empty()){
+            return false;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::ParallelFor(int begin, int end, const std::function<void(int)>& body, bool helping)
+{
+    if (end <= begin){
+        return;
+    }
+
+    // Workers take indices from a shared counter, so uneven items balance themselves.
+    std::atomic<int> next(begin);
+    auto loop = [&next, end, &body](){
+        for (int i = next++; i < end; i = next++){
+            body(i);
+        }
+    };
+
+    TaskGroup group(*this, helping);
+    int taskCount = std::min((int)workers.size(), end - begin);
+    if (helping){
+        taskCount--;
+    }
+    for (int i = 0; i < taskCount; i++){
+        group.Run(loop);
+    }
+    if (helping){
+        loop();
+    }
+    group.Wait();
+}
+
+void ThreadPool::Resize(int threadCount)
+{
+    if (threadCount == (int)workers.size()){
+        return;
+    }
+
+    StopWorkers();
+    StartWorkers(threadCount);
+}
+
+void ThreadPool::PinWorkers()
+{
+    int workerSize = workers.size();
+    for (int i = 0; i < workerSize; i++){
+        Threading::PinToCore(workers[i], i);
+    }
+}
+
+int ThreadPool::Size() const
+{
+    return workers.size();
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool, bool helping)
+    : pool(pool), helping(helping)
+{
+
+}
+
+TaskGroup::~TaskGroup()
+{
+    Wait();
+}
+
+void TaskGroup::Run(std::function<void()> task)
+{
+    pending.push_back(pool.Submit(std::move(task)));
+}
+
+void TaskGroup::Wait()
+{
+    int pendingSize = pending.size();
+    for (int i = 0; i < pendingSize; i++){
+        // Help with queued work instead of blocking a thread the pool may need.
+        while (pending[i].wait_for(std::chrono::seconds(0)) != std::future_status::ready){
+            if (!helping || !pool.RunPendingTask()){
+                pending[i].wait();
+            }
+        }
+        pending[i].get();
+    }
+    pending.clear();
+}
@@ -0,0 +1,80 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Process wide set of worker threads. Workers are started once and reused by
+// parsing, BVH construction, rendering and image output.
+class ThreadPool
+{
+public:
+    ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    template <class F>
+    std::future<typename std::result_of<F()>::type> Submit(F task);
+
+    // Runs body(i) for every i in [begin, end). Unless helping is false, the calling
+    // thread helps until all are done.
+    void ParallelFor(int begin, int end, const std::function<void(int)>& body, bool helping = true);
+
+    bool RunPendingTask();
+    void Resize(int threadCount);
+    void PinWorkers();
+    int Size() const;
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    bool stopping;
+
+    void Enqueue(std::function<void()> task);
+    void StartWorkers(int threadCount);
+    void StopWorkers();
+    void WorkerLoop();
+};
+
+// Tasks that are waited on together. Wait() runs queued tasks while it waits, so
+// a task may start a group of its own without starving the pool. A group that
+// does not help only blocks, which keeps render work on the pool's own, possibly
+// pinned, workers; its tasks must not wait on groups of their own.
+class TaskGroup
+{
+public:
+    TaskGroup(ThreadPool& pool, bool helping = true);
+    ~TaskGroup();
+
+    void Run(std::function<void()> task);
+    void Wait();
+
+private:
+    ThreadPool& pool;
+    bool helping;
+    std::vector<std::future<void>> pending;
+};
+
+// The global pool, created in main before the scene is loaded.
+extern ThreadPool* pPool;
+
+template <class F>
+std::future<typename std::result_of<F()>::type> ThreadPool::Submit(F task)
+{
+    typedef typename std::result_of<F()>::type Result;
+
+    // std::function needs a copyable target, so the packaged task is shared.
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    std::future<Result> result = packaged->get_future();
+    Enqueue([packaged](){ (*packaged)(); });
+    return result;
+}
+
+#endif
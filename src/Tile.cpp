@@ -0,0 +1,278 @@
+#include "Tile.h"
+#include <algorithm>
+#include <cstdint>
+
+namespace {
+    // Layout of WorkerSlot::rows: the generation in the upper bits, then the
+    // next row and the end row. Images may be up to 2^20 rows high.
+    const int rowBits = 20;
+    const uint64_t rowMask = (1u << rowBits) - 1;
+
+    uint64_t PackRows(uint64_t generation, uint32_t nextRow, uint32_t endRow){
+        return (generation << (2 * rowBits)) | ((uint64_t)nextRow << rowBits) | endRow;
+    }
+
+    uint64_t Generation(uint64_t rows){
+        return rows >> (2 * rowBits);
+    }
+
+    uint32_t NextRowOf(uint64_t rows){
+        return (rows >> rowBits) & rowMask;
+    }
+
+    uint32_t EndRowOf(uint64_t rows){
+        return rows & rowMask;
+    }
+
+    // Interleaves the lower 16 bits of x and y.
+    uint32_t MortonCode(uint32_t x, uint32_t y){
+        uint32_t code = 0;
+        for (int i = 0; i < 16; i++){
+            code |= ((x >> i) & 1u) << (2 * i);
+            code |= ((y >> i) & 1u) << (2 * i + 1);
+        }
+        return code;
+    }
+}
+
+TileQueue::TileQueue()
+    : next(0)
+{
+
+}
+
+TileQueue::TileQueue(int width, int height, int tileSize, TileOrder order)
+    : next(0)
+{
+    Append(width, height, tileSize, order, 0);
+}
+
+void TileQueue::Append(int width, int height, int tileSize, TileOrder order, int job)
+{
+    if (tileSize < 1){
+        tileSize = defaultTileSize;
+    }
+
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    std::vector<Tile> imageTiles;
+    for (int ty = 0; ty < tilesY; ty++){
+        for (int tx = 0; tx < tilesX; tx++){
+            Tile tile;
+            tile.x0 = tx * tileSize;
+            tile.y0 = ty * tileSize;
+            tile.x1 = std::min(tile.x0 + tileSize, width);
+            tile.y1 = std::min(tile.y0 + tileSize, height);
+            tile.job = job;
+            imageTiles.push_back(tile);
+        }
+    }
+
+    // Cost order starts from Morton order; SortByCost reorders once the costs are known.
+    if (order == MortonOrder || order == CostOrder){
+        MortonSort(imageTiles, tilesX, tilesY);
+    }
+    else if (order == SpiralOrder){
+        SpiralSort(imageTiles, tilesX, tilesY);
+    }
+
+    tiles.insert(tiles.end(), imageTiles.begin(), imageTiles.end());
+}
+
+void TileQueue::SortByCost(const std::vector<float>& costs)
+{
+    // Most expensive tiles go first, so the cheap ones fill the gaps at the end.
+    int tileCount = tiles.size();
+    std::vector<int> order(tileCount);
+    for (int i = 0; i < tileCount; i++){
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&costs](int a, int b){ return costs[a] > costs[b]; });
+
+    std::vector<Tile> sorted(tileCount);
+    for (int i = 0; i < tileCount; i++){
+        sorted[i] = tiles[order[i]];
+    }
+    tiles = sorted;
+}
+
+Tile TileQueue::GetTile(int index) const
+{
+    return tiles[index];
+}
+
+int TileQueue::Size() const
+{
+    return tiles.size();
+}
+
+void TileQueue::Reset()
+{
+    // Hands out the same tiles again, for another pass over the image.
+    next = 0;
+}
+
+void TileQueue::PrepareWorkers(int workerCount)
+{
+    slots = std::vector<WorkerSlot>(workerCount);
+    for (int i = 0; i < workerCount; i++){
+        slots[i].rows = 0;
+        slots[i].x0 = 0;
+        slots[i].x1 = 0;
+        slots[i].job = 0;
+    }
+}
+
+bool TileQueue::Next(int worker, Tile& tile)
+{
+    int index = next.fetch_add(1, std::memory_order_relaxed);
+    if (index < (int)tiles.size()){
+        tile = tiles[index];
+        Publish(worker, tile);
+        return true;
+    }
+
+    return Steal(worker, tile);
+}
+
+bool TileQueue::NextRow(int worker, int& row)
+{
+    WorkerSlot& slot = slots[worker];
+    uint64_t rows = slot.rows.load(std::memory_order_acquire);
+    while (true){
+        uint32_t nextRow = NextRowOf(rows);
+        uint32_t endRow = EndRowOf(rows);
+        if (nextRow >= endRow){
+            return false;
+        }
+
+        uint64_t claimed = PackRows(Generation(rows), nextRow + 1, endRow);
+        if (slot.rows.compare_exchange_weak(rows, claimed, std::memory_order_acq_rel)){
+            row = nextRow;
+            return true;
+        }
+    }
+}
+
+void TileQueue::Publish(int worker, const Tile& tile)
+{
+    // Only the owner publishes, and thieves keep the generation, so it can be
+    // read without a loop. The slot is emptied under the new generation before
+    // the tile changes, as in a seqlock: a thief that reads the new x0, x1 or
+    // job then fails its exchange against the old rows.
+    WorkerSlot& slot = slots[worker];
+    uint64_t generation = Generation(slot.rows.load(std::memory_order_relaxed)) + 1;
+    slot.rows.store(PackRows(generation, 0, 0), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.x0.store(tile.x0, std::memory_order_relaxed);
+    slot.x1.store(tile.x1, std::memory_order_relaxed);
+    slot.job.store(tile.job, std::memory_order_relaxed);
+    slot.rows.store(PackRows(generation, tile.y0, tile.y1), std::memory_order_release);
+}
+
+bool TileQueue::Steal(int worker, Tile& tile)
+{
+    int slotSize = slots.size();
+    while (true){
+        // Pick the worker with the most rows left.
+        int victim = -1;
+        uint64_t victimRows = 0;
+        uint32_t mostRows = 1;
+        for (int i = 0; i < slotSize; i++){
+            if (i == worker){
+                continue;
+            }
+
+            uint64_t rows = slots[i].rows.load(std::memory_order_acquire);
+            uint32_t left = EndRowOf(rows) - std::min(NextRowOf(rows), EndRowOf(rows));
+            if (left > mostRows){
+                mostRows = left;
+                victim = i;
+                victimRows = rows;
+            }
+        }
+
+        // Nothing left that is worth splitting.
+        if (victim == -1){
+            return false;
+        }
+
+        // These may already belong to a newer tile of the victim. Publish then
+        // changed the generation first, so the exchange below fails and the
+        // thief looks again.
+        WorkerSlot& slot = slots[victim];
+        int x0 = slot.x0.load(std::memory_order_relaxed);
+        int x1 = slot.x1.load(std::memory_order_relaxed);
+        int job = slot.job.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        uint32_t nextRow = NextRowOf(victimRows);
+        uint32_t endRow = EndRowOf(victimRows);
+        uint32_t splitRow = nextRow + (endRow - nextRow + 1) / 2;
+        uint64_t kept = PackRows(Generation(victimRows), nextRow, splitRow);
+        if (slot.rows.compare_exchange_strong(victimRows, kept, std::memory_order_acq_rel)){
+            tile.x0 = x0;
+            tile.x1 = x1;
+            tile.y0 = splitRow;
+            tile.y1 = endRow;
+            tile.job = job;
+            Publish(worker, tile);
+            return true;
+        }
+    }
+}
+
+void TileQueue::MortonSort(std::vector<Tile>& imageTiles, int tilesX, int)
+{
+    // Tiles are still in scanline order here, so the tile coordinates follow from the index.
+    int tileCount = imageTiles.size();
+    std::vector<std::pair<uint32_t, int>> keys(tileCount);
+    for (int i = 0; i < tileCount; i++){
+        keys[i] = {MortonCode(i % tilesX, i / tilesX), i};
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<Tile> sorted(tileCount);
+    for (int i = 0; i < tileCount; i++){
+        sorted[i] = imageTiles[keys[i].second];
+    }
+    imageTiles = sorted;
+}
+
+void TileQueue::SpiralSort(std::vector<Tile>& imageTiles, int tilesX, int tilesY)
+{
+    // Walk outwards from the center tile, so the middle of the image finishes first.
+    int tileCount = imageTiles.size();
+    std::vector<Tile> sorted;
+    sorted.reserve(tileCount);
+
+    int x = (tilesX - 1) / 2;
+    int y = (tilesY - 1) / 2;
+    int dx = 1, dy = 0;
+    int legLength = 1;
+    int legsDone = 0;
+    int stepsInLeg = 0;
+
+    while ((int)sorted.size() < tileCount){
+        if (x >= 0 && x < tilesX && y >= 0 && y < tilesY){
+            sorted.push_back(imageTiles[y * tilesX + x]);
+        }
+
+        x += dx;
+        y += dy;
+        stepsInLeg++;
+        if (stepsInLeg == legLength){
+            stepsInLeg = 0;
+            int temp = dx;
+            dx = -dy;
+            dy = temp;
+            legsDone++;
+            if (legsDone % 2 == 0){
+                legLength++;
+            }
+        }
+    }
+    imageTiles = sorted;
+}
@@ -0,0 +1,67 @@
+#ifndef _TILE_H_
+#define _TILE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "defs.h"
+
+const int defaultTileSize = 16;
+
+// Pixel rectangle [x0, x1) x [y0, y1) rendered as one unit of work.
+typedef struct Tile
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    int job;
+} Tile;
+
+// Rows of the tile a worker is rendering. The next row to render and the end
+// row share one word, so the owner taking a row and a thief cutting off the
+// end can never both get the same row. The word also counts the tiles the slot
+// has published, so a thief can not cut rows off a newer tile that happens to
+// cover the same rows as the one it read x0, x1 and job of.
+typedef struct WorkerSlot
+{
+    std::atomic<uint64_t> rows;
+    std::atomic<int> x0;
+    std::atomic<int> x1;
+    std::atomic<int> job;
+    char padding[44];
+} WorkerSlot;
+
+// Images split into tiles that render threads pull from until it is empty.
+// Tiles of several images can share one queue; each tile remembers its job.
+// Tiles are appended before rendering starts; taking one is a single atomic increment.
+// Once the queue is empty, idle workers steal the lower half of the rows a busy worker has left.
+class TileQueue
+{
+public:
+    TileQueue();
+    TileQueue(int width, int height, int tileSize, TileOrder order);
+
+    void Append(int width, int height, int tileSize, TileOrder order, int job);
+    void SortByCost(const std::vector<float>& costs);
+    Tile GetTile(int index) const;
+    int Size() const;
+    void Reset();
+
+    void PrepareWorkers(int workerCount);
+    bool Next(int worker, Tile& tile);
+    bool NextRow(int worker, int& row);
+
+private:
+    std::vector<Tile> tiles;
+    std::atomic<int> next;
+    std::vector<WorkerSlot> slots;
+
+    void Publish(int worker, const Tile& tile);
+    bool Steal(int worker, Tile& tile);
+
+    void MortonSort(std::vector<Tile>& imageTiles, int tilesX, int tilesY);
+    void SpiralSort(std::vector<Tile>& imageTiles, int tilesX, int tilesY);
+};
+
+#endif
@@ -1,4 +1,7 @@
 #include "Transformation.h"
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 Transformation::Transformation(void)
 {
@@ -8,4 +11,101 @@ Transformation::Transformation(int id, TransformationType type){
     this->id = id;
     this->type = type;
     this->angle = 0;
-}
\ No newline at end of file
+}
+
+MotionTrack::MotionTrack(const std::vector<Keyframe>& keyframes){
+    this->keyframes = keyframes;
+    std::sort(this->keyframes.begin(), this->keyframes.end(),
+            [](const Keyframe& a, const Keyframe& b){ return a.time < b.time; });
+}
+
+Keyframe MotionTrack::Interpolate(float time) const {
+    int keySize = keyframes.size();
+    if (time <= keyframes[0].time){
+        return keyframes[0];
+    }
+    if (time >= keyframes[keySize-1].time){
+        return keyframes[keySize-1];
+    }
+
+    int i = 0;
+    while (keyframes[i+1].time < time){
+        i++;
+    }
+
+    const Keyframe& k0 = keyframes[i];
+    const Keyframe& k1 = keyframes[i+1];
+    float u = (time - k0.time) / (k1.time - k0.time);
+
+    Keyframe key;
+    key.time = time;
+    key.translation = glm::mix(k0.translation, k1.translation, u);
+    key.scale = glm::mix(k0.scale, k1.scale, u);
+    key.rotation = glm::slerp(k0.rotation, k1.rotation, u);
+    return key;
+}
+
+glm::mat4 MotionTrack::Evaluate(float time) const {
+    Keyframe key = Interpolate(time);
+    glm::mat4 m = glm::translate(glm::mat4(1.0), key.translation);
+    m = m * glm::mat4_cast(key.rotation);
+    return glm::scale(m, key.scale);
+}
+
+glm::mat4 MotionTrack::EvaluateInverse(float time) const {
+    // Inverse of T * R * S is S^-1 * R^T * T^-1, no general inverse needed.
+    Keyframe key = Interpolate(time);
+    glm::vec3 inverseScale = {1.0f / key.scale[0], 1.0f / key.scale[1], 1.0f / key.scale[2]};
+    glm::mat4 m = glm::scale(glm::mat4(1.0), inverseScale);
+    m = m * glm::mat4_cast(glm::conjugate(key.rotation));
+    return glm::translate(m, -key.translation);
+}
+
+BBox MotionTrack::ComputeBounds(const BBox& localBox, const glm::mat4& model) const {
+    // Every segment between keyframes is sampled. Samples cover translation and
+    // scale exactly, the arc a rotation sweeps between two samples is covered by padding.
+    const int segmentSamples = 16;
+    float _max = std::numeric_limits<float>::max();
+    Eigen::Vector3f minPoint = {_max, _max, _max};
+    Eigen::Vector3f maxPoint = {-_max, -_max, -_max};
+    float maxRadius = 0;
+    float maxStepAngle = 0;
+
+    std::vector<float> times;
+    int keySize = keyframes.size();
+    times.push_back(keyframes[0].time);
+    for (int i = 0; i + 1 < keySize; i++){
+        for (int s = 1; s <= segmentSamples; s++){
+            float u = (float)s / segmentSamples;
+            times.push_back(keyframes[i].time + (keyframes[i+1].time - keyframes[i].time) * u);
+        }
+    }
+
+    glm::quat previousRotation = keyframes[0].rotation;
+    int timeSize = times.size();
+    for (int i = 0; i < timeSize; i++){
+        Keyframe key = Interpolate(times[i]);
+        glm::mat4 m = Evaluate(times[i]) * model;
+
+        float cosHalf = std::min(1.0f, std::abs(glm::dot(previousRotation, key.rotation)));
+        maxStepAngle = std::max(maxStepAngle, 2.0f * std::acos(cosHalf));
+        previousRotation = key.rotation;
+
+        for (int c = 0; c < 8; c++){
+            glm::vec4 corner = {(c & 1) ? localBox.maxPoint[0] : localBox.minPoint[0],
+                                (c & 2) ? localBox.maxPoint[1] : localBox.minPoint[1],
+                                (c & 4) ? localBox.maxPoint[2] : localBox.minPoint[2], 1};
+            glm::vec4 p = m * corner;
+            Eigen::Vector3f point = {p[0], p[1], p[2]};
+            minPoint = minPoint.cwiseMin(point);
+            maxPoint = maxPoint.cwiseMax(point);
+
+            Eigen::Vector3f pivot = {key.translation[0], key.translation[1], key.translation[2]};
+            maxRadius = std::max(maxRadius, (point - pivot).norm());
+        }
+    }
+
+    float pad = maxRadius * (1.0f - std::cos(maxStepAngle * 0.5f));
+    Eigen::Vector3f padding = {pad, pad, pad};
+    return BBox{minPoint - padding, maxPoint + padding};
+}
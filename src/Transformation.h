@@ -1,8 +1,11 @@
 #ifndef _TRANSFORMATION_H_
 #define _TRANSFORMATION_H_
 
+#include <vector>
 #include "Eigen/Dense"
 #include "glm/gtx/string_cast.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "defs.h"
 
 enum TransformationType{None, Translation, Scaling, Rotation, Composite};
 
@@ -19,4 +22,28 @@ public:
     Transformation(int id, TransformationType type);
 };
 
+typedef struct Keyframe
+{
+    float time;
+    glm::vec3 translation;
+    glm::quat rotation;
+    glm::vec3 scale;
+} Keyframe;
+
+// Keyframed motion applied on top of the static transformation of an object or
+// instance. Translation and scale are interpolated linearly, rotation with slerp.
+class MotionTrack{
+public:
+    std::vector<Keyframe> keyframes;
+
+    MotionTrack(const std::vector<Keyframe>& keyframes);
+
+    glm::mat4 Evaluate(float time) const;
+    glm::mat4 EvaluateInverse(float time) const;
+    BBox ComputeBounds(const BBox& localBox, const glm::mat4& model) const;
+
+private:
+    Keyframe Interpolate(float time) const;
+};
+
 #endif
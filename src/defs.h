@@ -4,11 +4,16 @@
 #include "Eigen/Dense"
 
 class Scene;
+class Shape;
+class Instance;
 
 enum DecalMode{ReplaceKd, BlendKd, BumpNormal, ReplaceNormal, ReplaceAll, ReplaceBackground, NoDecal};
 enum Interpolation{NN, Bilinear};
 enum TextureType{ImageTexture, PerlinTexture};
 enum NoiseConversion{Absval, NCLinear, NoConversion};
+enum TileOrder{MortonOrder, SpiralOrder, ScanlineOrder, CostOrder};
+enum LightSamplingMode{AllLights, PowerLightSampling, TreeLightSampling};
+enum IntegratorType{WhittedIntegrator, PathIntegrator};
 
 typedef struct ReturnVal
 {
@@ -16,9 +21,14 @@ typedef struct ReturnVal
     Eigen::Vector3f normal;
     bool full = false;
     int matIndex;
-    DecalMode dm;
+    DecalMode dm = NoDecal;
     Eigen::Vector3f textureColor;
     float textureNormalizer;
+    // Leaf primitive that was hit and the outermost instance above it, so the
+    // same primitive can be tested again. instanceDepth counts the instances.
+    const Shape* primitive = nullptr;
+    const Instance* instance = nullptr;
+    int instanceDepth = 0;
 } ReturnVal;
 
 typedef struct BBox
@@ -1,15 +1,263 @@
 #include "defs.h"
 #include "Scene.h"
 #include "BVH.h"
+#include "ThreadPool.h"
+#include "Helper.h"
+#include "LightSampler.h"
+#include <cstring>
 
 Scene* pScene; // definition of the global scene variable (declared in defs.h)
+ThreadPool* pPool; // definition of the global worker pool (declared in ThreadPool.h)
 
 int main(int argc, char* argv[])
 {
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " scene.xml [--threads N] [--pin] [--deterministic] [--seed N]\n"
+				  << "    [--concurrent-cameras] [--sampler random|halton|sobol|cmj]\n"
+				  << "    [--time-budget S] [--target-spp N] [--snapshot-interval S]\n"
+				  << "    [--light-sampling all|power|tree] [--shadow-rays N] [--integrator whitted|path]\n"
+				  << "    [--stochastic-dielectrics] [--prune-threshold W] [--wavefront] [--wavefront-batch N]\n"
+				  << "    [--no-ray-reorder] [--packets] [--caustic-photons N] [--photon-radius R]\n"
+				  << "    [--irradiance-cache] [--cache-tolerance A] [--no-occluder-cache]" << std::endl;
+		return 1;
+	}
+
 	const char* xmlPath = argv[1];
+
+	int threadCount = -1;
+	bool pinThreads = false;
+	bool deterministic = false;
+	bool hasSeed = false;
+	bool concurrentCameras = false;
+	bool hasSampler = false;
+	SamplerType samplerType = RandomSamplerType;
+	float timeBudget = -1;
+	float snapshotInterval = -1;
+	int targetSamples = -1;
+	bool hasLightSampling = false;
+	LightSamplingMode lightSampling = AllLights;
+	int shadowRayBudget = -1;
+	bool hasIntegrator = false;
+	IntegratorType integrator = WhittedIntegrator;
+	bool stochasticDielectrics = false;
+	float pruneThreshold = -1;
+	bool wavefront = false;
+	int wavefrontBatch = -1;
+	bool noRayReorder = false;
+	bool noOccluderCache = false;
+	bool packetTraversal = false;
+	int causticPhotons = -1;
+	float photonRadius = -1;
+	bool irradianceCache = false;
+	float cacheTolerance = -1;
+	unsigned int seed = 0;
+	for (int i = 2; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) && i + 1 < argc)
+		{
+			threadCount = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--pin") == 0)
+		{
+			pinThreads = true;
+		}
+		else if (strcmp(argv[i], "--deterministic") == 0)
+		{
+			deterministic = true;
+		}
+		else if (strcmp(argv[i], "--concurrent-cameras") == 0)
+		{
+			concurrentCameras = true;
+		}
+		else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc)
+		{
+			hasSampler = Sampling::ParseSamplerType(argv[++i], samplerType);
+			if (!hasSampler)
+			{
+				std::cerr << "Unknown sampler " << argv[i] << "." << std::endl;
+			}
+		}
+		else if (strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc)
+		{
+			timeBudget = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc)
+		{
+			snapshotInterval = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--target-spp") == 0 && i + 1 < argc)
+		{
+			targetSamples = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--light-sampling") == 0 && i + 1 < argc)
+		{
+			hasLightSampling = LightSampling::ParseLightSamplingMode(argv[++i], lightSampling);
+			if (!hasLightSampling)
+			{
+				std::cerr << "Unknown light sampling mode " << argv[i] << "." << std::endl;
+			}
+		}
+		else if (strcmp(argv[i], "--shadow-rays") == 0 && i + 1 < argc)
+		{
+			shadowRayBudget = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc)
+		{
+			hasIntegrator = Parser::ParseIntegratorType(argv[++i], integrator);
+			if (!hasIntegrator)
+			{
+				std::cerr << "Unknown integrator " << argv[i] << "." << std::endl;
+			}
+		}
+		else if (strcmp(argv[i], "--stochastic-dielectrics") == 0)
+		{
+			stochasticDielectrics = true;
+		}
+		else if (strcmp(argv[i], "--prune-threshold") == 0 && i + 1 < argc)
+		{
+			pruneThreshold = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--wavefront") == 0)
+		{
+			wavefront = true;
+		}
+		else if (strcmp(argv[i], "--wavefront-batch") == 0 && i + 1 < argc)
+		{
+			wavefrontBatch = atoi(argv[++i]);
+			wavefront = true;
+		}
+		else if (strcmp(argv[i], "--no-ray-reorder") == 0)
+		{
+			noRayReorder = true;
+		}
+		else if (strcmp(argv[i], "--no-occluder-cache") == 0)
+		{
+			noOccluderCache = true;
+		}
+		else if (strcmp(argv[i], "--packets") == 0)
+		{
+			packetTraversal = true;
+		}
+		else if (strcmp(argv[i], "--caustic-photons") == 0 && i + 1 < argc)
+		{
+			causticPhotons = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--photon-radius") == 0 && i + 1 < argc)
+		{
+			photonRadius = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--irradiance-cache") == 0)
+		{
+			irradianceCache = true;
+		}
+		else if (strcmp(argv[i], "--cache-tolerance") == 0 && i + 1 < argc)
+		{
+			cacheTolerance = atof(argv[++i]);
+			irradianceCache = true;
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+		{
+			seed = strtoul(argv[++i], nullptr, 10);
+			hasSeed = true;
+		}
+		else
+		{
+			std::cerr << "Unknown option " << argv[i] << "." << std::endl;
+		}
+	}
+
+	// The pool already serves scene loading, before the scene's own settings are known.
+	pPool = new ThreadPool(Threading::ResolveThreadCount(threadCount));
 	pScene = new Scene(xmlPath);
 
+	// Command line options override the settings in the scene file.
+	if (threadCount != -1)
+	{
+		pScene->threadCount = threadCount;
+	}
+	pScene->pinThreads = pScene->pinThreads || pinThreads;
+	pScene->deterministic = pScene->deterministic || deterministic || hasSeed;
+	pScene->concurrentCameras = pScene->concurrentCameras || concurrentCameras;
+	if (hasSampler)
+	{
+		pScene->samplerType = samplerType;
+	}
+
+	// Any progressive option turns on progressive rendering.
+	if (timeBudget >= 0)
+	{
+		pScene->timeBudget = timeBudget;
+		pScene->progressive = true;
+	}
+	if (snapshotInterval >= 0)
+	{
+		pScene->snapshotInterval = snapshotInterval;
+		pScene->progressive = true;
+	}
+	if (targetSamples >= 0)
+	{
+		pScene->targetSamples = targetSamples;
+		pScene->progressive = true;
+	}
+	if (hasSeed)
+	{
+		pScene->seed = seed;
+	}
+	if (hasLightSampling)
+	{
+		pScene->lightSampling = lightSampling;
+	}
+	if (shadowRayBudget > 0)
+	{
+		pScene->shadowRayBudget = shadowRayBudget;
+	}
+	if (hasIntegrator)
+	{
+		pScene->integrator = integrator;
+	}
+	if (stochasticDielectrics)
+	{
+		pScene->stochasticDielectrics = true;
+	}
+	if (pruneThreshold >= 0)
+	{
+		pScene->pruneThreshold = pruneThreshold;
+	}
+	pScene->wavefront = pScene->wavefront || wavefront;
+	if (wavefrontBatch > 0)
+	{
+		pScene->wavefrontBatch = wavefrontBatch;
+	}
+	if (noRayReorder)
+	{
+		pScene->reorderRays = false;
+	}
+	pScene->packetTraversal = pScene->packetTraversal || packetTraversal;
+	if (noOccluderCache)
+	{
+		pScene->occluderCache = false;
+	}
+	if (causticPhotons >= 0)
+	{
+		pScene->causticPhotons = causticPhotons;
+	}
+	if (photonRadius > 0)
+	{
+		pScene->photonRadius = photonRadius;
+	}
+	pScene->useIrradianceCache = pScene->useIrradianceCache || irradianceCache;
+	if (cacheTolerance > 0)
+	{
+		pScene->cacheTolerance = cacheTolerance;
+	}
+
+	pPool->Resize(Threading::ResolveThreadCount(pScene->threadCount));
+	if (pScene->pinThreads)
+	{
+		pPool->PinWorkers();
+	}
+
 	pScene->renderScene();
 	return 0;
 }
-